@@ -54,6 +54,16 @@
 // Linking: -lX11 -lXext -lasound -lpthread -lm
 //
 //
+// Building (Headless)
+// -------------------
+// #define MO_HEADLESS before #including this file (in every translation unit) to build without a window.
+// mo_present() will write to an in-memory 32-bit surface instead (see pPresentBufferHeadless), and
+// mo_run() will just step and present until mo_close() is called. This is useful for bots, automated
+// testing and benchmarking. X11 is not used at all in this mode so there's no need to link to it.
+//
+// Linking (Linux): -lasound -lpthread -lm
+//
+//
 //
 // NOTES
 // =====
@@ -83,11 +93,14 @@ extern "C" {
 #endif
 
 #ifdef _WIN32
-#define MO_WIN32
 #include <windows.h>
+#ifndef MO_HEADLESS
+#define MO_WIN32
+#endif
 #else
-#define MO_X11
 #define MO_POSIX
+#ifndef MO_HEADLESS
+#define MO_X11
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <X11/Xatom.h>
@@ -96,6 +109,7 @@ extern "C" {
 #include <X11/XKBlib.h>
 #include <X11/extensions/XShm.h>
 #endif
+#endif
 
 // External library support.
 #ifdef STBI_INCLUDE_STB_IMAGE_H
@@ -187,6 +201,15 @@ typedef void* mal_ptr;
     } mal_event;
 #endif
 
+#ifdef MAL_WIN32
+    #define MAL_THREADCALL WINAPI
+    typedef unsigned long mal_thread_result;
+#else
+    #define MAL_THREADCALL
+    typedef void* mal_thread_result;
+#endif
+typedef mal_thread_result (MAL_THREADCALL * mal_thread_entry_proc)(void* pData);
+
 #ifdef MAL_ENABLE_DSOUND
     #define MAL_MAX_PERIODS_DSOUND    4
 #endif
@@ -381,6 +404,19 @@ mal_uint32 mal_device_get_available_rewind_amount(mal_device* pDevice);
 mal_uint32 mal_device_rewind(mal_device* pDevice, mal_uint32 framesToRewind);
 mal_uint32 mal_device_get_buffer_size_in_bytes(mal_device* pDevice);
 mal_uint32 mal_get_sample_size_in_bytes(mal_format format);
+
+// Threading primitives. These are used internally by mini_al, but are also useful for the host application.
+mal_bool32 mal_thread_create(mal_thread* pThread, mal_thread_entry_proc entryProc, void* pData);
+void mal_thread_wait(mal_thread* pThread);
+void mal_sleep(mal_uint32 milliseconds);
+mal_bool32 mal_mutex_create(mal_mutex* pMutex);
+void mal_mutex_delete(mal_mutex* pMutex);
+void mal_mutex_lock(mal_mutex* pMutex);
+void mal_mutex_unlock(mal_mutex* pMutex);
+mal_bool32 mal_event_create(mal_event* pEvent);
+void mal_event_delete(mal_event* pEvent);
+mal_bool32 mal_event_wait(mal_event* pEvent);
+mal_bool32 mal_event_signal(mal_event* pEvent);
 #endif
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -390,6 +426,12 @@ mal_uint32 mal_get_sample_size_in_bytes(mal_format format);
 
 
 #define MO_GLYPH_SIZE               9
+#define MO_MAX_PRESENT_THREADS      16
+#define MO_MAX_IMAGE_THREADS        16
+#define MO_DIRTY_TILE_SIZE          16
+#define MO_RESAMPLER_TAPS           8   // The number of source frames each output frame is filtered from with mo_resampler_polyphase.
+#define MO_DEFAULT_MAX_SOUNDS       256 // The default for profile.maxSounds.
+#define MO_DEFAULT_DECODE_AHEAD_MILLISECONDS    250 // The default for profile.audioDecodeAheadMilliseconds.
 
 typedef int mo_result;
 #define MO_SUCCESS                   0
@@ -403,6 +445,7 @@ typedef int mo_result;
 #define MO_UNSUPPORTED_AUDIO_FORMAT -8
 #define MO_FAILED_TO_INIT_AUDIO     -9
 #define MO_BAD_PROFILE              -10
+#define MO_TOO_MANY_SOUNDS          -11 // Every sound is in use and none of them could be stolen.
 
 typedef unsigned int mo_event_type;
 #define MO_EVENT_TYPE_KEY_DOWN      1
@@ -481,6 +524,7 @@ typedef mo_uint8            mo_color_index;
 
 typedef struct mo_context mo_context;
 typedef struct mo_sound_source mo_sound_source;
+typedef struct mo_file_mapping mo_file_mapping;
 typedef struct mo_sound_group mo_sound_group;
 typedef struct mo_sound mo_sound;
 
@@ -495,9 +539,33 @@ typedef enum
 {
     mo_sound_source_type_raw,
     mo_sound_source_type_vorbis,
-    mo_sound_source_type_flac
+    mo_sound_source_type_flac,
+    mo_sound_source_type_stream
 } mo_sound_source_type;
 
+typedef enum
+{
+    mo_resampler_linear = 0,    // Cheap, but dulls high frequencies and lets some aliasing through.
+    mo_resampler_polyphase      // A windowed sinc filter. Costs about 4 times as much as linear.
+} mo_resampler;
+
+// The sound that's stopped to make room for a new one when profile.maxSounds has been reached. Only sounds started
+// with mo_play_sound_source() are ever stolen, and those that have already finished are always taken first.
+typedef enum
+{
+    mo_sound_steal_policy_oldest = 0,       // The sound that was started the longest time ago.
+    mo_sound_steal_policy_quietest,         // The sound with the lowest volume, including it's group's volume.
+    mo_sound_steal_policy_lowest_priority   // The sound with the lowest priority, oldest first. Sounds with a higher priority than the new one are never stolen.
+} mo_sound_steal_policy;
+
+// How RGBA colors are dithered when they're converted to palette indices by mo_image_create() and mo_image_load().
+typedef enum
+{
+    mo_dither_mode_none = 0,            // Each pixel is given the closest color.
+    mo_dither_mode_ordered,             // An 8x8 Bayer pattern. Stable and tiles well, so good for animated or scrolling images.
+    mo_dither_mode_floyd_steinberg      // Error diffusion. Best for gradients and photographic images.
+} mo_dither_mode;
+
 #ifdef _MSC_VER
     #pragma warning(push)
     #pragma warning(disable:4201)
@@ -534,19 +602,51 @@ typedef struct
     mo_color_rgba palette[256]; // Palette colors.
     mo_uint32 audioChannels;    // The number of channels to use for audio. TODO: Implement me. Requires changes to mixing.
     mo_uint32 audioSampleRate;  // The sample rate to use for audio.
+    mo_uint32 presentThreadCount;   // The number of threads to use when scaling the screen for presentation, including the main thread. 0 or 1 for single-threaded. Maximum of MO_MAX_PRESENT_THREADS. Ignored on Win32.
+    mo_bool32 asyncPresent;     // When set, each frame is presented on a separate thread while the next one is being stepped.
+    mo_bool32 diffPresent;      // When set, the screen is compared against the previously presented frame and only the regions that have actually changed are presented.
+    mo_bool32 dirtyPresent;     // When set, only the regions touched by the drawing APIs and mo_invalidate() are presented. Direct writes to pContext->screen must then be reported with mo_invalidate(). When neither this nor diffPresent is set the whole screen is presented every time.
+    mo_uint32 targetStepRate;   // The number of steps per second mo_run() sleeps to maintain. 0 (the default) runs as fast as possible.
+    mo_bool32 fixedTimestep;    // When set with targetStepRate, onStep is always passed a dt of exactly 1/targetStepRate. Multiple steps are run in a frame to catch up when running behind.
+    mo_resampler audioResampler;    // The resampler used for sounds whose sample rate is different to the device's. Defaults to mo_resampler_linear.
+    mo_bool32 audioPreResample; // When set, raw sound sources are resampled to the device's sample rate when they're created rather than while they're being mixed.
+    mo_uint32 maxSounds;        // The maximum number of sounds that can exist at the same time. Memory for them is allocated up front. Defaults to MO_DEFAULT_MAX_SOUNDS.
+    mo_sound_steal_policy soundStealPolicy; // How to make room for a new sound when maxSounds has been reached.
+    mo_uint32 audioDecodeOnLoadMilliseconds;    // Vorbis and FLAC sources no longer than this are decoded in full when they're created so they cost the same to play as a WAV. 0 (the default) disables this.
+    mo_dither_mode imageDitherMode; // How RGBA images are dithered when converted to palette indices. Defaults to mo_dither_mode_none. This can be changed in pContext->profile at any time to use a different mode for different images.
+    mo_uint32 imageThreadCount; // The number of threads to use when converting large RGBA images to palette indices in mo_image_create(), including the calling thread. 0 or 1 for single-threaded. Maximum of MO_MAX_IMAGE_THREADS.
+    mo_uint32 audioDecodeAheadMilliseconds; // How far ahead of playback Vorbis and FLAC sounds are decoded on a background thread. Rounded up to a power of 2 in frames. Defaults to MO_DEFAULT_DECODE_AHEAD_MILLISECONDS.
 } mo_profile;
 
+// A run of opaque pixels in a row of an image.
+typedef struct
+{
+    mo_uint16 x;
+    mo_uint16 length;
+} mo_image_span;
+
 typedef struct
 {
     mo_uint32 width;
     mo_uint32 height;
     mo_image_format format;
-    mo_uint8 pData[1];
+    mo_uint8* pData;                // Can be modified, but call mo_image_update() afterwards so the spans below are rebuilt. Read-only while pFileMapping is set.
+    mo_file_mapping* pFileMapping;  // Set when pData points into a memory mapped .moimage file rather than memory owned by the image.
+    mo_uint8* pWritableData;        // Set when the data of a mapped image has been copied with mo_image_make_writable().
+
+    // The runs of opaque pixels in each row, in order. These are built when the image is created or updated so that
+    // unscaled drawing can copy a run at a time. The spans of row y are pSpans[pRowSpans[y]] up to pSpans[pRowSpans[y+1]]. Both
+    // are null when the image is too wide, or when it's broken up by transparency so much that runs aren't worth it.
+    mo_uint32* pRowSpans;
+    mo_image_span* pSpans;
+    mo_color_index spanTransparentColorIndex;   // The transparent color index the spans were built with.
 } mo_image;
 
 struct mo_sound_source
 {
+    mo_context* pContext;
     mo_sound_source_type type;
+    mo_file_mapping* pFileMapping;  // Set when the sample data of a raw source points into a memory mapped WAV file.
     union
     {
         struct
@@ -554,20 +654,32 @@ struct mo_sound_source
             mo_uint32 channels;
             mo_uint32 sampleRate;
             mo_uint64 sampleCount;
-            mo_int16 pSampleData[1];
+            const mo_int16* pSampleData;
         } raw;
 
         struct
         {
+            mo_uint32 channels;
+            mo_uint32 sampleRate;
             size_t dataSize;
             mo_uint8 pData[1];
         } vorbis;
 
         struct
         {
+            mo_uint32 channels;
+            mo_uint32 sampleRate;
             size_t dataSize;
             mo_uint8 pData[1];
         } flac;
+
+        struct
+        {
+            mo_uint32 channels;
+            mo_uint32 sampleRate;
+            mo_sound_source_type decoderType;   // mo_sound_source_type_vorbis or mo_sound_source_type_flac.
+            char filePath[1];
+        } stream;
     };
 };
 
@@ -578,9 +690,48 @@ struct mo_sound
     mo_uint32 group;
     float linearVolume;
     float pan;
+    float pitch;
     mo_uint32 flags;
     mo_bool32 isMarkedForDeletion;
 
+    // Pooling. soundIndex is the sound's position in the context's list of live sounds so it can be removed in
+    // constant time, and serial increases with each sound that's created which is used to find the oldest when
+    // stealing. pNextFreeSound links sounds in the pool that aren't in use.
+    mo_uint32 soundIndex;
+    mo_uint32 serial;
+    mo_uint32 priority;
+    mo_sound* pNextFreeSound;
+
+    // The ID of the most recent call to mo_sound_play(). The audio thread sets finishedPlayID to this when the sound
+    // reaches the end which is how the game thread knows the sound has stopped. isRetired is set by the audio thread
+    // when it has let go of a deleted sound, after which it's safe to free.
+    mo_uint32 playID;
+    volatile mo_uint32 finishedPlayID;
+    volatile mo_uint32 isRetired;
+
+    // The audio thread's copy of the sound's state. This is only ever touched by the audio thread and is updated with
+    // commands posted by the game thread. Playing sounds are kept in a linked list which is owned by the mixer.
+    mo_sound* pNextVoice;
+    mo_sound* pPrevVoice;
+    mo_uint32 mixerFlags;
+    mo_uint32 mixerPlayID;
+    float mixerLinearVolume;
+    float mixerPanGainL;
+    float mixerPanGainR;
+    float mixerPitch;
+    mo_bool32 isInMixer;
+
+    // Resampling, for when the source's sample rate is different to the device's or the pitch has been changed. The
+    // step is the number of source frames to advance for each output frame, and the position is where the next output
+    // frame is taken from relative to the start of the history. Both are 32.32 fixed point. The history holds the last
+    // few source frames that were read, in the device's channel layout, so the filter can look back past the start of
+    // each chunk. Once a voice starts resampling it keeps doing so until it's restarted, even if the step goes back to
+    // 1, because switching back would skip the frames that are sitting in the history.
+    mo_uint64 mixerResamplerStep;
+    mo_bool32 isMixerResampling;
+    mo_uint64 resamplerPos;
+    float resamplerHistory[MO_RESAMPLER_TAPS * 2];
+
     // Streaming.
     union
     {
@@ -591,16 +742,28 @@ struct mo_sound
 
         struct
         {
-            mo_uint64 currentSample;
-            /*stb_vorbis**/ void* pDecoder;
-        } vorbis;
-
-        struct
-        {
-            mo_uint64 currentSample;
-            /*drflac**/ void* pDecoder;
-        } flac;
+            /*stb_vorbis* or drflac**/ void* pDecoder;
+            mo_sound_source_type type;  // mo_sound_source_type_vorbis or mo_sound_source_type_flac.
+            mo_uint32 channels;
+            mo_uint32 sampleRate;
+        } decoder;
     };
+
+    // Sounds with a compressed source (Vorbis, FLAC or a stream) are decoded ahead of time into a ring buffer of 16-bit
+    // frames in the source's channel layout. The decoder belongs to the streaming thread which opens it and does the
+    // first fill, after which it sets isStreamReady. isStreamFilling is set while the streaming thread is working on
+    // the sound so that it isn't released out from under it. The indices are in frames. underrunCount is incremented
+    // by the audio thread each time it finds the buffer empty before the end.
+    mo_int16* pStreamBuffer;
+    mo_uint32 streamBufferSizeInFrames;
+    volatile mo_uint32 streamWriteIndex;
+    volatile mo_uint32 streamReadIndex;
+    volatile mo_uint32 isStreamAtEnd;
+    volatile mo_uint32 isStreamLooping;
+    volatile mo_uint32 isStreamReady;
+    volatile mo_uint32 isStreamFilling;
+    volatile mo_uint32 underrunCount;
+    mo_uint32 streamIndex;
 };
 
 struct mo_sound_group
@@ -615,6 +778,22 @@ typedef struct
     int64_t counter;
 } mo_timer;
 
+// Input statistics. Latency is the time between the window system timestamping an input event and the end of the
+// present of the frame that was stepped after it was received (or the hand-off to the presentation thread when
+// profile.asyncPresent is set). The window system's clock is not directly comparable
+// to ours so the offset between them is estimated from the quickest event seen so far. This means the numbers are
+// estimates and are only accurate relative to each other.
+typedef struct
+{
+    mo_uint64 inputEventCount;      // The total number of input events received.
+    mo_uint64 eventCount;           // The total number of window events of any kind that have been processed.
+    mo_uint32 lastEventsPerFrame;   // The number of window events processed at the start of the most recent frame.
+    mo_uint32 maxEventsPerFrame;
+    double lastInputLatency;        // In seconds.
+    double maxInputLatency;
+    double averageInputLatency;
+} mo_input_stats;
+
 // Initializes a high-resolution timer.
 void mo_timer_init(mo_timer* pTimer);
 
@@ -627,6 +806,65 @@ double mo_timer_tick(mo_timer* pTimer);
 typedef void (* mo_on_step_proc)(mo_context* pContext, double dt);
 typedef void (* mo_on_log_proc) (mo_context* pContext, const char* message);
 
+// A worker thread for presenting the screen. Each worker converts and scales a band of rows of the presentation
+// buffer while the main thread does the last band itself.
+typedef struct
+{
+    mo_context* pContext;
+    mal_thread thread;
+    mal_event wakeupEvent;
+    mal_event doneEvent;
+    mo_bool32 isTerminating;
+    mo_uint32* pRowBuffer;  // Scratch space for one expanded row of the virtual screen.
+
+    // The job. These are set by the main thread before waking up the worker.
+    const mo_color_index* pScreen;
+    const mo_color_rgba* pPalette;
+    mo_uint32* pDst;
+    const mo_uint32* pColumnMap;
+    mo_uint32 dstSizeX;
+    mo_uint32 dstSizeY;
+    mo_uint32 rowBeg;
+    mo_uint32 rowEnd;
+} mo_present_worker;
+
+// Commands posted from the game thread to the audio thread. The audio thread never touches state owned by the game
+// thread and vice versa. Everything goes through these.
+#define MO_AUDIO_COMMAND_QUEUE_SIZE 1024    // Must be a power of 2.
+#define MO_MIX_BUS_SIZE_IN_SAMPLES  4096    // The size of the floating point buffer sounds are mixed into, in samples.
+#define MO_STREAM_THREAD_INTERVAL           0.01    // The longest the streaming thread waits between topping up the ring buffers, in seconds.
+#define MO_RESAMPLER_PHASE_BITS     6
+#define MO_RESAMPLER_PHASES         (1 << MO_RESAMPLER_PHASE_BITS)
+#define MO_RESAMPLER_UNITY_STEP     ((mo_uint64)1 << 32)
+#define MO_RESAMPLER_MAX_STEP       ((mo_uint64)16 << 32)  // Source frames consumed per output frame is capped at this.
+#define MO_MAX_PITCH                16.0f                   // mo_sound_set_pitch() clamps to this. Anything higher hits MO_RESAMPLER_MAX_STEP anyway.
+#define MO_RESAMPLER_WINDOW_SIZE_IN_FRAMES  1024
+
+typedef enum
+{
+    mo_audio_command_type_play,
+    mo_audio_command_type_stop,
+    mo_audio_command_type_set_volume,
+    mo_audio_command_type_set_pan,
+    mo_audio_command_type_set_pitch,
+    mo_audio_command_type_delete,
+    mo_audio_command_type_group_pause,
+    mo_audio_command_type_group_resume,
+    mo_audio_command_type_group_set_volume
+} mo_audio_command_type;
+
+typedef struct
+{
+    mo_audio_command_type type;
+    mo_sound* pSound;
+    mo_uint32 group;
+    mo_uint32 playID;
+    mo_bool32 loop;
+    float linearVolume;
+    float pan;
+    float pitch;
+} mo_audio_command;
+
 struct mo_context
 {
     mo_on_step_proc onStep;
@@ -641,6 +879,57 @@ struct mo_context
     // an index into the palette.
     mo_color_index* screen;
 
+    // The lookup used by mo_find_closest_color(). RGB space is split into a 32x64x32 grid of cells (the top bits of
+    // each channel, like RGB565) and each cell lists, in index order, the palette entries that could be the closest
+    // match for any color inside it. Most cells only have one. The entries of a cell start at pColorCubeOffsets[cell]
+    // and end at pColorCubeOffsets[cell+1]. This is only built once enough colors have been looked up to pay for
+    // building it (see MO_COLOR_CUBE_SEARCHES_PER_ENTRY). When it's null the whole palette is searched instead.
+    mo_uint32* pColorCubeOffsets;
+    mo_color_index* pColorCubeEntries;
+
+    // The palette, palette size and transparent color index that the color cube and search arrays were built from.
+    // These can all be changed by the application at any time. Comparing them against the profile is too slow to do
+    // for every lookup, so paletteGeneration is incremented whenever the palette is known to have changed and the
+    // lookups are rebuilt when it's different to lookupPaletteGeneration. Direct changes to the profile are found by
+    // comparing once per frame and once per image conversion.
+    mo_color_rgba lookupPalette[256];
+    mo_uint32 lookupPaletteSize;
+    mo_uint32 lookupTransparentColorIndex;
+    mo_bool32 isLookupBuilt;
+    mo_uint32 paletteGeneration;
+    mo_uint32 lookupPaletteGeneration;
+
+    // The number of colors looked up since the lookups were built. Used for deciding when to build the color cube.
+    mo_uint64 lookupSearchCount;
+
+    // The palette split into separate channels for searching it with SIMD when there's no color cube. The transparent
+    // color and the entries past the end of the palette are placed far away from every real color so they're never
+    // the closest. paletteSearchCount is the palette size rounded up to a multiple of 8.
+    float paletteSearchR[256];
+    float paletteSearchG[256];
+    float paletteSearchB[256];
+    mo_uint32 paletteSearchCount;
+
+    // Dirty tile tracking. The virtual screen is split into MO_DIRTY_TILE_SIZE x MO_DIRTY_TILE_SIZE tiles and
+    // each drawing routine marks the tiles it touches. Only dirty tiles are converted and sent to the window
+    // when presenting. A non-zero byte means the tile is dirty. Unless profile.dirtyPresent or profile.diffPresent
+    // is set every tile is marked dirty before presenting.
+    mo_uint8* pDirtyTiles;
+    mo_uint32 dirtyTileCountX;
+    mo_uint32 dirtyTileCountY;
+
+    // The palette as of the last present. Changing a palette entry changes every pixel using it, so the whole screen
+    // is presented whenever the palette is different to this. That way the palette can still be changed in place. This
+    // is also the palette the screen is presented with, which means the asynchronous presentation thread never reads
+    // profile.palette while the game thread could be changing it.
+    mo_color_rgba prevPresentPalette[256];
+
+    // Frame diffing (profile.diffPresent). This is a copy of the screen as of the last present. When diffing is
+    // enabled the dirty tiles are replaced with the tiles that are actually different to this copy. Set
+    // isFullPresentPending when the presentation buffer needs to be completely refreshed regardless.
+    mo_color_index* pPrevPresentScreen;
+    mo_bool32 isFullPresentPending;
+
     // Button state. A set bit means the key is down.
     unsigned int buttonState;
     unsigned int buttonPressState;
@@ -652,6 +941,31 @@ struct mo_context
     // Timer.
     mo_timer timer;
 
+    // The number of frames that finished after their deadline when pacing with profile.targetStepRate.
+    mo_uint64 missedDeadlineCount;
+
+    // Input statistics. Input times are in seconds relative to inputTimer which is never ticked.
+    mo_input_stats inputStats;
+    mo_timer inputTimer;
+    double inputClockOffset;            // Estimated offset between the window system's event clock and inputTimer.
+    double oldestPendingInputTime;      // Time of the oldest input event not yet seen by a presented frame.
+    double inputLatencySum;
+    mo_uint64 inputLatencyCount;
+    mo_uint32 eventsThisFrame;
+    mo_bool32 hasInputClockOffset;
+    mo_bool32 hasPendingInput;
+
+    // Window changes are coalesced while draining the event queue and then applied once per frame.
+    mo_uint32 pendingWindowSizeX;
+    mo_uint32 pendingWindowSizeY;
+    mo_bool32 isResizePending;
+    mo_bool32 isExposePending;
+
+#ifdef _WIN32
+    // winmm.dll is loaded dynamically for timeBeginPeriod() so that Sleep() is accurate enough for frame pacing.
+    HMODULE hWinMM;
+#endif
+
     // Boolean flags;
     mo_uint32 flags;
 
@@ -672,6 +986,26 @@ struct mo_context
     XImage* pPresentBufferX11;
     XShmSegmentInfo shmInfo;    // Only used if MIT-SHM is supported.
 #endif
+#if defined(MO_X11) || defined(MO_HEADLESS)
+    // Maps each column of the presentation buffer to a column of the virtual screen. This is only used for
+    // non-integer scales and is rebuilt whenever the width of the presentation buffer changes.
+    mo_uint32* pPresentColumnMap;
+    mo_uint32 presentColumnMapSize;
+
+    // Scratch space for one expanded row of the virtual screen when presenting with scaling. Used by the main thread
+    // only. Each worker has its own.
+    mo_uint32* pPresentRowBuffer;
+
+    // Worker threads for presentation. The main thread takes a share of the work as well, so there's one less of
+    // these than profile.presentThreadCount.
+    mo_present_worker presentWorkers[MO_MAX_PRESENT_THREADS-1];
+    mo_uint32 presentWorkerCount;
+#endif
+#ifdef MO_HEADLESS
+    mo_uint32* pPresentBufferHeadless;  // The surface mo_present() writes to. Same 32-bit format as mo_color_rgba.
+    mo_uint32 presentBufferWidthHeadless;
+    mo_uint32 presentBufferHeightHeadless;
+#endif
 
     // Audio
 #ifdef MO_ENABLE_DSOUND
@@ -690,17 +1024,72 @@ struct mo_context
     // Sound groups. There's a fixed number of groups, and they are referenced with an index.
     mo_sound_group soundGroups[MO_SOUND_GROUP_COUNT];
 
-    // TODO: Improve memory management for sounds.
-    //
-    // Sounds. This is just a basic realloc()'ed array of mo_sound* pointers.
+    // Sounds. These are allocated from a pool with twice profile.maxSounds slots so that there's always room for a
+    // new sound while deleted ones are waiting to be retired by the audio thread. Unused slots are kept in a free
+    // list. ppSounds holds the live sounds and has room for profile.maxSounds. ppRetiringSounds holds the deleted
+    // ones and is the same size as the pool. This is only accessed by the game thread. The audio thread has it's own
+    // list of playing sounds (pFirstVoice).
+    mo_sound* pSoundPool;
+    mo_sound* pFirstFreeSound;
+    mo_uint32 soundPoolSize;
+    mo_uint32 nextSoundSerial;
     mo_sound** ppSounds;
     mo_uint32 soundCount;
-    mo_uint32 soundBufferSize;
+
+    // Sounds that have been deleted but can't be released until the audio thread has let go of them.
+    mo_sound** ppRetiringSounds;
+    mo_uint32 retiringSoundCount;
+
+    // The number of inlined sounds (mo_play_sound_source()) which need to be deleted when they finish playing.
+    mo_uint32 inlinedSoundCount;
+
+    // Sounds with a compressed source are kept topped up by streamThread. The list is shared with the streaming thread
+    // and is protected by streamLock, which is only held while the list is being read or changed, never while
+    // decoding. The thread wakes up often enough to go around several times in the time it takes to play through a
+    // buffer, and straight away when streamWakeupEvent is signaled for a new sound.
+    mo_sound** ppStreamingSounds;
+    mo_uint32 streamingSoundCount;
+    mal_thread streamThread;
+    mal_mutex streamLock;
+    mal_event streamWakeupEvent;
+    double streamThreadInterval;
+    volatile mo_uint32 isStreamThreadTerminating;
+    mo_bool32 hasStreamThread;
+
+    // The total number of times the audio thread has found a sound's decoded audio had run out before the end.
+    volatile mo_uint32 audioUnderrunCount;
+
+    // The command queue from the game thread to the audio thread. This is a single-producer, single-consumer lock-
+    // free ring buffer. The indices are free running and are masked when indexing into the buffer. The write index
+    // is only written by the game thread and the read index is only written by the audio thread.
+    mo_audio_command audioCommands[MO_AUDIO_COMMAND_QUEUE_SIZE];
+    volatile mo_uint32 audioCommandWriteIndex;
+    volatile mo_uint32 audioCommandReadIndex;
+
+    // State owned by the audio thread.
+    mo_sound* pFirstVoice;
+    mo_sound_group mixerSoundGroups[MO_SOUND_GROUP_COUNT];
+    float mixBus[MO_MIX_BUS_SIZE_IN_SAMPLES];
+    float resamplerWindow[MO_RESAMPLER_WINDOW_SIZE_IN_FRAMES * 2];
+
+    // The polyphase filter. There's one extra row so the coefficients can be interpolated between phases. This is
+    // built when the context is initialized and never changes.
+    float resamplerCoefficients[MO_RESAMPLER_PHASES + 1][MO_RESAMPLER_TAPS];
 
     // Keeps track of whether or not there is at least one sound needing to be deleted at the end
     // of the next step. This is used for garbage collection of sounds.
     mo_bool32 isSoundMarkedForDeletion;
 
+    // Asynchronous presentation (profile.asyncPresent). At the end of each step the virtual screen is copied to
+    // pAsyncPresentScreen which is then presented on asyncPresentThread while the next frame is being stepped.
+    mo_color_index* pAsyncPresentScreen;
+    mo_uint8* pAsyncPresentDirtyTiles;
+    mal_thread asyncPresentThread;
+    mal_event asyncPresentWakeupEvent;
+    mal_event asyncPresentDoneEvent;
+    mo_bool32 isAsyncPresentBusy;
+    mo_bool32 isAsyncPresentTerminating;
+
 
 
     // Dynamically sized data.
@@ -719,6 +1108,14 @@ int mo_run(mo_context* pContext);
 // Exits the game's main loop. This does not uninitialize the context.
 void mo_close(mo_context* pContext);
 
+// Retrieves the number of frames that finished after their deadline. This is only tracked when profile.targetStepRate
+// is set.
+mo_uint64 mo_get_missed_deadline_count(mo_context* pContext);
+
+// Retrieves the number of times a Vorbis or FLAC sound ran out of decoded audio before the background thread could
+// catch up. Each one is a gap of silence. Increase profile.audioDecodeAheadMilliseconds if this keeps going up.
+mo_uint32 mo_get_audio_underrun_count(mo_context* pContext);
+
 // Posts a log message.
 void mo_log(mo_context* pContext, const char* message);
 void mo_logf(mo_context* pContext, const char* format, ...);
@@ -727,6 +1124,10 @@ void mo_logf(mo_context* pContext, const char* format, ...);
 //// Resources ////
 
 // Creates an image from raw image data.
+//
+// The image's data is in pImage->pData as one palette index per pixel and can be drawn into directly, but
+// mo_image_update() must be called once the changes are done. Unscaled drawing copies runs of opaque pixels which are
+// worked out ahead of time, and those runs are only rebuilt by mo_image_update().
 mo_result mo_image_create(mo_context* pContext, unsigned int width, unsigned int height, mo_image_format format, const void* pData, mo_image** ppImage);
 
 // Loads an image. The image can be unloaded with mo_delete_image().
@@ -735,15 +1136,41 @@ mo_result mo_image_load(mo_context* pContext, const char* filePath, mo_image** p
 // Deletes an image.
 void mo_image_delete(mo_context* pContext, mo_image* pImage);
 
+// Gives an image its own copy of its data so that it can be modified. Images loaded from .moimage files point straight
+// into the file which is mapped read-only where possible, so writing to them can crash. Does nothing for other images.
+mo_result mo_image_make_writable(mo_context* pContext, mo_image* pImage);
+
+// Lets the library know that the image's data has been modified. This must be called after writing to pImage->pData
+// and before the image is next drawn. Until then, pixels that have been made transparent are still drawn (using the
+// transparent color index) and pixels that have been made opaque may not be drawn at all.
+void mo_image_update(mo_context* pContext, mo_image* pImage);
+
 
 //// Drawing ////
 
 // Finds the color index for the given RGBA color code.
+//
+// Changes made with mo_set_palette() are used straight away. Changes made directly to profile.palette, paletteSize or
+// transparentColorIndex are picked up the next time the screen is presented or an image is created, or straight away
+// by calling mo_invalidate_palette().
 mo_color_index mo_find_closest_color(mo_context* pContext, mo_color_rgba color);
 
+// Replaces the palette. The transparent color index stays the same and must be less than paletteSize. The whole
+// screen is presented again the next time mo_present() is called.
+mo_result mo_set_palette(mo_context* pContext, mo_uint32 paletteSize, const mo_color_rgba* pPalette);
+
+// Lets the library know that profile.palette, paletteSize or transparentColorIndex have been changed directly so that
+// mo_find_closest_color() uses the new palette straight away. This isn't needed after mo_set_palette().
+void mo_invalidate_palette(mo_context* pContext);
+
 // Clears the screen.
 void mo_clear(mo_context* pContext, mo_color_index colorIndex);
 
+// Marks a region of the screen as changed so that it's updated the next time the screen is presented. The
+// drawing APIs do this automatically. You only need to call this if you write to pContext->screen directly and
+// profile.dirtyPresent is set.
+void mo_invalidate(mo_context* pContext, int posX, int posY, int sizeX, int sizeY);
+
 // Draws a quad.
 void mo_draw_quad(mo_context* pContext, int posX, int posY, int sizeX, int sizeY, mo_color_index colorIndex);
 
@@ -761,13 +1188,25 @@ void mo_draw_image_scaled(mo_context* pContext, int dstX, int dstY, int dstWidth
 //// Audio ////
 
 // Creates a sound source. When a sound is played, you pass in a reference to this source.
+//
+// The sample rate does not need to match the device. The sound is resampled while it's being mixed, or once here when
+// profile.audioPreResample is set.
 mo_result mo_sound_source_create(mo_context* pContext, unsigned int channels, unsigned int sampleRate, mo_uint64 sampleCount, const mo_int16* pSampleData, mo_sound_source** ppSource);
+
+// Creates a sound source from a Vorbis or FLAC file in memory. The data is copied. Sounds that are no longer than
+// profile.audioDecodeOnLoadMilliseconds are decoded here and become raw sources, which saves decoding them every time
+// they're played. mo_sound_source_load() does the same.
 mo_result mo_sound_source_create_vorbis(mo_context* pContext, size_t dataSize, const void* pData, mo_sound_source** ppSource);
 mo_result mo_sound_source_create_flac(mo_context* pContext, size_t dataSize, const void* pData, mo_sound_source** ppSource);
 
 // Loads a sound source from a file.
 mo_result mo_sound_source_load(mo_context* pContext, const char* filePath, mo_sound_source** ppSource);
 
+// Opens a Vorbis or FLAC file as a streaming sound source. Rather than loading the whole file, each sound created from
+// the source opens the file itself and is decoded a little at a time on a background thread. Use this for long music
+// tracks. The file must remain accessible for as long as the source exists.
+mo_result mo_sound_source_open_stream(mo_context* pContext, const char* filePath, mo_sound_source** ppSource);
+
 // Deletes a sound source.
 void mo_sound_source_delete(mo_sound_source* pSource);
 
@@ -775,6 +1214,10 @@ void mo_sound_source_delete(mo_sound_source* pSource);
 // finished playing. The sound does not loop.
 mo_result mo_play_sound_source(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group);
 
+// The same as mo_play_sound_source(), but with a priority for use with mo_sound_steal_policy_lowest_priority. Sounds
+// played with mo_play_sound_source() have a priority of 0.
+mo_result mo_play_sound_source_with_priority(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group, mo_uint32 priority);
+
 
 // Pauses playback of all sounds in the given sound group.
 void mo_sound_group_pause(mo_context* pContext, mo_uint32 group);
@@ -808,6 +1251,21 @@ void mo_sound_mark_for_deletion(mo_sound* pSound);
 // Sets the volume of the given sound. The volume is linear.
 void mo_sound_set_volume(mo_sound* pSound, float linearVolume);
 
+// Sets the pan of the given sound, between -1 (left) and 1 (right). 0 is the center. Panning uses constant power so a sound
+// being moved across the stereo field doesn't dip in loudness in the middle. This has no effect on a mono device.
+void mo_sound_set_pan(mo_sound* pSound, float pan);
+
+// Sets the pitch of the given sound as a multiplier of its playback rate. 1 is the natural pitch, 2 is an octave up and
+// 0.5 is an octave down. This also changes the speed. The pitch is clamped to between 0.001 and 16, with NaN being
+// treated as 0.001, and the rate the source is stepped through is capped at 16 times the device's sample rate.
+//
+// Neither resampler filters out the frequencies that are too high for the output when a sound is played faster than the
+// device's sample rate, whether that's from raising the pitch or from the source having a higher sample rate than the
+// device. Those frequencies alias, which sounds like harsh, inharmonic noise on bright sounds, and gets worse the
+// further the rate is raised. mo_resampler_polyphase handles small increases better than mo_resampler_linear. For
+// large increases it's better to author the sound at the higher pitch.
+void mo_sound_set_pitch(mo_sound* pSound, float pitch);
+
 // Plays the given sound.
 void mo_sound_play(mo_sound* pSound, mo_bool32 loop);
 
@@ -820,6 +1278,9 @@ mo_bool32 mo_sound_is_playing(mo_sound* pSound);
 // Determines whether or not the given sound is looping.
 mo_bool32 mo_sound_is_looping(mo_sound* pSound);
 
+// Retrieves the number of times the given sound ran out of decoded audio. This is always 0 for sounds with a raw source.
+mo_uint32 mo_sound_get_underrun_count(mo_sound* pSound);
+
 
 
 //// Input ////
@@ -839,6 +1300,9 @@ mo_bool32 mo_was_button_pressed(mo_context* pContext, unsigned int button);
 // Determines if a button has just been released.
 mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button);
 
+// Retrieves input statistics. See mo_input_stats.
+void mo_get_input_stats(mo_context* pContext, mo_input_stats* pStats);
+
 
 //// Misc ////
 #define mo_degrees(radians) ((radians) * 57.29577951308232087685f)
@@ -858,6 +1322,7 @@ mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button);
 #include <assert.h>
 #include <stdio.h>  // Required for printf() and family which is used in mo_logf().
 #include <stdarg.h> // va_list, va_start, va_arg, va_end
+#include <math.h>   // sin() and cos() for building the resampling filter.
 
 // Standard library functions.
 #ifndef mo_zero_memory
@@ -919,7 +1384,7 @@ mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button);
 #endif
 #endif
 
-#ifdef MO_X11
+#ifdef MO_POSIX
 #include <stdlib.h>
 #include <string.h> // For memset()
 #include <float.h>  // <-- What's this one for?
@@ -927,6 +1392,8 @@ mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button);
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #endif
 
 // Atomics.
@@ -938,8 +1405,65 @@ mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button);
 #define mo_atomic_decrement(a) __sync_sub_and_fetch(a, 1)
 #endif
 
+// Loads with acquire semantics and stores with release semantics. Used for passing data between threads without locks.
+#if defined(_WIN32) && defined(_MSC_VER) && !defined(__clang__)
+static mo_uint32 mo_atomic_load_u32(volatile mo_uint32* p)
+{
+    mo_uint32 value = *p;
+    MemoryBarrier();
+    return value;
+}
+
+static void mo_atomic_store_u32(volatile mo_uint32* p, mo_uint32 value)
+{
+    MemoryBarrier();
+    *p = value;
+}
+#else
+#define mo_atomic_load_u32(p)           __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mo_atomic_store_u32(p, value)   __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#endif
+
+// SIMD. AVX2 is detected at run time so it can be used without needing to compile the whole program with -mavx2. Define
+// MO_NO_AVX2 to disable it.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386) || defined(_M_IX86)
+#define MO_X86
+#endif
+
+#if !defined(MO_NO_AVX2) && defined(MO_X86)
+    #if defined(_MSC_VER) && _MSC_VER >= 1700 && !defined(__clang__)
+        #define MO_SUPPORT_AVX2
+        #define MO_AVX2_FUNCTION
+    #elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+        #define MO_SUPPORT_AVX2
+        #define MO_AVX2_FUNCTION __attribute__((target("avx2")))
+    #endif
+#endif
+
+#ifdef MO_SUPPORT_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// SSE2 and NEON are only used when they're enabled at compile time. Define MO_NO_SSE2 or MO_NO_NEON to disable them.
+#if !defined(MO_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MO_SUPPORT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if !defined(MO_NO_NEON) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define MO_SUPPORT_NEON
+#include <arm_neon.h>
+#endif
+
 #define MO_FLAG_CLOSING                     (1 << 0)
 #define MO_FLAG_X11_USING_SHM               (1 << 1)
+#define MO_FLAG_HAS_AVX2                    (1 << 2)
+#define MO_FLAG_ASYNC_PRESENT_THREAD        (1 << 3)    // Set when the asynchronous presentation thread has been created.
+
+#define MO_MAX_CATCH_UP_STEPS               8           // The maximum number of fixed timesteps to run in a single frame.
 
 #define MO_SOUND_GROUP_FLAG_PAUSED          (1 << 0)
 
@@ -974,7 +1498,197 @@ static inline float mo_clampf(float a, float lo, float hi)
     return (a > hi) ? hi : ((a < lo) ? lo : a);
 }
 
-#ifdef MO_WIN32
+
+#ifdef MO_SUPPORT_AVX2
+static void mo_cpuid(int info[4], int functionID)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    __cpuidex(info, functionID, 0);
+#else
+    __asm__ __volatile__ ("cpuid" : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3]) : "a"(functionID), "c"(0));
+#endif
+}
+
+static mo_uint64 mo_xgetbv(int reg)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(reg);
+#else
+    mo_uint32 lo;
+    mo_uint32 hi;
+    __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(reg));
+    return ((mo_uint64)hi << 32) | lo;
+#endif
+}
+#endif
+
+static mo_bool32 mo_has_avx2(void)
+{
+#ifdef MO_SUPPORT_AVX2
+    int info1[4];
+    mo_cpuid(info1, 0);
+    if (info1[0] < 7) {
+        return MO_FALSE;
+    }
+
+    // The OS needs to be saving the YMM registers (OSXSAVE + AVX, and then XCR0 bits 1 and 2) in addition to the CPU
+    // supporting the instructions themselves.
+    mo_cpuid(info1, 1);
+    if ((info1[2] & (1 << 27)) == 0 || (info1[2] & (1 << 28)) == 0) {
+        return MO_FALSE;
+    }
+    if ((mo_xgetbv(0) & 0x06) != 0x06) {
+        return MO_FALSE;
+    }
+
+    int info7[4];
+    mo_cpuid(info7, 7);
+    return (info7[1] & (1 << 5)) != 0;
+#else
+    return MO_FALSE;
+#endif
+}
+
+
+//// Palette Expansion ////
+
+static void mo_expand_color_indices__scalar(const mo_uint32* pPalette, mo_uint32* pDst, const mo_color_index* pSrc, mo_uint32 count)
+{
+    mo_uint32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        pDst[i+0] = pPalette[pSrc[i+0]];
+        pDst[i+1] = pPalette[pSrc[i+1]];
+        pDst[i+2] = pPalette[pSrc[i+2]];
+        pDst[i+3] = pPalette[pSrc[i+3]];
+    }
+    for (; i < count; ++i) {
+        pDst[i] = pPalette[pSrc[i]];
+    }
+}
+
+#ifdef MO_SUPPORT_AVX2
+MO_AVX2_FUNCTION
+static void mo_expand_color_indices__avx2(const mo_uint32* pPalette, mo_uint32* pDst, const mo_color_index* pSrc, mo_uint32 count)
+{
+    // 16 at a time. Indices are zero-extended to 32-bit and then used to gather from the palette.
+    mo_uint32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i indices = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m256i indices0 = _mm256_cvtepu8_epi32(indices);
+        __m256i indices1 = _mm256_cvtepu8_epi32(_mm_srli_si128(indices, 8));
+        _mm256_storeu_si256((__m256i*)(pDst + i + 0), _mm256_i32gather_epi32((const int*)pPalette, indices0, 4));
+        _mm256_storeu_si256((__m256i*)(pDst + i + 8), _mm256_i32gather_epi32((const int*)pPalette, indices1, 4));
+    }
+
+    mo_expand_color_indices__scalar(pPalette, pDst + i, pSrc + i, count - i);
+}
+#endif
+
+// Converts a run of color indices to their 32-bit palette colors. This is the routine to use for any kind of conversion
+// of the virtual screen (or an image) to 32-bit colors.
+static void mo_expand_color_indices(mo_context* pContext, const mo_color_rgba* pPaletteRGBA, mo_uint32* pDst, const mo_color_index* pSrc, mo_uint32 count)
+{
+    const mo_uint32* pPalette = (const mo_uint32*)pPaletteRGBA;
+
+#ifdef MO_SUPPORT_AVX2
+    if (pContext->flags & MO_FLAG_HAS_AVX2) {
+        mo_expand_color_indices__avx2(pPalette, pDst, pSrc, count);
+        return;
+    }
+#endif
+
+    mo_expand_color_indices__scalar(pPalette, pDst, pSrc, count);
+}
+
+
+//// Dirty Tiles ////
+
+static void mo_mark_dirty(mo_context* pContext, int left, int top, int right, int bottom)
+{
+    // The rectangle is assumed to be clamped to the screen already.
+    if (right <= left || bottom <= top) return;
+
+    mo_uint32 tileLeft   = (mo_uint32)left       / MO_DIRTY_TILE_SIZE;
+    mo_uint32 tileRight  = (mo_uint32)(right-1)  / MO_DIRTY_TILE_SIZE;
+    mo_uint32 tileTop    = (mo_uint32)top        / MO_DIRTY_TILE_SIZE;
+    mo_uint32 tileBottom = (mo_uint32)(bottom-1) / MO_DIRTY_TILE_SIZE;
+    for (mo_uint32 tileY = tileTop; tileY <= tileBottom; ++tileY) {
+        mo_uint8* pRow = pContext->pDirtyTiles + (tileY * pContext->dirtyTileCountX);
+        for (mo_uint32 tileX = tileLeft; tileX <= tileRight; ++tileX) {
+            pRow[tileX] = 1;
+        }
+    }
+}
+
+static void mo_mark_all_dirty(mo_context* pContext)
+{
+    for (mo_uint32 i = 0; i < pContext->dirtyTileCountX * pContext->dirtyTileCountY; ++i) {
+        pContext->pDirtyTiles[i] = 1;
+    }
+}
+
+static void mo_mark_presentation_stale(mo_context* pContext)
+{
+    // Used when the contents of the presentation buffer are lost, such as when the window is resized. Unlike
+    // mo_mark_all_dirty() this also forces a full present when frame diffing is enabled.
+    mo_mark_all_dirty(pContext);
+    pContext->isFullPresentPending = MO_TRUE;
+}
+
+static mo_uint32 mo_count_dirty_tiles(mo_context* pContext, const mo_uint8* pDirtyTiles)
+{
+    mo_uint32 count = 0;
+    for (mo_uint32 i = 0; i < pContext->dirtyTileCountX * pContext->dirtyTileCountY; ++i) {
+        count += (pDirtyTiles[i] != 0);
+    }
+
+    return count;
+}
+
+static mo_bool32 mo_next_dirty_run(mo_context* pContext, const mo_uint8* pDirtyTiles, mo_uint32* pTileIndex, mo_uint32* pLeft, mo_uint32* pTop, mo_uint32* pRight, mo_uint32* pBottom)
+{
+    // Finds the next horizontal run of dirty tiles starting from *pTileIndex and returns it as a rectangle on the
+    // virtual screen. Runs never span more than one row of tiles.
+    mo_uint32 tileCount = pContext->dirtyTileCountX * pContext->dirtyTileCountY;
+
+    mo_uint32 i = *pTileIndex;
+    while (i < tileCount && pDirtyTiles[i] == 0) {
+        i += 1;
+    }
+    if (i == tileCount) {
+        *pTileIndex = i;
+        return MO_FALSE;
+    }
+
+    mo_uint32 tileY = i / pContext->dirtyTileCountX;
+    mo_uint32 tileX = i % pContext->dirtyTileCountX;
+    mo_uint32 runLength = 1;
+    while (tileX + runLength < pContext->dirtyTileCountX && pDirtyTiles[i + runLength] != 0) {
+        runLength += 1;
+    }
+
+    *pLeft   = tileX * MO_DIRTY_TILE_SIZE;
+    *pTop    = tileY * MO_DIRTY_TILE_SIZE;
+    *pRight  = (tileX + runLength) * MO_DIRTY_TILE_SIZE;
+    *pBottom = (tileY + 1)         * MO_DIRTY_TILE_SIZE;
+    if (*pRight  > pContext->profile.resolutionX) *pRight  = pContext->profile.resolutionX;
+    if (*pBottom > pContext->profile.resolutionY) *pBottom = pContext->profile.resolutionY;
+
+    *pTileIndex = i + runLength;
+    return MO_TRUE;
+}
+
+// Waits for the asynchronous presentation thread to finish presenting the previous frame. This must be called before
+// anything that the presentation thread depends on is changed such as the size of the presentation buffer.
+static void mo_wait_for_async_present(mo_context* pContext)
+{
+    if (pContext->isAsyncPresentBusy) {
+        mal_event_wait(&pContext->asyncPresentDoneEvent);
+        pContext->isAsyncPresentBusy = MO_FALSE;
+    }
+}
+
+#ifdef _WIN32
 static LARGE_INTEGER g_moTimerFrequency = {{0}};
 void mo_timer_init(mo_timer* pTimer)
 {
@@ -1001,13 +1715,45 @@ double mo_timer_tick(mo_timer* pTimer)
 
     return (newTimeCounter - oldTimeCounter) / (double)g_moTimerFrequency.QuadPart;
 }
+
+static double mo_timer_peek(mo_timer* pTimer)
+{
+    // Same as mo_timer_tick(), only the timer is left unchanged.
+    LARGE_INTEGER counter;
+    if (!QueryPerformanceCounter(&counter)) {
+        return 0;
+    }
+
+    return (counter.QuadPart - pTimer->counter) / (double)g_moTimerFrequency.QuadPart;
+}
+
+static void mo_sleep(double seconds)
+{
+    // Sleep() is only accurate to about 1 millisecond, and only after timeBeginPeriod(1).
+    DWORD milliseconds = (DWORD)(seconds * 1000);
+    if (milliseconds > 0) {
+        Sleep(milliseconds);
+    }
+}
+
+static void mo_yield(void)
+{
+    SwitchToThread();
+}
+
+static void mo_event_wait_timeout(mal_event* pEvent, double seconds)
+{
+    // Waits until the event is signaled or the timeout expires, whichever comes first.
+    WaitForSingleObject((HANDLE)*pEvent, (DWORD)(seconds * 1000));
+}
 #endif
 
-#ifdef MO_X11
+#ifdef MO_POSIX
 void mo_timer_init(mo_timer* pTimer)
 {
+    // This needs to be wall clock time rather than CPU time. Otherwise time spent sleeping would not be counted.
     struct timespec newTime;
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &newTime);
+    clock_gettime(CLOCK_MONOTONIC, &newTime);
 
     pTimer->counter = (newTime.tv_sec * 1000000000LL) + newTime.tv_nsec;
 }
@@ -1015,7 +1761,7 @@ void mo_timer_init(mo_timer* pTimer)
 double mo_timer_tick(mo_timer* pTimer)
 {
     struct timespec newTime;
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &newTime);
+    clock_gettime(CLOCK_MONOTONIC, &newTime);
 
     long long newTimeCounter = (newTime.tv_sec * 1000000000LL) + newTime.tv_nsec;
     long long oldTimeCounter = pTimer->counter;
@@ -1024,33 +1770,137 @@ double mo_timer_tick(mo_timer* pTimer)
 
     return (newTimeCounter - oldTimeCounter) / 1000000000.0;
 }
-#endif
-
-
 
+static double mo_timer_peek(mo_timer* pTimer)
+{
+    // Same as mo_timer_tick(), only the timer is left unchanged.
+    struct timespec newTime;
+    clock_gettime(CLOCK_MONOTONIC, &newTime);
 
+    long long newTimeCounter = (newTime.tv_sec * 1000000000LL) + newTime.tv_nsec;
+    return (newTimeCounter - pTimer->counter) / 1000000000.0;
+}
 
-static inline void mo__on_button_down(mo_context* pContext, unsigned int button)
+static void mo_sleep(double seconds)
 {
-    if (button == 0) return;
-    if ((pContext->buttonState & button) == 0) {
-        pContext->buttonState |= button;
-        pContext->buttonPressState |= button;
-        pContext->buttonReleaseState &= ~button;
-    }
+    struct timespec duration;
+    duration.tv_sec  = (time_t)seconds;
+    duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1000000000.0);
+    nanosleep(&duration, NULL);
 }
 
-static inline void mo__on_button_up(mo_context* pContext, unsigned int button)
+static void mo_yield(void)
 {
-    if (button == 0) return;
-    pContext->buttonState &= ~button;
-    pContext->buttonPressState &= ~button;
-    pContext->buttonReleaseState |= button;
+    sched_yield();
 }
 
-#ifdef _WIN32
-static const char* g_MintaroWndClassName = "mintaro.WindowClass";
-static LONG g_MintaroInitCounter = 0;
+static void mo_event_wait_timeout(mal_event* pEvent, double seconds)
+{
+    // Waits until the event is signaled or the timeout expires, whichever comes first. Like mal_event_wait() this
+    // resets the event. The condition variable uses the realtime clock by default.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long nanoseconds = deadline.tv_nsec + (long long)(seconds * 1000000000.0);
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000LL);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000LL);
+
+    pthread_mutex_lock(&pEvent->mutex);
+    {
+        while (pEvent->value == 0) {
+            if (pthread_cond_timedwait(&pEvent->condition, &pEvent->mutex, &deadline) != 0) {
+                break;  // Timed out.
+            }
+        }
+
+        pEvent->value = 0;
+    }
+    pthread_mutex_unlock(&pEvent->mutex);
+}
+#endif
+
+// The amount of time before a deadline at which mo_wait_until() stops sleeping and starts spinning. Sleeping is never
+// exact so this needs to be a bit more than the granularity of the OS scheduler.
+#ifdef _WIN32
+#define MO_SPIN_TIME    0.002
+#else
+#define MO_SPIN_TIME    0.0005
+#endif
+
+static void mo_wait_until(mo_timer* pTimer, double time)
+{
+    // Sleeps for most of the time and then spins (yielding) for the remainder for accuracy.
+    double remaining = time - mo_timer_peek(pTimer);
+    if (remaining > MO_SPIN_TIME) {
+        mo_sleep(remaining - MO_SPIN_TIME);
+    }
+
+    while (mo_timer_peek(pTimer) < time) {
+        mo_yield();
+    }
+}
+
+
+
+
+
+static inline void mo__on_button_down(mo_context* pContext, unsigned int button)
+{
+    if (button == 0) return;
+    if ((pContext->buttonState & button) == 0) {
+        pContext->buttonState |= button;
+        pContext->buttonPressState |= button;
+        pContext->buttonReleaseState &= ~button;
+    }
+}
+
+static inline void mo__on_button_up(mo_context* pContext, unsigned int button)
+{
+    if (button == 0) return;
+    pContext->buttonState &= ~button;
+    pContext->buttonPressState &= ~button;
+    pContext->buttonReleaseState |= button;
+}
+
+static inline void mo__on_input_event(mo_context* pContext, mo_uint32 eventTimeInMilliseconds)
+{
+    // The event timestamp is in the window system's clock which has an unknown offset to ours. The smallest offset
+    // seen so far is the closest estimate since that's the event that spent the least amount of time in the queue.
+    double currentTime = mo_timer_peek(&pContext->inputTimer);
+    double eventTime = eventTimeInMilliseconds / 1000.0;
+    double offset = currentTime - eventTime;
+    if (!pContext->hasInputClockOffset || offset < pContext->inputClockOffset) {
+        pContext->inputClockOffset = offset;
+        pContext->hasInputClockOffset = MO_TRUE;
+    }
+
+    eventTime += pContext->inputClockOffset;
+    if (!pContext->hasPendingInput || eventTime < pContext->oldestPendingInputTime) {
+        pContext->oldestPendingInputTime = eventTime;
+        pContext->hasPendingInput = MO_TRUE;
+    }
+
+    pContext->inputStats.inputEventCount += 1;
+}
+
+static void mo__on_frame_presented(mo_context* pContext)
+{
+    if (pContext->hasPendingInput) {
+        double latency = mo_timer_peek(&pContext->inputTimer) - pContext->oldestPendingInputTime;
+        pContext->inputStats.lastInputLatency = latency;
+        if (pContext->inputStats.maxInputLatency < latency) {
+            pContext->inputStats.maxInputLatency = latency;
+        }
+
+        pContext->inputLatencySum += latency;
+        pContext->inputLatencyCount += 1;
+        pContext->inputStats.averageInputLatency = pContext->inputLatencySum / pContext->inputLatencyCount;
+        pContext->hasPendingInput = MO_FALSE;
+    }
+}
+
+#ifdef MO_WIN32
+static const char* g_MintaroWndClassName = "mintaro.WindowClass";
+static LONG g_MintaroInitCounter = 0;
 
 static mo_bool32 mo_is_win32_mouse_button_key_code(WPARAM wParam)
 {
@@ -1110,6 +1960,7 @@ static LRESULT DefaultWindowProcWin32(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 
         case WM_SIZE:
         {
+            mo_wait_for_async_present(pContext);
             pContext->windowWidth = LOWORD(lParam);
             pContext->windowHeight = HIWORD(lParam);
         } break;
@@ -1118,6 +1969,7 @@ static LRESULT DefaultWindowProcWin32(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
         {
             if (!mo_is_win32_mouse_button_key_code(wParam)) {
                 if ((lParam & (1 << 30)) == 0) {    // <-- This checks for auto-repeat. We want to ignore auto-repeated key-down events.
+                    mo__on_input_event(pContext, (mo_uint32)GetMessageTime());
                     mo__on_button_down(pContext, mo_get_key_binding(pContext, mo_convert_key_code__win32(wParam)));
                 }
             }
@@ -1125,6 +1977,7 @@ static LRESULT DefaultWindowProcWin32(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 
         case WM_KEYUP:
         {
+            mo__on_input_event(pContext, (mo_uint32)GetMessageTime());
             mo__on_button_up(pContext, mo_get_key_binding(pContext, mo_convert_key_code__win32(wParam)));
         } break;
 
@@ -1133,7 +1986,9 @@ static LRESULT DefaultWindowProcWin32(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 
     return DefWindowProcA(hWnd, msg, wParam, lParam);
 }
-#else
+#endif
+
+#ifdef MO_X11
 static int g_MintaroInitCounter = 0;
 static Display* g_moX11Display = NULL;
 static Atom g_WM_DELETE_WINDOW = 0;
@@ -1229,357 +2084,2080 @@ void mo_x11_resize_presentation_buffer(mo_context* pContext, unsigned int sizeX,
     mo_x11_create_presentation_buffer(pContext, sizeX, sizeY);
 }
 
-void mo_x11_present(mo_context* pContext)
+void mo_x11_present_rect(mo_context* pContext, int x, int y, unsigned int sizeX, unsigned int sizeY)
 {
     if (pContext == NULL || pContext->pPresentBufferX11 == NULL) return;
 
     if (pContext->flags & MO_FLAG_X11_USING_SHM) {
-        XShmPutImage(g_moX11Display, pContext->windowX11, pContext->gcX11, pContext->pPresentBufferX11,
-            0, 0, 0, 0, pContext->pPresentBufferX11->width, pContext->pPresentBufferX11->height, False);
+        XShmPutImage(g_moX11Display, pContext->windowX11, pContext->gcX11, pContext->pPresentBufferX11, x, y, x, y, sizeX, sizeY, False);
     } else {
-        XPutImage(g_moX11Display, pContext->windowX11, pContext->gcX11, pContext->pPresentBufferX11,
-            0, 0, 0, 0, pContext->pPresentBufferX11->width, pContext->pPresentBufferX11->height);
+        XPutImage(g_moX11Display, pContext->windowX11, pContext->gcX11, pContext->pPresentBufferX11, x, y, x, y, sizeX, sizeY);
     }
 }
+
+void mo_x11_present(mo_context* pContext)
+{
+    if (pContext == NULL || pContext->pPresentBufferX11 == NULL) return;
+    mo_x11_present_rect(pContext, 0, 0, pContext->pPresentBufferX11->width, pContext->pPresentBufferX11->height);
+}
 #endif
 
 
 
-///////////////////////////////////////////////////////////////////////////////
-//
-// AUDIO
-//
-///////////////////////////////////////////////////////////////////////////////
-void mo_on_log__mal(mal_device* pDevice, const char* message)
+#if defined(MO_X11) || defined(MO_HEADLESS)
+static const mo_uint32* mo_present__get_column_map(mo_context* pContext, unsigned int dstSizeX)
 {
-    mo_logf((mo_context*)pDevice->pUserData, "[AUDIO] %s", message);
+    if (pContext->pPresentColumnMap != NULL && pContext->presentColumnMapSize == dstSizeX) {
+        return pContext->pPresentColumnMap;
+    }
+
+    mo_uint32* pNewColumnMap = (mo_uint32*)mo_realloc(pContext->pPresentColumnMap, dstSizeX * sizeof(*pNewColumnMap));
+    if (pNewColumnMap == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int x = 0; x < dstSizeX; ++x) {
+        pNewColumnMap[x] = (mo_uint32)(((mo_uint64)x * pContext->profile.resolutionX) / dstSizeX);
+    }
+
+    pContext->pPresentColumnMap = pNewColumnMap;
+    pContext->presentColumnMapSize = dstSizeX;
+    return pNewColumnMap;
 }
 
-mo_uint32 mo_sound__read_and_accumulate_frames(mo_sound* pSound, float linearVolume, mo_uint32 frameCount, mo_int16* pFrames)
+static void mo_present__expand_and_scale_rows(mo_context* pContext, const mo_color_index* pScreen, const mo_color_rgba* pPalette, unsigned int dstSizeX, unsigned int dstSizeY, mo_uint32* pDst, const mo_uint32* pColumnMap, mo_uint32* pRowBuffer, unsigned int rowBeg, unsigned int rowEnd, unsigned int colBeg, unsigned int colEnd)
 {
-    // This is the main mixing function. pFrames is an in/out buffer - samples are read from the sound's data source
-    // and then accumated with the samples already in the buffer.
+    // Converts the virtual screen to 32-bit colors, scaling it to fill the destination buffer. Only rows in the range
+    // [rowBeg, rowEnd) are output which is how the work is split between threads. Likewise, only columns in the range
+    // [colBeg, colEnd) are output which is used for updating dirty tiles.
     //
-    // When a sound reaches the end of it's data source it will either loop or just stop. If it's an inline sound it
-    // will be _marked_ for deletion (actual deletion will happen later at the end of the next step). The reason it
-    // it only marked for deletion is because Mintaro is not thread-safe and this function will be called on another
-    // thread to the main stepping thread.
-
-    // Currently assuming the device is stereo. When/if different channel counts are supported we'll need to look
-    // into making this more robust.
-    mo_assert(pSound->pContext->playbackDevice2.channels <= 2);
+    // OPTIMIZATION NOTES
+    // ==================
+    // - Each source row is only ever expanded once. Any subsequent destination rows mapping to the same source
+    //   row are just a copy of the previous one.
+    // - When scaling, the needed part of the source row is first expanded into pRowBuffer with
+    //   mo_expand_color_indices() and then replicated from there. That way the scaled paths get the same SIMD
+    //   expansion as the 1:1 path and the replication step is just 32-bit copies out of L1.
+    // - When the destination width is an integer multiple of the source width each source pixel is just repeated
+    //   horizontally. Otherwise a column map is used which is cached on the context.
+    unsigned int srcSizeX = pContext->profile.resolutionX;
+    unsigned int srcSizeY = pContext->profile.resolutionY;
 
-    mo_uint32 totalFramesRead = 0;
+    unsigned int scaleX = ((dstSizeX % srcSizeX) == 0) ? dstSizeX / srcSizeX : 0;
+
+    // The range of source columns covering [colBeg, colEnd). The column map is monotonic so only the ends matter.
+    unsigned int srcColBeg;
+    unsigned int srcColEnd;
+    if (scaleX > 0) {
+        // The column range is always aligned to scaleX in this case since it's derived from whole source pixels.
+        srcColBeg = colBeg / scaleX;
+        srcColEnd = colEnd / scaleX;
+    } else if (pColumnMap != NULL) {
+        srcColBeg = pColumnMap[colBeg];
+        srcColEnd = pColumnMap[colEnd-1] + 1;
+    } else {
+        srcColBeg = (unsigned int)(((mo_uint64)colBeg     * srcSizeX) / dstSizeX);
+        srcColEnd = (unsigned int)(((mo_uint64)(colEnd-1) * srcSizeX) / dstSizeX) + 1;
+    }
 
-    mo_sound_source* pSource = pSound->pSource;
-    mo_assert(pSource != NULL);
+    unsigned int prevScreenY = (unsigned int)-1;
+    for (unsigned int y = rowBeg; y < rowEnd; ++y) {
+        mo_uint32* pDstRow = pDst + (y * dstSizeX);
 
-    if (pSource->type == mo_sound_source_type_raw)
-    {
-        const mo_uint32 soundChannels = pSound->pSource->raw.channels;
-        const mo_uint32 deviceChannels = pSound->pContext->playbackDevice2.channels;
-        while (frameCount > 0) {
-            mo_uint64 framesAvailable = (pSound->pSource->raw.sampleCount - pSound->raw.currentSample) / soundChannels;
-            if (framesAvailable > frameCount) {
-                framesAvailable = frameCount;
-            }
+        unsigned int screenY = (unsigned int)(((mo_uint64)y * srcSizeY) / dstSizeY);
+        if (screenY == prevScreenY) {
+            mo_copy_memory(pDstRow + colBeg, pDstRow - dstSizeX + colBeg, (colEnd - colBeg) * sizeof(mo_uint32));
+            continue;
+        }
 
-            if (deviceChannels == 1) {
-                // Mono. For converting to mono all we do is just average each channel.
-                for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                    float totalPCM = 0;
-                    for (mo_uint32 iChannel = 0; iChannel < soundChannels; ++iChannel) {
-                        totalPCM += (float)pSound->pSource->raw.pSampleData[pSound->raw.currentSample + iFrame];
+        const mo_color_index* pSrcRow = pScreen + (screenY * srcSizeX);
+        if (scaleX == 1) {
+            mo_expand_color_indices(pContext, pPalette, pDstRow + colBeg, pSrcRow + colBeg, colEnd - colBeg);
+        } else {
+            mo_expand_color_indices(pContext, pPalette, pRowBuffer + srcColBeg, pSrcRow + srcColBeg, srcColEnd - srcColBeg);
+
+            if (scaleX > 1) {
+                mo_uint32* pRunningDst = pDstRow + colBeg;
+                for (unsigned int screenX = srcColBeg; screenX < srcColEnd; ++screenX) {
+                    mo_uint32 color = pRowBuffer[screenX];
+                    for (unsigned int i = 0; i < scaleX; ++i) {
+                        pRunningDst[i] = color;
                     }
-
-                    float outputSample = pFrames[iFrame] + ((totalPCM / soundChannels) * linearVolume);
-                    pFrames[iFrame] = (mo_int16)(mo_clampf(outputSample, -32768.0f, 32767.0f));
+                    pRunningDst += scaleX;
+                }
+            } else if (pColumnMap != NULL) {
+                for (unsigned int x = colBeg; x < colEnd; ++x) {
+                    pDstRow[x] = pRowBuffer[pColumnMap[x]];
                 }
-                pSound->raw.currentSample += framesAvailable * soundChannels;
             } else {
-                // Stereo.
-                if (soundChannels == 1) {
-                    // Mono
-                    for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                        float scaledSample0 = pSound->pSource->raw.pSampleData[pSound->raw.currentSample + iFrame] * linearVolume;
-                        float outputSample0 = pFrames[iFrame*deviceChannels + 0] + scaledSample0;
-                        float outputSample1 = pFrames[iFrame*deviceChannels + 1] + scaledSample0;
-                        pFrames[iFrame*deviceChannels + 0] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        pFrames[iFrame*deviceChannels + 1] = (mo_int16)(mo_clampf(outputSample1, -32768.0f, 32767.0f));
-                    }
-                    pSound->raw.currentSample += framesAvailable * soundChannels;
-                } else if (soundChannels == 2) {
-                    // Stereo
-                    for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                        float scaledSample0 = pSound->pSource->raw.pSampleData[pSound->raw.currentSample + iFrame*soundChannels + 0] * linearVolume;
-                        float scaledSample1 = pSound->pSource->raw.pSampleData[pSound->raw.currentSample + iFrame*soundChannels + 1] * linearVolume;
-                        float outputSample0 = pFrames[iFrame*deviceChannels + 0] + scaledSample0;
-                        float outputSample1 = pFrames[iFrame*deviceChannels + 1] + scaledSample1;
-                        pFrames[iFrame*deviceChannels + 0] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        pFrames[iFrame*deviceChannels + 1] = (mo_int16)(mo_clampf(outputSample1, -32768.0f, 32767.0f));
-                    }
-                    pSound->raw.currentSample += framesAvailable * soundChannels;
-                } else {
-                    // More than stereo. Just drop the extra channels. This can be used for stereo sounds, but is not as optimized.
-                    for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                        for (mo_uint32 iChannel = 0; iChannel < deviceChannels; ++iChannel) {
-                            float scaledSample0 = pSound->pSource->raw.pSampleData[pSound->raw.currentSample + iFrame*soundChannels + iChannel] * linearVolume;
-                            float outputSample0 = pFrames[iFrame*deviceChannels + iChannel] + scaledSample0;
-                            pFrames[iFrame*deviceChannels + iChannel] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        }
-                    }
-                    pSound->raw.currentSample += framesAvailable * soundChannels;
+                // Failed to allocate the column map. Slow path.
+                for (unsigned int x = colBeg; x < colEnd; ++x) {
+                    pDstRow[x] = pRowBuffer[((mo_uint64)x * srcSizeX) / dstSizeX];
                 }
             }
+        }
 
+        prevScreenY = screenY;
+    }
+}
 
-            mo_bool32 reachedEnd = framesAvailable < frameCount;
-            frameCount -= (mo_uint32)framesAvailable;   // <-- Safe cast because we clamped it to frameCount which is 32-bit.
-            pFrames += framesAvailable * deviceChannels;
-
-            if (reachedEnd) {
-                if (mo_sound_is_looping(pSound)) {
-                    pSound->raw.currentSample = 0;
-                } else {
-                    if ((pSound->flags & MO_SOUND_FLAG_INLINED) != 0) {
-                        mo_sound_mark_for_deletion(pSound);
-                    } else {
-                        mo_sound_stop(pSound);
-                    }
+static mal_thread_result MAL_THREADCALL mo_present_worker_thread(void* pData)
+{
+    mo_present_worker* pWorker = (mo_present_worker*)pData;
+    mo_assert(pWorker != NULL);
 
-                    break;
-                }
-            }
+    for (;;) {
+        mal_event_wait(&pWorker->wakeupEvent);
+        if (pWorker->isTerminating) {
+            break;
         }
+
+        mo_present__expand_and_scale_rows(pWorker->pContext, pWorker->pScreen, pWorker->pPalette, pWorker->dstSizeX, pWorker->dstSizeY, pWorker->pDst, pWorker->pColumnMap, pWorker->pRowBuffer, pWorker->rowBeg, pWorker->rowEnd, 0, pWorker->dstSizeX);
+        mal_event_signal(&pWorker->doneEvent);
     }
-#ifdef MO_HAS_STB_VORBIS
-    else if (pSource->type == mo_sound_source_type_vorbis)
-    {
-        // Conveniently, stb_vorbis supports sample retrieval with a custom channel count.
-        const mo_uint32 deviceChannels = pSound->pContext->playbackDevice2.channels;
-        const mo_uint32 soundChannels = deviceChannels;
-        while (frameCount > 0) {
-            mo_uint64 framesAvailable = frameCount;
 
-            // We need to use an intermediary here. The process goes: stb_vorbis -> temp buffer -> sum with output.
-            float tempFrames[4096];
-            mo_uint32 tempFrameCount = sizeof(tempFrames) / sizeof(tempFrames[0]) / soundChannels;
-            if (framesAvailable > tempFrameCount) {
-                framesAvailable = tempFrameCount;
-            }
+    return (mal_thread_result)0;
+}
 
-            // This is used for later checking if we need to stop playback or loop back to the start.
-            mo_bool32 reachedEnd = MO_FALSE;
+static mo_bool32 mo_present_worker_init(mo_context* pContext, mo_present_worker* pWorker)
+{
+    mo_zero_object(pWorker);
+    pWorker->pContext = pContext;
 
-            int framesRead = stb_vorbis_get_samples_float_interleaved((stb_vorbis*)pSound->vorbis.pDecoder, (int)deviceChannels, tempFrames, (int)(framesAvailable * deviceChannels));
-            if (framesRead < (int)framesAvailable) {
-                reachedEnd = MO_TRUE;
-            }
+    pWorker->pRowBuffer = (mo_uint32*)mo_malloc(pContext->profile.resolutionX * sizeof(mo_uint32));
+    if (pWorker->pRowBuffer == NULL) {
+        return MO_FALSE;
+    }
 
-            // Unroll this loop for stereo? Probably not worth it...
-            for (mo_uint32 iSample = 0; iSample < framesRead*soundChannels; ++iSample) {
-                float scaledSample0 = tempFrames[iSample]*32767.0f * linearVolume;
-                float outputSample0 = pFrames[iSample] + scaledSample0;
-                pFrames[iSample] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-            }
+    if (!mal_event_create(&pWorker->wakeupEvent)) {
+        mo_free(pWorker->pRowBuffer);
+        return MO_FALSE;
+    }
+    if (!mal_event_create(&pWorker->doneEvent)) {
+        mal_event_delete(&pWorker->wakeupEvent);
+        mo_free(pWorker->pRowBuffer);
+        return MO_FALSE;
+    }
+    if (!mal_thread_create(&pWorker->thread, mo_present_worker_thread, pWorker)) {
+        mal_event_delete(&pWorker->doneEvent);
+        mal_event_delete(&pWorker->wakeupEvent);
+        mo_free(pWorker->pRowBuffer);
+        return MO_FALSE;
+    }
 
-            pSound->vorbis.currentSample += framesRead * soundChannels;
-            frameCount -= (mo_uint32)framesAvailable;   // <-- Safe cast because we clamped it to frameCount which is 32-bit.
-            pFrames += framesAvailable * deviceChannels;
+    return MO_TRUE;
+}
 
-            if (reachedEnd) {
-                if (mo_sound_is_looping(pSound)) {
-                    pSound->vorbis.currentSample = 0;
-                    stb_vorbis_seek_start((stb_vorbis*)pSound->vorbis.pDecoder);
-                } else {
-                    if ((pSound->flags & MO_SOUND_FLAG_INLINED) != 0) {
-                        mo_sound_mark_for_deletion(pSound);
-                    } else {
-                        mo_sound_stop(pSound);
-                    }
+static void mo_present_worker_uninit(mo_present_worker* pWorker)
+{
+    pWorker->isTerminating = MO_TRUE;
+    mal_event_signal(&pWorker->wakeupEvent);
+    mal_thread_wait(&pWorker->thread);
 
-                    break;
-                }
-            }
-        }
-    }
-#endif
-#ifdef MO_HAS_DR_FLAC
-    else if (pSource->type == mo_sound_source_type_flac)
-    {
-        const mo_uint32 deviceChannels = pSound->pContext->playbackDevice2.channels;
-        const mo_uint32 soundChannels = ((drflac*)pSound->flac.pDecoder)->channels;
-        while (frameCount > 0) {
-            mo_uint64 framesAvailable = frameCount;
+    mal_event_delete(&pWorker->doneEvent);
+    mal_event_delete(&pWorker->wakeupEvent);
+    mo_free(pWorker->pRowBuffer);
+}
 
-            // We need to use an intermediary here. The process goes: dr_flac -> temp buffer -> sum with output.
-            mo_int32 tempFrames[4096];
-            mo_uint32 tempFrameCount = sizeof(tempFrames) / sizeof(tempFrames[0]) / soundChannels;
-            if (framesAvailable > tempFrameCount) {
-                framesAvailable = tempFrameCount;
-            }
+static void mo_present__expand_and_scale(mo_context* pContext, const mo_color_index* pScreen, const mo_color_rgba* pPalette, unsigned int dstSizeX, unsigned int dstSizeY, mo_uint32* pDst)
+{
+    // The column map needs to be retrieved up front because the worker threads can't be allowed to rebuild it.
+    const mo_uint32* pColumnMap = NULL;
+    if ((dstSizeX % pContext->profile.resolutionX) != 0) {
+        pColumnMap = mo_present__get_column_map(pContext, dstSizeX);
+    }
 
-            // This is used for later checking if we need to stop playback or loop back to the start.
-            mo_bool32 reachedEnd = MO_FALSE;
+    // The rows are split into bands, one for each worker thread with the main thread doing the last one.
+    mo_uint32 bandCount = pContext->presentWorkerCount + 1;
+    if (bandCount > dstSizeY) {
+        bandCount = dstSizeY;
+    }
 
-            dr_uint64 framesRead = drflac_read_s32((drflac*)pSound->flac.pDecoder, framesAvailable * soundChannels, tempFrames) / soundChannels;
-            if (framesRead < framesAvailable) {
-                reachedEnd = MO_TRUE;
-            }
+    mo_uint32 rowsPerBand = dstSizeY / bandCount;
+    for (mo_uint32 iWorker = 0; iWorker < bandCount-1; ++iWorker) {
+        mo_present_worker* pWorker = &pContext->presentWorkers[iWorker];
+        pWorker->pScreen = pScreen;
+        pWorker->pPalette = pPalette;
+        pWorker->pDst = pDst;
+        pWorker->pColumnMap = pColumnMap;
+        pWorker->dstSizeX = dstSizeX;
+        pWorker->dstSizeY = dstSizeY;
+        pWorker->rowBeg = iWorker * rowsPerBand;
+        pWorker->rowEnd = pWorker->rowBeg + rowsPerBand;
+        mal_event_signal(&pWorker->wakeupEvent);
+    }
 
+    mo_present__expand_and_scale_rows(pContext, pScreen, pPalette, dstSizeX, dstSizeY, pDst, pColumnMap, pContext->pPresentRowBuffer, (bandCount-1) * rowsPerBand, dstSizeY, 0, dstSizeX);
 
-            // Channel conversion.
-            if (deviceChannels == 1) {
-                // Mono. For converting to mono all we do is just average each channel.
-                for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                    float totalPCM = 0;
-                    for (mo_uint32 iChannel = 0; iChannel < soundChannels; ++iChannel) {
-                        totalPCM += (float)(tempFrames[iFrame*soundChannels + iChannel] >> 16);
-                    }
+    for (mo_uint32 iWorker = 0; iWorker < bandCount-1; ++iWorker) {
+        mal_event_wait(&pContext->presentWorkers[iWorker].doneEvent);
+    }
+}
 
-                    float outputSample = pFrames[iFrame] + ((totalPCM / soundChannels) * linearVolume);
-                    pFrames[iFrame] = (mo_int16)(mo_clampf(outputSample, -32768.0f, 32767.0f));
-                }
-            } else {
-                // Stereo.
-                if (soundChannels == 1) {
-                    // Mono
-                    for (mo_uint32 iFrame = 0; iFrame < framesRead; ++iFrame) {
-                        float scaledSample0 = (tempFrames[iFrame*soundChannels + 0] >> 16) * linearVolume;
-                        float outputSample0 = pFrames[iFrame*deviceChannels + 0] + scaledSample0;
-                        float outputSample1 = pFrames[iFrame*deviceChannels + 1] + scaledSample0;
-                        pFrames[iFrame*deviceChannels + 0] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        pFrames[iFrame*deviceChannels + 1] = (mo_int16)(mo_clampf(outputSample1, -32768.0f, 32767.0f));
-                    }
-                } else if (soundChannels == 2) {
-                    // Stereo
-                    for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                        float scaledSample0 = (tempFrames[iFrame*soundChannels + 0] >> 16) * linearVolume;
-                        float scaledSample1 = (tempFrames[iFrame*soundChannels + 1] >> 16) * linearVolume;
-                        float outputSample0 = pFrames[iFrame*deviceChannels + 0] + scaledSample0;
-                        float outputSample1 = pFrames[iFrame*deviceChannels + 1] + scaledSample1;
-                        pFrames[iFrame*deviceChannels + 0] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        pFrames[iFrame*deviceChannels + 1] = (mo_int16)(mo_clampf(outputSample1, -32768.0f, 32767.0f));
-                    }
-                } else {
-                    // More than stereo. Just drop the extra channels. This can be used for stereo sounds, but is not as optimized.
-                    for (mo_uint32 iFrame = 0; iFrame < framesAvailable; ++iFrame) {
-                        for (mo_uint32 iChannel = 0; iChannel < deviceChannels; ++iChannel) {
-                            float scaledSample0 = (tempFrames[iFrame*soundChannels + iChannel] >> 16) * linearVolume;
-                            float outputSample0 = pFrames[iFrame*deviceChannels + iChannel] + scaledSample0;
-                            pFrames[iFrame*deviceChannels + iChannel] = (mo_int16)(mo_clampf(outputSample0, -32768.0f, 32767.0f));
-                        }
-                    }
-                }
-            }
+static void mo_present__expand_and_scale_dirty(mo_context* pContext, const mo_color_index* pScreen, const mo_color_rgba* pPalette, const mo_uint8* pDirtyTiles, unsigned int dstSizeX, unsigned int dstSizeY, mo_uint32* pDst)
+{
+    // Only the dirty tiles are updated. This is done on the calling thread since the regions are usually small. On
+    // X11 each region is sent to the window as it's converted.
+    const mo_uint32* pColumnMap = NULL;
+    if ((dstSizeX % pContext->profile.resolutionX) != 0) {
+        pColumnMap = mo_present__get_column_map(pContext, dstSizeX);
+    }
 
+    mo_uint64 srcSizeX = pContext->profile.resolutionX;
+    mo_uint64 srcSizeY = pContext->profile.resolutionY;
 
-            pSound->flac.currentSample += framesRead * soundChannels;
-            frameCount -= (mo_uint32)framesAvailable;   // <-- Safe cast because we clamped it to frameCount which is 32-bit.
-            pFrames += framesAvailable * deviceChannels;
+    mo_uint32 tileIndex = 0;
+    mo_uint32 left, top, right, bottom;
+    while (mo_next_dirty_run(pContext, pDirtyTiles, &tileIndex, &left, &top, &right, &bottom)) {
+        // The destination rectangle is made up of every destination pixel that maps to a source pixel inside the
+        // run. This is the inverse of the mapping used by mo_present__expand_and_scale_rows(), rounded up.
+        unsigned int dstLeft   = (unsigned int)((left   * dstSizeX + srcSizeX-1) / srcSizeX);
+        unsigned int dstRight  = (unsigned int)((right  * dstSizeX + srcSizeX-1) / srcSizeX);
+        unsigned int dstTop    = (unsigned int)((top    * dstSizeY + srcSizeY-1) / srcSizeY);
+        unsigned int dstBottom = (unsigned int)((bottom * dstSizeY + srcSizeY-1) / srcSizeY);
+        if (dstRight <= dstLeft || dstBottom <= dstTop) {
+            continue;   // <-- The run is too small to cover any destination pixels when downscaling.
+        }
 
-            if (reachedEnd) {
-                if (mo_sound_is_looping(pSound)) {
-                    pSound->flac.currentSample = 0;
-                    drflac_seek_to_sample((drflac*)pSound->flac.pDecoder, 0);
-                } else {
-                    if ((pSound->flags & MO_SOUND_FLAG_INLINED) != 0) {
-                        mo_sound_mark_for_deletion(pSound);
-                    } else {
-                        mo_sound_stop(pSound);
-                    }
+        mo_present__expand_and_scale_rows(pContext, pScreen, pPalette, dstSizeX, dstSizeY, pDst, pColumnMap, pContext->pPresentRowBuffer, dstTop, dstBottom, dstLeft, dstRight);
 
-                    break;
-                }
-            }
-        }
+#ifdef MO_X11
+        mo_x11_present_rect(pContext, (int)dstLeft, (int)dstTop, dstRight - dstLeft, dstBottom - dstTop);
+#endif
     }
+}
 #endif
 
-    return totalFramesRead;
-}
 
-mal_uint32 mo_on_send_frames__mal(mal_device* pDevice, mal_uint32 frameCount, void* pFrames)
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// AUDIO
+//
+///////////////////////////////////////////////////////////////////////////////
+void mo_on_log__mal(mal_device* pDevice, const char* message)
 {
-    // This is where all of our audio mixing is done.
-    mo_context* pContext = (mo_context*)pDevice->pUserData;
-    mo_assert(pContext != NULL);
+    mo_logf((mo_context*)pDevice->pUserData, "[AUDIO] %s", message);
+}
 
-    // The output buffer is in s16 format.
-    mo_int16* pFramesS16 = (mal_int16*)pFrames;
-    mo_assert(pFramesS16 != NULL);
+//// Mixing Kernels ////
+//
+// These accumulate a run of signed 16-bit samples from a raw sound source into the floating point mix bus, applying the
+// volume as they go. They're the inner loop of the mixer so the common channel layouts have SIMD versions. AVX2 is
+// selected at run time, whereas SSE2 and NEON are compile time. The scalar versions handle the tails.
+//
+// Stereo outputs take a separate volume for each channel which is how panning is applied. The SIMD loops always cover
+// a whole number of frames so the left and right volumes stay lined up with the lanes.
 
-    // Mixing is easy - we just need to accumulate each sound, making sure we adjust for volume. If a sound reaches
-    // the end of it's data source we need to either loop or stop the sound.
+static void mo_mix_s16__scalar(float* pDst, const mo_int16* pSrc, mo_uint32 sampleCount, float volumeL, float volumeR)
+{
+    mo_uint32 i = 0;
+    for (; i + 2 <= sampleCount; i += 2) {
+        pDst[i+0] += pSrc[i+0] * volumeL;
+        pDst[i+1] += pSrc[i+1] * volumeR;
+    }
+    if (i < sampleCount) {
+        pDst[i] += pSrc[i] * volumeL;
+    }
+}
 
-    // Important that we clear the output buffer to zero since we'll be accumulating.
-    mo_zero_memory(pFrames, frameCount * pDevice->channels * sizeof(mo_int16));
+static void mo_mix_s16_mono_to_stereo__scalar(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    for (mo_uint32 iFrame = 0; iFrame < frameCount; ++iFrame) {
+        pDst[iFrame*2 + 0] += pSrc[iFrame] * volumeL;
+        pDst[iFrame*2 + 1] += pSrc[iFrame] * volumeR;
+    }
+}
 
-    for (mo_uint32 iSound = 0; iSound < pContext->soundCount; ++iSound) {
-        mo_sound* pSound = pContext->ppSounds[iSound];
-        if (mo_sound_is_playing(pSound) && !mo_sound_group_is_paused(pContext, pSound->group)) {
-            float linearVolume = pSound->linearVolume * pContext->soundGroups[pSound->group].linearVolume * pContext->soundGroups[MO_SOUND_GROUP_MASTER].linearVolume;
-            if (linearVolume > 0) {
-                mo_sound__read_and_accumulate_frames(pSound, linearVolume, frameCount, pFramesS16);
-            }
+static void mo_mix_s16_to_mono__scalar(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, mo_uint32 channels, float volume)
+{
+    // For converting to mono all we do is just average each channel.
+    const float scale = volume / channels;
+    for (mo_uint32 iFrame = 0; iFrame < frameCount; ++iFrame) {
+        float totalPCM = 0;
+        for (mo_uint32 iChannel = 0; iChannel < channels; ++iChannel) {
+            totalPCM += (float)pSrc[iFrame*channels + iChannel];
         }
+
+        pDst[iFrame] += totalPCM * scale;
     }
+}
 
-    return frameCount;
+#if defined(MO_SUPPORT_SSE2)
+static inline __m128 mo_s16_lo_to_f32__sse2(__m128i x)
+{
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
 }
 
-mo_result mo_init_audio(mo_context* pContext)
+static inline __m128 mo_s16_hi_to_f32__sse2(__m128i x)
 {
-    mo_assert(pContext != NULL);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+}
 
-    // Sound groups.
-    for (int i = 0; i < MO_SOUND_GROUP_COUNT; ++i) {
-        pContext->soundGroups[i].linearVolume = 1;
+static void mo_mix_s16__sse2(float* pDst, const mo_int16* pSrc, mo_uint32 sampleCount, float volumeL, float volumeR)
+{
+    const __m128 v = _mm_setr_ps(volumeL, volumeR, volumeL, volumeR);
+    mo_uint32 i = 0;
+    for (; i + 8 <= sampleCount; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        _mm_storeu_ps(pDst + i + 0, _mm_add_ps(_mm_loadu_ps(pDst + i + 0), _mm_mul_ps(mo_s16_lo_to_f32__sse2(x), v)));
+        _mm_storeu_ps(pDst + i + 4, _mm_add_ps(_mm_loadu_ps(pDst + i + 4), _mm_mul_ps(mo_s16_hi_to_f32__sse2(x), v)));
     }
 
-    mal_device_config config;
-    config.format = mal_format_s16;
-    config.channels = pContext->profile.audioChannels;
-    config.sampleRate = pContext->profile.audioSampleRate;
-    config.bufferSizeInFrames = 0;
-    config.periods = 0;
-    config.onSendCallback = mo_on_send_frames__mal;
-    config.onRecvCallback = NULL;
-    config.onStopCallback = NULL;
+    mo_mix_s16__scalar(pDst + i, pSrc + i, sampleCount - i, volumeL, volumeR);
+}
+
+static void mo_mix_s16_mono_to_stereo__sse2(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    const __m128 v = _mm_setr_ps(volumeL, volumeR, volumeL, volumeR);
+    mo_uint32 i = 0;
+    for (; i + 8 <= frameCount; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m128 m0 = mo_s16_lo_to_f32__sse2(x);
+        __m128 m1 = mo_s16_hi_to_f32__sse2(x);
+
+        float* pDstFrame = pDst + i*2;
+        _mm_storeu_ps(pDstFrame +  0, _mm_add_ps(_mm_loadu_ps(pDstFrame +  0), _mm_mul_ps(_mm_unpacklo_ps(m0, m0), v)));
+        _mm_storeu_ps(pDstFrame +  4, _mm_add_ps(_mm_loadu_ps(pDstFrame +  4), _mm_mul_ps(_mm_unpackhi_ps(m0, m0), v)));
+        _mm_storeu_ps(pDstFrame +  8, _mm_add_ps(_mm_loadu_ps(pDstFrame +  8), _mm_mul_ps(_mm_unpacklo_ps(m1, m1), v)));
+        _mm_storeu_ps(pDstFrame + 12, _mm_add_ps(_mm_loadu_ps(pDstFrame + 12), _mm_mul_ps(_mm_unpackhi_ps(m1, m1), v)));
+    }
+
+    mo_mix_s16_mono_to_stereo__scalar(pDst + i*2, pSrc + i, frameCount - i, volumeL, volumeR);
+}
+
+static void mo_mix_s16_stereo_to_mono__sse2(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volume)
+{
+    // pmaddwd against a vector of ones sums each left/right pair straight into 32-bit.
+    const __m128 v = _mm_set1_ps(volume * 0.5f);
+    const __m128i ones = _mm_set1_epi16(1);
+    mo_uint32 i = 0;
+    for (; i + 4 <= frameCount; i += 4) {
+        __m128i sums = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i*2)), ones);
+        _mm_storeu_ps(pDst + i, _mm_add_ps(_mm_loadu_ps(pDst + i), _mm_mul_ps(_mm_cvtepi32_ps(sums), v)));
+    }
+
+    mo_mix_s16_to_mono__scalar(pDst + i, pSrc + i*2, frameCount - i, 2, volume);
+}
+#endif
+
+#ifdef MO_SUPPORT_AVX2
+MO_AVX2_FUNCTION
+static void mo_mix_s16__avx2(float* pDst, const mo_int16* pSrc, mo_uint32 sampleCount, float volumeL, float volumeR)
+{
+    const __m256 v = _mm256_setr_ps(volumeL, volumeR, volumeL, volumeR, volumeL, volumeR, volumeL, volumeR);
+    mo_uint32 i = 0;
+    for (; i + 16 <= sampleCount; i += 16) {
+        __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(pSrc + i + 0))));
+        __m256 x1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(pSrc + i + 8))));
+        _mm256_storeu_ps(pDst + i + 0, _mm256_add_ps(_mm256_loadu_ps(pDst + i + 0), _mm256_mul_ps(x0, v)));
+        _mm256_storeu_ps(pDst + i + 8, _mm256_add_ps(_mm256_loadu_ps(pDst + i + 8), _mm256_mul_ps(x1, v)));
+    }
+
+    mo_mix_s16__scalar(pDst + i, pSrc + i, sampleCount - i, volumeL, volumeR);
+}
+
+MO_AVX2_FUNCTION
+static void mo_mix_s16_mono_to_stereo__avx2(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    // The samples are duplicated while still 16-bit which keeps everything inside 128-bit lanes.
+    const __m256 v = _mm256_setr_ps(volumeL, volumeR, volumeL, volumeR, volumeL, volumeR, volumeL, volumeR);
+    mo_uint32 i = 0;
+    for (; i + 8 <= frameCount; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m256 s0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_unpacklo_epi16(x, x)));
+        __m256 s1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_unpackhi_epi16(x, x)));
+
+        float* pDstFrame = pDst + i*2;
+        _mm256_storeu_ps(pDstFrame + 0, _mm256_add_ps(_mm256_loadu_ps(pDstFrame + 0), _mm256_mul_ps(s0, v)));
+        _mm256_storeu_ps(pDstFrame + 8, _mm256_add_ps(_mm256_loadu_ps(pDstFrame + 8), _mm256_mul_ps(s1, v)));
+    }
+
+    mo_mix_s16_mono_to_stereo__scalar(pDst + i*2, pSrc + i, frameCount - i, volumeL, volumeR);
+}
+
+MO_AVX2_FUNCTION
+static void mo_mix_s16_stereo_to_mono__avx2(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volume)
+{
+    // _mm256_madd_epi16 works within 128-bit lanes, but since each lane holds consecutive frames the output is in order.
+    const __m256 v = _mm256_set1_ps(volume * 0.5f);
+    const __m256i ones = _mm256_set1_epi16(1);
+    mo_uint32 i = 0;
+    for (; i + 8 <= frameCount; i += 8) {
+        __m256i sums = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(pSrc + i*2)), ones);
+        _mm256_storeu_ps(pDst + i, _mm256_add_ps(_mm256_loadu_ps(pDst + i), _mm256_mul_ps(_mm256_cvtepi32_ps(sums), v)));
+    }
+
+    mo_mix_s16_to_mono__scalar(pDst + i, pSrc + i*2, frameCount - i, 2, volume);
+}
+#endif
+
+#if defined(MO_SUPPORT_NEON)
+static void mo_mix_s16__neon(float* pDst, const mo_int16* pSrc, mo_uint32 sampleCount, float volumeL, float volumeR)
+{
+    const float volumes[4] = {volumeL, volumeR, volumeL, volumeR};
+    const float32x4_t v = vld1q_f32(volumes);
+    mo_uint32 i = 0;
+    for (; i + 8 <= sampleCount; i += 8) {
+        int16x8_t x = vld1q_s16(pSrc + i);
+        float32x4_t x0 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+        float32x4_t x1 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+        vst1q_f32(pDst + i + 0, vmlaq_f32(vld1q_f32(pDst + i + 0), x0, v));
+        vst1q_f32(pDst + i + 4, vmlaq_f32(vld1q_f32(pDst + i + 4), x1, v));
+    }
+
+    mo_mix_s16__scalar(pDst + i, pSrc + i, sampleCount - i, volumeL, volumeR);
+}
+
+static void mo_mix_s16_mono_to_stereo__neon(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    mo_uint32 i = 0;
+    for (; i + 4 <= frameCount; i += 4) {
+        float32x4_t m = vcvtq_f32_s32(vmovl_s16(vld1_s16(pSrc + i)));
+        float32x4x2_t d = vld2q_f32(pDst + i*2);
+        d.val[0] = vmlaq_n_f32(d.val[0], m, volumeL);
+        d.val[1] = vmlaq_n_f32(d.val[1], m, volumeR);
+        vst2q_f32(pDst + i*2, d);
+    }
+
+    mo_mix_s16_mono_to_stereo__scalar(pDst + i*2, pSrc + i, frameCount - i, volumeL, volumeR);
+}
+
+static void mo_mix_s16_stereo_to_mono__neon(float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volume)
+{
+    const float scale = volume * 0.5f;
+    mo_uint32 i = 0;
+    for (; i + 4 <= frameCount; i += 4) {
+        int32x4_t sums = vpaddlq_s16(vld1q_s16(pSrc + i*2));
+        vst1q_f32(pDst + i, vmlaq_n_f32(vld1q_f32(pDst + i), vcvtq_f32_s32(sums), scale));
+    }
+
+    mo_mix_s16_to_mono__scalar(pDst + i, pSrc + i*2, frameCount - i, 2, volume);
+}
+#endif
+
+// Accumulates samples where the source and output have the same channel count. Even samples are scaled by volumeL and
+// odd samples by volumeR. For mono they should be the same.
+static void mo_mix_s16(mo_context* pContext, float* pDst, const mo_int16* pSrc, mo_uint32 sampleCount, float volumeL, float volumeR)
+{
+    (void)pContext;
+
+#ifdef MO_SUPPORT_AVX2
+    if (pContext->flags & MO_FLAG_HAS_AVX2) {
+        mo_mix_s16__avx2(pDst, pSrc, sampleCount, volumeL, volumeR);
+        return;
+    }
+#endif
+#if defined(MO_SUPPORT_SSE2)
+    mo_mix_s16__sse2(pDst, pSrc, sampleCount, volumeL, volumeR);
+#elif defined(MO_SUPPORT_NEON)
+    mo_mix_s16__neon(pDst, pSrc, sampleCount, volumeL, volumeR);
+#else
+    mo_mix_s16__scalar(pDst, pSrc, sampleCount, volumeL, volumeR);
+#endif
+}
+
+static void mo_mix_s16_mono_to_stereo(mo_context* pContext, float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    (void)pContext;
+
+#ifdef MO_SUPPORT_AVX2
+    if (pContext->flags & MO_FLAG_HAS_AVX2) {
+        mo_mix_s16_mono_to_stereo__avx2(pDst, pSrc, frameCount, volumeL, volumeR);
+        return;
+    }
+#endif
+#if defined(MO_SUPPORT_SSE2)
+    mo_mix_s16_mono_to_stereo__sse2(pDst, pSrc, frameCount, volumeL, volumeR);
+#elif defined(MO_SUPPORT_NEON)
+    mo_mix_s16_mono_to_stereo__neon(pDst, pSrc, frameCount, volumeL, volumeR);
+#else
+    mo_mix_s16_mono_to_stereo__scalar(pDst, pSrc, frameCount, volumeL, volumeR);
+#endif
+}
+
+static void mo_mix_s16_to_mono(mo_context* pContext, float* pDst, const mo_int16* pSrc, mo_uint32 frameCount, mo_uint32 channels, float volume)
+{
+    if (channels == 1) {
+        mo_mix_s16(pContext, pDst, pSrc, frameCount, volume, volume);
+        return;
+    }
+
+    if (channels == 2) {
+    #ifdef MO_SUPPORT_AVX2
+        if (pContext->flags & MO_FLAG_HAS_AVX2) {
+            mo_mix_s16_stereo_to_mono__avx2(pDst, pSrc, frameCount, volume);
+            return;
+        }
+    #endif
+    #if defined(MO_SUPPORT_SSE2)
+        mo_mix_s16_stereo_to_mono__sse2(pDst, pSrc, frameCount, volume);
+        return;
+    #elif defined(MO_SUPPORT_NEON)
+        mo_mix_s16_stereo_to_mono__neon(pDst, pSrc, frameCount, volume);
+        return;
+    #endif
+    }
+
+    mo_mix_s16_to_mono__scalar(pDst, pSrc, frameCount, channels, volume);
+}
+
+// Accumulates frames of any channel count into a mono or stereo output. Channels beyond what the output has are dropped,
+// except when mixing down to mono in which case they're averaged. volumeR is only used for stereo outputs.
+static void mo_mix_s16_frames(mo_context* pContext, float* pDst, mo_uint32 dstChannels, const mo_int16* pSrc, mo_uint32 srcChannels, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    if (dstChannels == 1) {
+        mo_mix_s16_to_mono(pContext, pDst, pSrc, frameCount, srcChannels, volumeL);
+    } else if (srcChannels == 1) {
+        mo_mix_s16_mono_to_stereo(pContext, pDst, pSrc, frameCount, volumeL, volumeR);
+    } else if (srcChannels == 2) {
+        mo_mix_s16(pContext, pDst, pSrc, frameCount * 2, volumeL, volumeR);
+    } else {
+        // More than stereo. Just drop the extra channels. This is not optimized.
+        for (mo_uint32 iFrame = 0; iFrame < frameCount; ++iFrame) {
+            pDst[iFrame*2 + 0] += pSrc[iFrame*srcChannels + 0] * volumeL;
+            pDst[iFrame*2 + 1] += pSrc[iFrame*srcChannels + 1] * volumeR;
+        }
+    }
+}
+
+
+//// Resampling ////
+//
+// Positions in the source are 32.32 fixed point. The input is a window of source frames where the frame at the integer
+// part of the position, and the one after it, are the ones the output frame falls between. The polyphase filter also
+// reads MO_RESAMPLER_TAPS/2 - 1 frames before that and MO_RESAMPLER_TAPS/2 - 1 frames after it, so the window needs to
+// extend that far in both directions.
+
+static void mo_resampler__init_coefficients(mo_context* pContext)
+{
+    // Blackman windowed sinc. The cutoff is a little below the source's Nyquist frequency because with so few taps the
+    // transition band is wide. It's not scaled for downsampling so large downward ratios will alias somewhat.
+    const double pi = 3.14159265358979323846;
+    const double cutoff = 0.9;
+    const double halfWidth = MO_RESAMPLER_TAPS / 2;
+
+    for (int iPhase = 0; iPhase <= MO_RESAMPLER_PHASES; ++iPhase) {
+        double frac = (double)iPhase / MO_RESAMPLER_PHASES;
+        double sum = 0;
+        double coefficients[MO_RESAMPLER_TAPS];
+        for (int iTap = 0; iTap < MO_RESAMPLER_TAPS; ++iTap) {
+            double x = (iTap - (MO_RESAMPLER_TAPS/2 - 1)) - frac;
+            double sinc = (x == 0) ? 1 : sin(pi * cutoff * x) / (pi * cutoff * x);
+            double window = 0.42 + 0.5*cos(pi * x / halfWidth) + 0.08*cos(2 * pi * x / halfWidth);
+            coefficients[iTap] = sinc * window;
+            sum += coefficients[iTap];
+        }
+
+        // Normalized so each phase has unity gain. Without this there's audible ripple at the output rate.
+        for (int iTap = 0; iTap < MO_RESAMPLER_TAPS; ++iTap) {
+            pContext->resamplerCoefficients[iPhase][iTap] = (float)(coefficients[iTap] / sum);
+        }
+    }
+}
+
+// Resamples frameCount frames from pWindow, starting at pos and advancing by step for each one, and accumulates them into
+// pFrames after applying the volume. The window must have the channel count of the output. volumeR is applied to the
+// right channel of stereo outputs and volumeL to everything else.
+static void mo_resample__accumulate(const mo_context* pContext, const float* pWindow, mo_uint32 channels, mo_uint64 pos, mo_uint64 step, float* pFrames, mo_uint32 frameCount, float volumeL, float volumeR)
+{
+    if (channels != 2) {
+        volumeR = volumeL;
+    }
+
+    if (pContext->profile.audioResampler == mo_resampler_polyphase) {
+        for (mo_uint32 iFrame = 0; iFrame < frameCount; ++iFrame) {
+            const float* pIn = pWindow + ((mo_uint32)(pos >> 32) - (MO_RESAMPLER_TAPS/2 - 1)) * channels;
+
+            // The fractional part selects the filter phase. The coefficients are interpolated between the two nearest
+            // phases which is much cheaper than a table big enough to not need it.
+            mo_uint32 frac = (mo_uint32)pos;
+            mo_uint32 iPhase = frac >> (32 - MO_RESAMPLER_PHASE_BITS);
+            float t = (float)(frac & ((1U << (32 - MO_RESAMPLER_PHASE_BITS)) - 1)) * (1.0f / (1U << (32 - MO_RESAMPLER_PHASE_BITS)));
+
+            float coefficients[MO_RESAMPLER_TAPS];
+            const float* pCoefficients0 = pContext->resamplerCoefficients[iPhase + 0];
+            const float* pCoefficients1 = pContext->resamplerCoefficients[iPhase + 1];
+            for (mo_uint32 iTap = 0; iTap < MO_RESAMPLER_TAPS; ++iTap) {
+                coefficients[iTap] = pCoefficients0[iTap] + (pCoefficients1[iTap] - pCoefficients0[iTap]) * t;
+            }
+
+            for (mo_uint32 iChannel = 0; iChannel < channels; ++iChannel) {
+                float sample = 0;
+                for (mo_uint32 iTap = 0; iTap < MO_RESAMPLER_TAPS; ++iTap) {
+                    sample += pIn[iTap*channels + iChannel] * coefficients[iTap];
+                }
+                pFrames[iFrame*channels + iChannel] += sample * ((iChannel == 1) ? volumeR : volumeL);
+            }
+
+            pos += step;
+        }
+    } else {
+        for (mo_uint32 iFrame = 0; iFrame < frameCount; ++iFrame) {
+            const float* pIn = pWindow + (mo_uint32)(pos >> 32) * channels;
+            float t = (float)((mo_uint32)pos >> 8) * (1.0f / 16777216.0f);
+
+            for (mo_uint32 iChannel = 0; iChannel < channels; ++iChannel) {
+                float a = pIn[iChannel];
+                float b = pIn[iChannel + channels];
+                pFrames[iFrame*channels + iChannel] += (a + (b - a)*t) * ((iChannel == 1) ? volumeR : volumeL);
+            }
+
+            pos += step;
+        }
+    }
+}
+
+static mo_uint64 mo_resampler__calculate_step(mo_uint32 sampleRateIn, mo_uint32 sampleRateOut, float pitch)
+{
+    // There's no output rate once the device has been uninitialized, or if it never was. Commands are still processed
+    // on the game thread in that case so this needs to be handled rather than dividing by zero.
+    if (sampleRateOut == 0) {
+        return MO_RESAMPLER_UNITY_STEP;
+    }
+
+    // The rates are done in integer so the step is exact when they match and the pitch is 1.
+    mo_uint64 step = ((mo_uint64)sampleRateIn << 32) / sampleRateOut;
+    if (pitch != 1) {
+        double scaledStep = step * (double)pitch;
+        if (!(scaledStep >= 0)) {
+            scaledStep = 0;     // <-- NaN or negative. Converting either of these to an integer is undefined.
+        }
+        step = (scaledStep > (double)MO_RESAMPLER_MAX_STEP) ? MO_RESAMPLER_MAX_STEP : (mo_uint64)scaledStep;
+    }
+
+    if (step > MO_RESAMPLER_MAX_STEP) {
+        step = MO_RESAMPLER_MAX_STEP;
+    }
+    if (step == 0) {
+        step = 1;
+    }
+
+    return step;
+}
+
+
+//// Streaming ////
+//
+// Sounds with a compressed source are decoded into their ring buffer on the streaming thread, a little ahead of the
+// mixer, so neither the game thread nor the audio thread ever runs a decoder. The decoder is opened and the buffer
+// first filled when the streaming thread picks the sound up, which it's woken up to do as soon as the sound is
+// created. Until then the mixer treats the sound as silent rather than as an underrun. The write index and
+// isStreamAtEnd are only written by the streaming thread, and the read index is only written by the audio thread.
+// Because decoding happens ahead of time, looping is handled here rather than by the mixer.
+
+static void* mo_stream__open_file_decoder(mo_sound_source_type decoderType, const char* filePath, mo_uint32* pChannels, mo_uint32* pSampleRate)
+{
+#if defined(MO_HAS_STB_VORBIS) && !defined(STB_VORBIS_NO_STDIO)
+    if (decoderType == mo_sound_source_type_vorbis) {
+        stb_vorbis* pDecoder = stb_vorbis_open_filename(filePath, NULL, NULL);
+        if (pDecoder != NULL) {
+            stb_vorbis_info info = stb_vorbis_get_info(pDecoder);
+            *pChannels = (mo_uint32)info.channels;
+            *pSampleRate = info.sample_rate;
+        }
+        return pDecoder;
+    }
+#endif
+#if defined(MO_HAS_DR_FLAC) && !defined(DR_FLAC_NO_STDIO)
+    if (decoderType == mo_sound_source_type_flac) {
+        drflac* pDecoder = drflac_open_file(filePath);
+        if (pDecoder != NULL) {
+            *pChannels = pDecoder->channels;
+            *pSampleRate = pDecoder->sampleRate;
+        }
+        return pDecoder;
+    }
+#endif
+
+    (void)decoderType;
+    (void)filePath;
+    (void)pChannels;
+    (void)pSampleRate;
+    return NULL;
+}
+
+static void mo_stream__close_decoder(mo_sound_source_type decoderType, void* pDecoder)
+{
+#ifdef MO_HAS_STB_VORBIS
+    if (decoderType == mo_sound_source_type_vorbis) {
+        stb_vorbis_close((stb_vorbis*)pDecoder);
+    }
+#endif
+#ifdef MO_HAS_DR_FLAC
+    if (decoderType == mo_sound_source_type_flac) {
+        drflac_close((drflac*)pDecoder);
+    }
+#endif
+
+    (void)decoderType;
+    (void)pDecoder;
+}
+
+static void* mo_stream__open_memory_decoder(mo_sound_source_type decoderType, const void* pData, size_t dataSize, mo_uint32* pChannels, mo_uint32* pSampleRate)
+{
+#ifdef MO_HAS_STB_VORBIS
+    if (decoderType == mo_sound_source_type_vorbis) {
+        stb_vorbis* pDecoder = stb_vorbis_open_memory((const unsigned char*)pData, (int)dataSize, NULL, NULL);
+        if (pDecoder != NULL) {
+            stb_vorbis_info info = stb_vorbis_get_info(pDecoder);
+            *pChannels = (mo_uint32)info.channels;
+            *pSampleRate = info.sample_rate;
+        }
+        return pDecoder;
+    }
+#endif
+#ifdef MO_HAS_DR_FLAC
+    if (decoderType == mo_sound_source_type_flac) {
+        drflac* pDecoder = drflac_open_memory(pData, dataSize);
+        if (pDecoder != NULL) {
+            *pChannels = pDecoder->channels;
+            *pSampleRate = pDecoder->sampleRate;
+        }
+        return pDecoder;
+    }
+#endif
+
+    (void)decoderType;
+    (void)pData;
+    (void)dataSize;
+    (void)pChannels;
+    (void)pSampleRate;
+    return NULL;
+}
+
+static mo_bool32 mo_stream__open_decoder(mo_sound* pSound)
+{
+    // Called on the streaming thread. The format was already taken from the source when the sound was created and the
+    // mixer may be using it, so a file that's been changed since the source was opened is treated as a failure.
+    mo_sound_source* pSource = pSound->pSource;
+    mo_uint32 channels = 0;
+    mo_uint32 sampleRate = 0;
+    void* pDecoder;
+    if (pSource->type == mo_sound_source_type_stream) {
+        pDecoder = mo_stream__open_file_decoder(pSound->decoder.type, pSource->stream.filePath, &channels, &sampleRate);
+    } else {
+        // The memory layout of the Vorbis and FLAC sources are the same.
+        pDecoder = mo_stream__open_memory_decoder(pSound->decoder.type, pSource->vorbis.pData, pSource->vorbis.dataSize, &channels, &sampleRate);
+    }
+
+    if (pDecoder == NULL) {
+        return MO_FALSE;
+    }
+
+    if (channels != pSound->decoder.channels || sampleRate != pSound->decoder.sampleRate) {
+        mo_stream__close_decoder(pSound->decoder.type, pDecoder);
+        return MO_FALSE;
+    }
+
+    pSound->decoder.pDecoder = pDecoder;
+    return MO_TRUE;
+}
+
+static mo_uint64 mo_stream__get_length_in_frames(mo_sound_source_type decoderType, void* pDecoder)
+{
+    // Returns 0 if the length is not known.
+#ifdef MO_HAS_STB_VORBIS
+    if (decoderType == mo_sound_source_type_vorbis) {
+        return stb_vorbis_stream_length_in_samples((stb_vorbis*)pDecoder);
+    }
+#endif
+#ifdef MO_HAS_DR_FLAC
+    if (decoderType == mo_sound_source_type_flac) {
+        return ((drflac*)pDecoder)->totalSampleCount / ((drflac*)pDecoder)->channels;
+    }
+#endif
+
+    (void)decoderType;
+    (void)pDecoder;
+    return 0;
+}
+
+static mo_uint32 mo_stream__calculate_buffer_size(mo_context* pContext, mo_uint32 sampleRate)
+{
+    // The size of a sound's ring buffer in frames. This needs to be a power of 2.
+    mo_uint64 frameCount = ((mo_uint64)pContext->profile.audioDecodeAheadMilliseconds * sampleRate + 999) / 1000;
+
+    mo_uint32 bufferSizeInFrames = 256;
+    while (bufferSizeInFrames < frameCount && bufferSizeInFrames < 0x10000000) {
+        bufferSizeInFrames *= 2;
+    }
+
+    return bufferSizeInFrames;
+}
+
+static void mo_stream__seek_to_start(mo_sound* pSound)
+{
+#ifdef MO_HAS_STB_VORBIS
+    if (pSound->decoder.type == mo_sound_source_type_vorbis) {
+        stb_vorbis_seek_start((stb_vorbis*)pSound->decoder.pDecoder);
+    }
+#endif
+#ifdef MO_HAS_DR_FLAC
+    if (pSound->decoder.type == mo_sound_source_type_flac) {
+        drflac_seek_to_sample((drflac*)pSound->decoder.pDecoder, 0);
+    }
+#endif
+
+    (void)pSound;
+}
+
+static mo_uint32 mo_stream__decode(mo_sound_source_type decoderType, void* pDecoder, mo_uint32 channels, mo_int16* pFrames, mo_uint32 frameCount)
+{
+    // Returns the number of frames decoded, which is only less than frameCount at the end of the stream.
+    mo_uint32 framesDecoded = 0;
+
+#ifdef MO_HAS_STB_VORBIS
+    if (decoderType == mo_sound_source_type_vorbis) {
+        framesDecoded = (mo_uint32)stb_vorbis_get_samples_short_interleaved((stb_vorbis*)pDecoder, (int)channels, pFrames, (int)(frameCount * channels));
+    }
+#endif
+#ifdef MO_HAS_DR_FLAC
+    if (decoderType == mo_sound_source_type_flac) {
+        mo_int32 tempSamples[4096];
+        mo_uint32 tempFrameCount = sizeof(tempSamples) / sizeof(tempSamples[0]) / channels;
+        while (framesDecoded < frameCount) {
+            mo_uint32 framesToRead = frameCount - framesDecoded;
+            if (framesToRead > tempFrameCount) {
+                framesToRead = tempFrameCount;
+            }
+
+            mo_uint32 framesRead = (mo_uint32)(drflac_read_s32((drflac*)pDecoder, framesToRead * channels, tempSamples) / channels);
+            for (mo_uint32 iSample = 0; iSample < framesRead*channels; ++iSample) {
+                pFrames[framesDecoded*channels + iSample] = (mo_int16)(tempSamples[iSample] >> 16);
+            }
+
+            framesDecoded += framesRead;
+            if (framesRead < framesToRead) {
+                break;
+            }
+        }
+    }
+#endif
+
+    (void)decoderType;
+    (void)pDecoder;
+    (void)channels;
+    (void)pFrames;
+    (void)frameCount;
+    return framesDecoded;
+}
+
+static void mo_stream__fill(mo_sound* pSound)
+{
+    // Decodes as many frames as will fit in the sound's ring buffer. The first time around the decoder is opened. If
+    // that fails the sound is put straight at the end so the mixer finishes it.
+    if (!pSound->isStreamReady) {
+        if (!mo_stream__open_decoder(pSound)) {
+            mo_atomic_store_u32(&pSound->isStreamAtEnd, 1);
+        }
+    }
+
+    if (pSound->decoder.pDecoder == NULL) {
+        mo_atomic_store_u32(&pSound->isStreamReady, 1);
+        return;
+    }
+
+    if (mo_atomic_load_u32(&pSound->isStreamAtEnd)) {
+        if (!mo_atomic_load_u32(&pSound->isStreamLooping)) {
+            return;
+        }
+
+        // The sound was played again with looping enabled after it reached the end.
+        mo_stream__seek_to_start(pSound);
+        mo_atomic_store_u32(&pSound->isStreamAtEnd, 0);
+    }
+
+    const mo_uint32 channels = pSound->decoder.channels;
+    const mo_uint32 bufferSizeInFrames = pSound->streamBufferSizeInFrames;
+    mo_uint32 writeIndex = pSound->streamWriteIndex;
+    mo_uint32 framesFree = bufferSizeInFrames - (writeIndex - mo_atomic_load_u32(&pSound->streamReadIndex));
+
+    mo_bool32 justLooped = MO_FALSE;
+    while (framesFree > 0) {
+        // Never decode across the end of the buffer.
+        mo_uint32 offset = writeIndex & (bufferSizeInFrames-1);
+        mo_uint32 framesToDecode = bufferSizeInFrames - offset;
+        if (framesToDecode > framesFree) {
+            framesToDecode = framesFree;
+        }
+
+        mo_uint32 framesDecoded = mo_stream__decode(pSound->decoder.type, pSound->decoder.pDecoder, channels, pSound->pStreamBuffer + offset*channels, framesToDecode);
+        writeIndex += framesDecoded;
+        framesFree -= framesDecoded;
+        mo_atomic_store_u32(&pSound->streamWriteIndex, writeIndex);
+
+        if (framesDecoded < framesToDecode) {
+            // Reached the end. If nothing was decoded straight after looping the stream is empty or broken and would
+            // otherwise loop forever.
+            if (mo_atomic_load_u32(&pSound->isStreamLooping) && !(justLooped && framesDecoded == 0)) {
+                mo_stream__seek_to_start(pSound);
+                justLooped = MO_TRUE;
+                continue;
+            }
+
+            mo_atomic_store_u32(&pSound->isStreamAtEnd, 1);
+            break;
+        }
+
+        justLooped = MO_FALSE;
+    }
+
+    mo_atomic_store_u32(&pSound->isStreamReady, 1);
+}
+
+static mal_thread_result MAL_THREADCALL mo_stream_thread(void* pData)
+{
+    mo_context* pContext = (mo_context*)pData;
+    mo_assert(pContext != NULL);
+
+    while (!mo_atomic_load_u32(&pContext->isStreamThreadTerminating)) {
+        // The lock is only held while picking the next sound so the game thread never waits on a decoder. A sound that
+        // is removed from the list while it's being filled isn't released until isStreamFilling is cleared. Sounds
+        // being moved around in the list by the game thread may be skipped or filled twice in a pass which is harmless.
+        for (mo_uint32 iSound = 0; ; ++iSound) {
+            mo_sound* pSound = NULL;
+            mal_mutex_lock(&pContext->streamLock);
+            {
+                if (iSound < pContext->streamingSoundCount) {
+                    pSound = pContext->ppStreamingSounds[iSound];
+                    mo_atomic_store_u32(&pSound->isStreamFilling, 1);
+                }
+            }
+            mal_mutex_unlock(&pContext->streamLock);
+
+            if (pSound == NULL) {
+                break;
+            }
+
+            mo_stream__fill(pSound);
+            mo_atomic_store_u32(&pSound->isStreamFilling, 0);
+        }
+
+        mo_event_wait_timeout(&pContext->streamWakeupEvent, pContext->streamThreadInterval);
+    }
+
+    return (mal_thread_result)0;
+}
+
+
+//// Mixer ////
+//
+// Everything in this section is run on the audio thread. The list of playing sounds (voices) is owned by the mixer and
+// is only changed in response to commands from the game thread, or when a sound reaches the end.
+
+static void mo_mixer__add_voice(mo_context* pContext, mo_sound* pSound)
+{
+    if (pSound->isInMixer) return;
+
+    pSound->pPrevVoice = NULL;
+    pSound->pNextVoice = pContext->pFirstVoice;
+    if (pContext->pFirstVoice != NULL) {
+        pContext->pFirstVoice->pPrevVoice = pSound;
+    }
+
+    pContext->pFirstVoice = pSound;
+    pSound->isInMixer = MO_TRUE;
+}
+
+static void mo_mixer__remove_voice(mo_context* pContext, mo_sound* pSound)
+{
+    if (!pSound->isInMixer) return;
+
+    if (pSound->pPrevVoice != NULL) {
+        pSound->pPrevVoice->pNextVoice = pSound->pNextVoice;
+    } else {
+        pContext->pFirstVoice = pSound->pNextVoice;
+    }
+    if (pSound->pNextVoice != NULL) {
+        pSound->pNextVoice->pPrevVoice = pSound->pPrevVoice;
+    }
+
+    pSound->pNextVoice = NULL;
+    pSound->pPrevVoice = NULL;
+    pSound->isInMixer = MO_FALSE;
+}
+
+static void mo_mixer__finish_voice(mo_context* pContext, mo_sound* pSound)
+{
+    // Called when a non-looping sound reaches the end.
+    pSound->mixerFlags &= ~MO_SOUND_FLAG_PLAYING;
+    mo_mixer__remove_voice(pContext, pSound);
+    mo_atomic_store_u32(&pSound->finishedPlayID, pSound->mixerPlayID);
+}
+
+static mo_uint32 mo_sound__get_source_sample_rate(mo_sound* pSound)
+{
+    mo_sound_source* pSource = pSound->pSource;
+    if (pSource->type == mo_sound_source_type_raw) {
+        return pSource->raw.sampleRate;
+    }
+
+    return pSound->decoder.sampleRate;
+}
+
+static mo_uint32 mo_sound__mix_stream_frames(mo_sound* pSound, float* pFrames, mo_uint32 frameCount, float volumeL, float volumeR, mo_bool32* pReachedEnd)
+{
+    // Mixes up to frameCount frames out of a sound's ring buffer. When less than frameCount is returned the sound has
+    // either reached the end or the streaming thread has fallen behind, which is counted as an underrun. The end flag is
+    // read before the write index so that once it's set every frame up to the end is guaranteed to be visible.
+    mo_context* pContext = pSound->pContext;
+    const mo_uint32 deviceChannels = pContext->playbackDevice2.channels;
+    const mo_uint32 soundChannels = pSound->decoder.channels;
+    const mo_uint32 bufferSizeInFrames = pSound->streamBufferSizeInFrames;
+
+    // Nothing has been decoded yet. This isn't an underrun because the streaming thread hasn't had a chance yet.
+    if (!mo_atomic_load_u32(&pSound->isStreamReady)) {
+        *pReachedEnd = MO_FALSE;
+        return 0;
+    }
+
+    mo_bool32 isAtEnd = mo_atomic_load_u32(&pSound->isStreamAtEnd);
+    mo_uint32 readIndex = pSound->streamReadIndex;
+    mo_uint32 framesAvailable = mo_atomic_load_u32(&pSound->streamWriteIndex) - readIndex;
+
+    mo_uint32 totalFramesRead = 0;
+    while (totalFramesRead < frameCount && framesAvailable > 0) {
+        // The buffer may wrap around.
+        mo_uint32 offset = readIndex & (bufferSizeInFrames-1);
+        mo_uint32 framesToRead = frameCount - totalFramesRead;
+        if (framesToRead > framesAvailable) {
+            framesToRead = framesAvailable;
+        }
+        if (framesToRead > bufferSizeInFrames - offset) {
+            framesToRead = bufferSizeInFrames - offset;
+        }
+
+        mo_mix_s16_frames(pContext, pFrames + totalFramesRead*deviceChannels, deviceChannels, pSound->pStreamBuffer + offset*soundChannels, soundChannels, framesToRead, volumeL, volumeR);
+        readIndex += framesToRead;
+        framesAvailable -= framesToRead;
+        totalFramesRead += framesToRead;
+    }
+
+    mo_atomic_store_u32(&pSound->streamReadIndex, readIndex);
+
+    *pReachedEnd = isAtEnd && framesAvailable == 0;
+    if (totalFramesRead < frameCount && !*pReachedEnd) {
+        mo_atomic_store_u32(&pSound->underrunCount, pSound->underrunCount + 1);
+        mo_atomic_store_u32(&pContext->audioUnderrunCount, pContext->audioUnderrunCount + 1);
+    }
+
+    return totalFramesRead;
+}
+
+static void mo_mixer__reset_resampler(mo_sound* pSound)
+{
+    // The history is treated as the silence before the first frame. The first output frame lands on the first frame
+    // read which comes straight after the history.
+    mo_zero_memory(pSound->resamplerHistory, sizeof(pSound->resamplerHistory));
+    pSound->resamplerPos = (mo_uint64)MO_RESAMPLER_TAPS << 32;
+}
+
+static void mo_mixer__update_resampler_step(mo_context* pContext, mo_sound* pSound)
+{
+    pSound->mixerResamplerStep = mo_resampler__calculate_step(mo_sound__get_source_sample_rate(pSound), pContext->playbackDevice2.sampleRate, pSound->mixerPitch);
+
+    // The first time a voice needs resampling its history is empty. When this happens in the middle of playback the
+    // polyphase filter will have silence for its first few taps, but the position carries on from where it was.
+    if (pSound->mixerResamplerStep != MO_RESAMPLER_UNITY_STEP && !pSound->isMixerResampling) {
+        mo_mixer__reset_resampler(pSound);
+        pSound->isMixerResampling = MO_TRUE;
+    }
+}
+
+static void mo_mixer__process_commands(mo_context* pContext)
+{
+    // This never waits on the game thread. Anything posted after the write index is read is handled next time.
+    mo_uint32 readIndex  = pContext->audioCommandReadIndex;
+    mo_uint32 writeIndex = mo_atomic_load_u32(&pContext->audioCommandWriteIndex);
+
+    for (; readIndex != writeIndex; readIndex += 1) {
+        const mo_audio_command* pCommand = &pContext->audioCommands[readIndex & (MO_AUDIO_COMMAND_QUEUE_SIZE-1)];
+        mo_sound* pSound = pCommand->pSound;
+
+        switch (pCommand->type)
+        {
+            case mo_audio_command_type_play:
+            {
+                pSound->mixerFlags = MO_SOUND_FLAG_PLAYING | ((pCommand->loop) ? MO_SOUND_FLAG_LOOPING : 0);
+                pSound->mixerPlayID = pCommand->playID;
+                if (!pSound->isInMixer) {
+                    pSound->isMixerResampling = MO_FALSE;
+                }
+                mo_mixer__update_resampler_step(pContext, pSound);
+                mo_mixer__add_voice(pContext, pSound);
+            } break;
+
+            case mo_audio_command_type_stop:
+            {
+                pSound->mixerFlags &= ~MO_SOUND_FLAG_PLAYING;
+                mo_mixer__remove_voice(pContext, pSound);
+            } break;
+
+            case mo_audio_command_type_set_volume:
+            {
+                pSound->mixerLinearVolume = pCommand->linearVolume;
+            } break;
+
+            case mo_audio_command_type_set_pan:
+            {
+                // Constant power. The gains are scaled so that a sound in the center is mixed at its normal volume,
+                // which means a sound panned hard to one side is 3dB louder on that side.
+                const float pi = 3.14159265f;
+                float angle = (pCommand->pan + 1) * (pi / 4);
+                pSound->mixerPanGainL = cosf(angle) * 1.41421356f;
+                pSound->mixerPanGainR = sinf(angle) * 1.41421356f;
+            } break;
+
+            case mo_audio_command_type_set_pitch:
+            {
+                pSound->mixerPitch = pCommand->pitch;
+                mo_mixer__update_resampler_step(pContext, pSound);
+            } break;
+
+            case mo_audio_command_type_delete:
+            {
+                // The sound must not be touched after it's been retired because the game thread may free it at any time.
+                mo_mixer__remove_voice(pContext, pSound);
+                mo_atomic_store_u32(&pSound->isRetired, 1);
+            } break;
+
+            case mo_audio_command_type_group_pause:
+            {
+                pContext->mixerSoundGroups[pCommand->group].flags |= MO_SOUND_GROUP_FLAG_PAUSED;
+            } break;
+
+            case mo_audio_command_type_group_resume:
+            {
+                pContext->mixerSoundGroups[pCommand->group].flags &= ~MO_SOUND_GROUP_FLAG_PAUSED;
+            } break;
+
+            case mo_audio_command_type_group_set_volume:
+            {
+                pContext->mixerSoundGroups[pCommand->group].linearVolume = pCommand->linearVolume;
+            } break;
+
+            default: break;
+        }
+    }
+
+    mo_atomic_store_u32(&pContext->audioCommandReadIndex, readIndex);
+}
+
+static mo_uint32 mo_sound__read_source_frames(mo_sound* pSound, mo_uint32 frameCount, float* pFrames)
+{
+    // Reads frames from the sound's data source in the device's channel layout, looping back to the start if the sound
+    // is looping. This only returns less than frameCount when a non-looping sound reaches the end.
+    mo_context* pContext = pSound->pContext;
+    mo_sound_source* pSource = pSound->pSource;
+    const mo_uint32 deviceChannels = pContext->playbackDevice2.channels;
+
+    mo_uint32 totalFramesRead = 0;
+    mo_bool32 justLooped = MO_FALSE;
+    while (totalFramesRead < frameCount) {
+        mo_uint32 framesToRead = frameCount - totalFramesRead;
+        float* pRunningFrames = pFrames + totalFramesRead*deviceChannels;
+        mo_uint32 framesRead = 0;
+
+        if (pSource->type == mo_sound_source_type_raw)
+        {
+            const mo_uint32 soundChannels = pSource->raw.channels;
+            mo_uint64 framesAvailable = (pSource->raw.sampleCount - pSound->raw.currentSample) / soundChannels;
+            framesRead = (framesAvailable < framesToRead) ? (mo_uint32)framesAvailable : framesToRead;
+
+            mo_zero_memory(pRunningFrames, framesRead * deviceChannels * sizeof(float));
+            mo_mix_s16_frames(pContext, pRunningFrames, deviceChannels, pSource->raw.pSampleData + pSound->raw.currentSample, soundChannels, framesRead, 1, 1);
+            pSound->raw.currentSample += framesRead * soundChannels;
+        }
+        else
+        {
+            // Looping is done by the streaming thread. If the buffer has run dry before the end the gap is filled with
+            // silence rather than ending the sound.
+            mo_bool32 reachedEnd;
+            mo_zero_memory(pRunningFrames, framesToRead * deviceChannels * sizeof(float));
+            framesRead = mo_sound__mix_stream_frames(pSound, pRunningFrames, framesToRead, 1, 1, &reachedEnd);
+            if (!reachedEnd) {
+                framesRead = framesToRead;
+            }
+        }
+
+        totalFramesRead += framesRead;
+
+        if (framesRead < framesToRead) {
+            // Reached the end. If nothing was read straight after looping the source is empty or broken and would
+            // otherwise loop forever.
+            if ((pSound->mixerFlags & MO_SOUND_FLAG_LOOPING) == 0 || (justLooped && framesRead == 0)) {
+                break;
+            }
+
+            if (pSource->type == mo_sound_source_type_raw) {
+                pSound->raw.currentSample = 0;
+            }
+            justLooped = MO_TRUE;
+        } else {
+            justLooped = MO_FALSE;
+        }
+    }
+
+    return totalFramesRead;
+}
+
+static void mo_sound__resample_and_accumulate_frames(mo_sound* pSound, float volumeL, float volumeR, mo_uint32 frameCount, float* pFrames)
+{
+    // This is the path taken by sounds whose sample rate doesn't match the device. Source frames are read into a window
+    // after the sound's history, resampled straight into the mix bus, and then the last few frames of the window become
+    // the new history.
+    mo_context* pContext = pSound->pContext;
+    const mo_uint32 channels = pContext->playbackDevice2.channels;
+    const mo_uint64 step = pSound->mixerResamplerStep;
+    const mo_uint32 historySizeInSamples = MO_RESAMPLER_TAPS * channels;
+    float* pWindow = pContext->resamplerWindow;
+
+    while (frameCount > 0) {
+        // The number of output frames is limited by how many source frames fit in the window.
+        mo_uint64 pos = pSound->resamplerPos;
+        mo_uint64 maxFrameCount = ((((mo_uint64)MO_RESAMPLER_WINDOW_SIZE_IN_FRAMES - MO_RESAMPLER_TAPS/2 - 1) << 32) - pos) / step;
+
+        mo_uint32 framesToProcess = frameCount;
+        if (framesToProcess > maxFrameCount) {
+            framesToProcess = (mo_uint32)maxFrameCount;
+        }
+
+        // Enough frames are read that the new position lands in the same place relative to the new history.
+        mo_uint64 newPos = pos + framesToProcess*step;
+        mo_uint32 framesToRead = (mo_uint32)(newPos >> 32) - (MO_RESAMPLER_TAPS/2 - 1);
+
+        mo_copy_memory(pWindow, pSound->resamplerHistory, historySizeInSamples * sizeof(float));
+        mo_uint32 framesRead = mo_sound__read_source_frames(pSound, framesToRead, pWindow + historySizeInSamples);
+        if (framesRead < framesToRead) {
+            mo_zero_memory(pWindow + historySizeInSamples + framesRead*channels, (framesToRead - framesRead) * channels * sizeof(float));
+        }
+
+        mo_resample__accumulate(pContext, pWindow, channels, pos, step, pFrames, framesToProcess, volumeL, volumeR);
+
+        mo_copy_memory(pSound->resamplerHistory, pWindow + framesToRead*channels, historySizeInSamples * sizeof(float));
+        pSound->resamplerPos = newPos - ((mo_uint64)framesToRead << 32);
+
+        frameCount -= framesToProcess;
+        pFrames += framesToProcess * channels;
+
+        if (framesRead < framesToRead) {
+            // The tail of the filter has been flushed with silence so there's nothing left to output.
+            mo_mixer__finish_voice(pContext, pSound);
+            break;
+        }
+    }
+}
+
+mo_uint32 mo_sound__read_and_accumulate_frames(mo_sound* pSound, float linearVolume, mo_uint32 frameCount, float* pFrames)
+{
+    // This is the main mixing function. pFrames is an in/out buffer - samples are read from the sound's data source
+    // and then accumated with the samples already in the buffer. The buffer is the floating point mix bus, in the
+    // range of a signed 16-bit integer. It is not clamped here - that's done once for the whole mix at the end.
+    //
+    // When a sound reaches the end of it's data source it will either loop or just stop. When it stops it's removed
+    // from the mixer and the game thread is notified via finishedPlayID. If it's an inline sound it will be deleted
+    // by the game thread the next time it collects garbage. This function is called on the audio thread so it must
+    // never touch anything owned by the game thread.
+
+    // Currently assuming the device is stereo. When/if different channel counts are supported we'll need to look
+    // into making this more robust.
+    mo_assert(pSound->pContext->playbackDevice2.channels <= 2);
+
+    mo_uint32 totalFramesRead = 0;
+
+    mo_sound_source* pSource = pSound->pSource;
+    mo_assert(pSource != NULL);
+
+    // Panning is done by giving each channel its own volume. The pan gains are calculated when the pan is set.
+    float volumeL = linearVolume;
+    float volumeR = linearVolume;
+    if (pSound->pContext->playbackDevice2.channels == 2) {
+        volumeL *= pSound->mixerPanGainL;
+        volumeR *= pSound->mixerPanGainR;
+    }
+
+    if (pSound->isMixerResampling) {
+        mo_sound__resample_and_accumulate_frames(pSound, volumeL, volumeR, frameCount, pFrames);
+        return totalFramesRead;
+    }
+
+    if (pSource->type == mo_sound_source_type_raw)
+    {
+        const mo_uint32 soundChannels = pSound->pSource->raw.channels;
+        const mo_uint32 deviceChannels = pSound->pContext->playbackDevice2.channels;
+        while (frameCount > 0) {
+            mo_uint64 framesAvailable = (pSound->pSource->raw.sampleCount - pSound->raw.currentSample) / soundChannels;
+            if (framesAvailable > frameCount) {
+                framesAvailable = frameCount;
+            }
+
+            mo_mix_s16_frames(pSound->pContext, pFrames, deviceChannels, pSound->pSource->raw.pSampleData + pSound->raw.currentSample, soundChannels, (mo_uint32)framesAvailable, volumeL, volumeR);
+            pSound->raw.currentSample += framesAvailable * soundChannels;
+
+            mo_bool32 reachedEnd = framesAvailable < frameCount;
+            frameCount -= (mo_uint32)framesAvailable;   // <-- Safe cast because we clamped it to frameCount which is 32-bit.
+            pFrames += framesAvailable * deviceChannels;
+
+            if (reachedEnd) {
+                if ((pSound->mixerFlags & MO_SOUND_FLAG_LOOPING) != 0) {
+                    pSound->raw.currentSample = 0;
+                } else {
+                    mo_mixer__finish_voice(pSound->pContext, pSound);
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        // Looping is done by the streaming thread so all that needs doing here is to finish the sound once the end has
+        // been reached. Anything short of that is an underrun which is just left silent.
+        mo_bool32 reachedEnd;
+        mo_sound__mix_stream_frames(pSound, pFrames, frameCount, volumeL, volumeR, &reachedEnd);
+        if (reachedEnd) {
+            mo_mixer__finish_voice(pSound->pContext, pSound);
+        }
+    }
+
+    return totalFramesRead;
+}
+
+static void mo_mixer__convert_bus_to_s16(mo_int16* pDst, const float* pSrc, mo_uint32 sampleCount)
+{
+    // Clamps the mix bus and converts it to the output format. This is the only place clipping happens.
+    mo_uint32 i = 0;
+
+#if defined(MO_SUPPORT_SSE2)
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps( 32767.0f);
+    for (; i + 8 <= sampleCount; i += 8) {
+        __m128i a = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(pSrc + i + 0), lo), hi));
+        __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(pSrc + i + 4), lo), hi));
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_packs_epi32(a, b));
+    }
+#elif defined(MO_SUPPORT_NEON)
+    // The float to int conversion and narrowing both saturate so there's no need for an explicit clamp.
+    for (; i + 8 <= sampleCount; i += 8) {
+        int16x4_t a = vqmovn_s32(vcvtq_s32_f32(vld1q_f32(pSrc + i + 0)));
+        int16x4_t b = vqmovn_s32(vcvtq_s32_f32(vld1q_f32(pSrc + i + 4)));
+        vst1q_s16(pDst + i, vcombine_s16(a, b));
+    }
+#endif
+
+    for (; i < sampleCount; ++i) {
+        pDst[i] = (mo_int16)mo_clampf(pSrc[i], -32768.0f, 32767.0f);
+    }
+}
+
+mal_uint32 mo_on_send_frames__mal(mal_device* pDevice, mal_uint32 frameCount, void* pFrames)
+{
+    // This is where all of our audio mixing is done.
+    mo_context* pContext = (mo_context*)pDevice->pUserData;
+    mo_assert(pContext != NULL);
+
+    // The output buffer is in s16 format.
+    mo_int16* pFramesS16 = (mal_int16*)pFrames;
+    mo_assert(pFramesS16 != NULL);
+
+    // Mixing is easy - we just need to accumulate each sound, making sure we adjust for volume. If a sound reaches
+    // the end of it's data source we need to either loop or stop the sound.
+
+    // Commands from the game thread are applied first so the voice list is up to date.
+    mo_mixer__process_commands(pContext);
+
+    // Sounds are accumulated into a floating point mix bus which is then clamped and converted in one go. The bus is
+    // a fixed size so the output is done in chunks if necessary.
+    const mo_uint32 channels = pDevice->channels;
+    const mo_uint32 busSizeInFrames = MO_MIX_BUS_SIZE_IN_SAMPLES / channels;
+    const mo_sound_group* pGroups = pContext->mixerSoundGroups;
+
+    mo_uint32 framesRemaining = frameCount;
+    while (framesRemaining > 0) {
+        mo_uint32 framesToMix = framesRemaining;
+        if (framesToMix > busSizeInFrames) {
+            framesToMix = busSizeInFrames;
+        }
+
+        // Important that we clear the bus to zero since we'll be accumulating.
+        mo_zero_memory(pContext->mixBus, framesToMix * channels * sizeof(float));
+
+        mo_sound* pSound = pContext->pFirstVoice;
+        while (pSound != NULL) {
+            mo_sound* pNextSound = pSound->pNextVoice;  // <-- Retrieve this first since the sound will be removed from the list if it reaches the end.
+
+            if ((pGroups[pSound->group].flags & MO_SOUND_GROUP_FLAG_PAUSED) == 0) {
+                float linearVolume = pSound->mixerLinearVolume * pGroups[pSound->group].linearVolume * pGroups[MO_SOUND_GROUP_MASTER].linearVolume;
+                if (linearVolume > 0) {
+                    mo_sound__read_and_accumulate_frames(pSound, linearVolume, framesToMix, pContext->mixBus);
+                }
+            }
+
+            pSound = pNextSound;
+        }
+
+        mo_mixer__convert_bus_to_s16(pFramesS16, pContext->mixBus, framesToMix * channels);
+
+        pFramesS16 += framesToMix * channels;
+        framesRemaining -= framesToMix;
+    }
+
+    return frameCount;
+}
+
+static void mo_audio__wait_for_mixer(mo_context* pContext)
+{
+    // Called from the game thread whenever it needs the audio thread to make progress. If the device isn't running
+    // (it failed to start, was stopped, or has been uninitialized) nothing is going to process the command queue, so
+    // it's drained here instead of waiting forever. This is safe because the audio thread isn't touching the mixer.
+    if (mal_device_is_started(&pContext->playbackDevice2)) {
+        mo_yield();
+    } else {
+        mo_mixer__process_commands(pContext);
+    }
+}
+
+static void mo_audio__post_command(mo_context* pContext, const mo_audio_command* pCommand)
+{
+    // Called from the game thread. If the queue is full we need to wait for the audio thread to catch up. This should
+    // only ever happen under extreme load, and it's the game thread that waits rather than the audio thread.
+    mo_uint32 writeIndex = pContext->audioCommandWriteIndex;
+    while (writeIndex - mo_atomic_load_u32(&pContext->audioCommandReadIndex) == MO_AUDIO_COMMAND_QUEUE_SIZE) {
+        mo_audio__wait_for_mixer(pContext);
+    }
+
+    pContext->audioCommands[writeIndex & (MO_AUDIO_COMMAND_QUEUE_SIZE-1)] = *pCommand;
+    mo_atomic_store_u32(&pContext->audioCommandWriteIndex, writeIndex + 1);
+}
+
+static void mo_sound__close_decoder(mo_sound* pSound)
+{
+    mo_assert(pSound != NULL);
+
+    if (pSound->pSource->type != mo_sound_source_type_raw) {
+        if (pSound->decoder.pDecoder != NULL) {
+            mo_stream__close_decoder(pSound->decoder.type, pSound->decoder.pDecoder);
+        }
+        mo_free(pSound->pStreamBuffer);
+    }
+}
+
+static void mo_sound__release(mo_sound* pSound)
+{
+    // Only call this once the audio thread has retired the sound.
+    mo_assert(pSound != NULL);
+
+    mo_context* pContext = pSound->pContext;
+    mo_sound__close_decoder(pSound);
+
+    pSound->pNextFreeSound = pContext->pFirstFreeSound;
+    pContext->pFirstFreeSound = pSound;
+}
+
+static void mo_audio__release_retired_sounds(mo_context* pContext)
+{
+    for (mo_uint32 iSound = 0; iSound < pContext->retiringSoundCount; /* DO NOTHING */) {
+        mo_sound* pSound = pContext->ppRetiringSounds[iSound];
+        if (mo_atomic_load_u32(&pSound->isRetired) && !mo_atomic_load_u32(&pSound->isStreamFilling)) {
+            mo_sound__release(pSound);
+            pContext->ppRetiringSounds[iSound] = pContext->ppRetiringSounds[pContext->retiringSoundCount-1];
+            pContext->retiringSoundCount -= 1;
+        } else {
+            iSound += 1;
+        }
+    }
+}
+
+static void mo_audio__collect_garbage(mo_context* pContext)
+{
+    // Inlined sounds are deleted once they've finished playing.
+    if (pContext->inlinedSoundCount > 0) {
+        for (mo_uint32 iSound = 0; iSound < pContext->soundCount; /* DO NOTHING */) {
+            mo_sound* pSound = pContext->ppSounds[iSound];
+            if ((pSound->flags & MO_SOUND_FLAG_INLINED) != 0 && !mo_sound_is_playing(pSound)) {
+                mo_sound_delete(pSound);
+            } else {
+                iSound += 1;
+            }
+        }
+    }
+
+    if (pContext->isSoundMarkedForDeletion) {
+        for (mo_uint32 iSound = 0; iSound < pContext->soundCount; /* DO NOTHING */) {
+            if (pContext->ppSounds[iSound]->isMarkedForDeletion) {
+                mo_sound_delete(pContext->ppSounds[iSound]);
+            } else {
+                iSound += 1;
+            }
+        }
+
+        pContext->isSoundMarkedForDeletion = MO_FALSE;
+    }
+
+    // Deleted sounds can be returned to the pool once the audio thread has let go of them.
+    mo_audio__release_retired_sounds(pContext);
+}
+
+mo_result mo_init_audio(mo_context* pContext)
+{
+    mo_assert(pContext != NULL);
+
+    mo_resampler__init_coefficients(pContext);
+
+    // The sound pool. Every slot starts off in the free list.
+    pContext->soundPoolSize = pContext->profile.maxSounds * 2;
+    pContext->pSoundPool = (mo_sound*)mo_calloc(pContext->soundPoolSize * sizeof(*pContext->pSoundPool));
+    pContext->ppSounds = (mo_sound**)mo_calloc(pContext->profile.maxSounds * sizeof(*pContext->ppSounds));
+    pContext->ppRetiringSounds = (mo_sound**)mo_calloc(pContext->soundPoolSize * sizeof(*pContext->ppRetiringSounds));
+    if (pContext->pSoundPool == NULL || pContext->ppSounds == NULL || pContext->ppRetiringSounds == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    for (mo_uint32 iSound = pContext->soundPoolSize; iSound > 0; --iSound) {
+        mo_sound* pSound = &pContext->pSoundPool[iSound-1];
+        pSound->pContext = pContext;
+        pSound->pNextFreeSound = pContext->pFirstFreeSound;
+        pContext->pFirstFreeSound = pSound;
+    }
+
+    // The streaming thread. This sits idle until a sound is created from a compressed source.
+    pContext->ppStreamingSounds = (mo_sound**)mo_calloc(pContext->profile.maxSounds * sizeof(*pContext->ppStreamingSounds));
+    if (pContext->ppStreamingSounds == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    pContext->streamThreadInterval = pContext->profile.audioDecodeAheadMilliseconds / 4000.0;
+    if (pContext->streamThreadInterval > MO_STREAM_THREAD_INTERVAL) {
+        pContext->streamThreadInterval = MO_STREAM_THREAD_INTERVAL;
+    }
+
+    if (!mal_mutex_create(&pContext->streamLock)) {
+        return MO_ERROR;
+    }
+    if (!mal_event_create(&pContext->streamWakeupEvent)) {
+        mal_mutex_delete(&pContext->streamLock);
+        return MO_ERROR;
+    }
+    if (!mal_thread_create(&pContext->streamThread, mo_stream_thread, pContext)) {
+        mal_event_delete(&pContext->streamWakeupEvent);
+        mal_mutex_delete(&pContext->streamLock);
+        return MO_ERROR;
+    }
+
+    pContext->hasStreamThread = MO_TRUE;
+
+    // Sound groups. The audio thread has it's own copy which is kept up to date with commands.
+    for (int i = 0; i < MO_SOUND_GROUP_COUNT; ++i) {
+        pContext->soundGroups[i].linearVolume = 1;
+        pContext->mixerSoundGroups[i].linearVolume = 1;
+    }
+
+    mal_device_config config;
+    config.format = mal_format_s16;
+    config.channels = pContext->profile.audioChannels;
+    config.sampleRate = pContext->profile.audioSampleRate;
+    config.bufferSizeInFrames = 0;
+    config.periods = 0;
+    config.onSendCallback = mo_on_send_frames__mal;
+    config.onRecvCallback = NULL;
+    config.onStopCallback = NULL;
     config.onLogCallback  = mo_on_log__mal;
     mal_result resultMAL = mal_device_init(&pContext->playbackDevice2, mal_device_type_playback, NULL, &config, pContext);
     if (resultMAL != MAL_SUCCESS) {
         return MO_ERROR;
     }
 
-    // Start the device now, but we might want to make this a bit more intelligent and only have the
-    // device running while a sound needs to be played.
-    mal_device_start(&pContext->playbackDevice2);
+    // Start the device now, but we might want to make this a bit more intelligent and only have the
+    // device running while a sound needs to be played. A failure here isn't fatal. Sounds are just silent, and
+    // commands are processed on the game thread by mo_audio__wait_for_mixer() when they'd otherwise wait.
+    resultMAL = mal_device_start(&pContext->playbackDevice2);
+    if (resultMAL != MAL_SUCCESS) {
+        mo_logf(pContext, "[AUDIO] Failed to start playback device (%d).", (int)resultMAL);
+    }
+
+    return MO_SUCCESS;
+}
+
+void mo_uninit_audio(mo_context* pContext)
+{
+    mo_assert(pContext != NULL);
+
+    // The audio thread is stopped first. From here on nothing else processes the command queue.
+    mal_device_uninit(&pContext->playbackDevice2);
+
+    // Inlined and marked sounds are deleted before anything else. This posts more delete commands, and it takes the
+    // stream lock so it needs to be done while the streaming thread is still around.
+    mo_audio__collect_garbage(pContext);
+
+    if (pContext->hasStreamThread) {
+        mo_atomic_store_u32(&pContext->isStreamThreadTerminating, 1);
+        mal_event_signal(&pContext->streamWakeupEvent);
+        mal_thread_wait(&pContext->streamThread);
+        mal_event_delete(&pContext->streamWakeupEvent);
+        mal_mutex_delete(&pContext->streamLock);
+    }
+
+    // Processing the outstanding commands retires every deleted sound, after which they can all be released.
+    mo_mixer__process_commands(pContext);
+    mo_audio__release_retired_sounds(pContext);
+
+    // Sounds that the application never deleted still need their decoders closed.
+    for (mo_uint32 iSound = 0; iSound < pContext->soundCount; ++iSound) {
+        mo_sound__close_decoder(pContext->ppSounds[iSound]);
+    }
+
+    mo_free(pContext->ppStreamingSounds);
+    mo_free(pContext->ppRetiringSounds);
+    mo_free(pContext->ppSounds);
+    mo_free(pContext->pSoundPool);
+}
+
+
+mo_color_rgba mo_make_rgba(mo_uint8 r, mo_uint8 g, mo_uint8 b, mo_uint8 a)
+{
+    mo_color_rgba result;
+    result.b = b;
+    result.g = g;
+    result.r = r;
+    result.a = a;
+    return result;
+}
+
+mo_color_rgba mo_make_rgb(mo_uint8 r, mo_uint8 g, mo_uint8 b)
+{
+    return mo_make_rgba(r, g, b, 255);
+}
+
+static mo_bool32 mo_tile_equal(const mo_color_index* pA, const mo_color_index* pB, mo_uint32 stride, mo_uint32 sizeX, mo_uint32 sizeY)
+{
+    // Full width tiles are exactly one 128-bit register per row. The differences of each row are accumulated and
+    // tested once at the end.
+#if defined(MO_SUPPORT_SSE2)
+    if (sizeX == 16) {
+        __m128i diff = _mm_setzero_si128();
+        for (mo_uint32 y = 0; y < sizeY; ++y) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(pA + (y * stride)));
+            __m128i b = _mm_loadu_si128((const __m128i*)(pB + (y * stride)));
+            diff = _mm_or_si128(diff, _mm_xor_si128(a, b));
+        }
+
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+    }
+#elif defined(MO_SUPPORT_NEON)
+    if (sizeX == 16) {
+        uint8x16_t diff = vdupq_n_u8(0);
+        for (mo_uint32 y = 0; y < sizeY; ++y) {
+            diff = vorrq_u8(diff, veorq_u8(vld1q_u8(pA + (y * stride)), vld1q_u8(pB + (y * stride))));
+        }
+
+        uint64x2_t diff64 = vreinterpretq_u64_u8(diff);
+        return (vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) == 0;
+    }
+#endif
+
+    for (mo_uint32 y = 0; y < sizeY; ++y) {
+        if (memcmp(pA + (y * stride), pB + (y * stride), sizeX) != 0) {
+            return MO_FALSE;
+        }
+    }
+
+    return MO_TRUE;
+}
+
+static void mo_diff_screen(mo_context* pContext)
+{
+    // Replaces the dirty tiles with the tiles that are actually different to what was last presented. This is done
+    // independently of whatever was marked by the drawing routines so it also picks up direct writes to the screen.
+    mo_uint32 stride = pContext->profile.resolutionX;
+
+    if (pContext->isFullPresentPending) {
+        mo_copy_memory(pContext->pPrevPresentScreen, pContext->screen, pContext->profile.resolutionX * pContext->profile.resolutionY);
+        mo_mark_all_dirty(pContext);
+        pContext->isFullPresentPending = MO_FALSE;
+        return;
+    }
+
+    for (mo_uint32 tileY = 0; tileY < pContext->dirtyTileCountY; ++tileY) {
+        mo_uint32 top    = tileY * MO_DIRTY_TILE_SIZE;
+        mo_uint32 sizeY  = pContext->profile.resolutionY - top;
+        if (sizeY > MO_DIRTY_TILE_SIZE) sizeY = MO_DIRTY_TILE_SIZE;
+
+        for (mo_uint32 tileX = 0; tileX < pContext->dirtyTileCountX; ++tileX) {
+            mo_uint32 left  = tileX * MO_DIRTY_TILE_SIZE;
+            mo_uint32 sizeX = pContext->profile.resolutionX - left;
+            if (sizeX > MO_DIRTY_TILE_SIZE) sizeX = MO_DIRTY_TILE_SIZE;
+
+            mo_uint32 offset = (top * stride) + left;
+            mo_uint8* pDirty = pContext->pDirtyTiles + (tileY * pContext->dirtyTileCountX) + tileX;
+            if (mo_tile_equal(pContext->screen + offset, pContext->pPrevPresentScreen + offset, stride, sizeX, sizeY)) {
+                *pDirty = 0;
+            } else {
+                *pDirty = 1;
+                for (mo_uint32 y = 0; y < sizeY; ++y) {
+                    mo_copy_memory(pContext->pPrevPresentScreen + offset + (y * stride), pContext->screen + offset + (y * stride), sizeX);
+                }
+            }
+        }
+    }
+}
+
+static void mo_update_dirty_tiles(mo_context* pContext)
+{
+    // Works out which tiles need to be presented this frame and takes the snapshot of the palette they're presented
+    // with. This is always done on the game thread, and never while an asynchronous present is in progress.
+    if (memcmp(pContext->prevPresentPalette, pContext->profile.palette, sizeof(pContext->prevPresentPalette)) != 0) {
+        mo_copy_memory(pContext->prevPresentPalette, pContext->profile.palette, sizeof(pContext->prevPresentPalette));
+        mo_mark_presentation_stale(pContext);
+    }
+
+    if (pContext->profile.diffPresent) {
+        mo_diff_screen(pContext);
+    } else if (!pContext->profile.dirtyPresent) {
+        mo_mark_all_dirty(pContext);
+    }
+}
+
+static void mo_present__screen(mo_context* pContext, const mo_color_index* pScreen, const mo_color_rgba* pPalette, mo_uint8* pDirtyTiles)
+{
+    // Presents the given virtual screen buffer to the window. This is called from the asynchronous presentation thread
+    // when profile.asyncPresent is enabled. Only the tiles marked in pDirtyTiles are updated, after which they're
+    // all cleared. pPalette is a snapshot taken on the game thread, never the live profile.palette.
+    mo_uint32 tileCount = pContext->dirtyTileCountX * pContext->dirtyTileCountY;
+    mo_uint32 dirtyTileCount = mo_count_dirty_tiles(pContext, pDirtyTiles);
+
+#ifdef MO_WIN32
+    // Conveniently, we can get Win32 to do the scaling for us. This means we're able to do an efficient 1x1 copy ourselves and then
+    // let the OS do the rest for us. Of course, there's a chance we could do it more efficiently ourselves, but maybe not.
+
+    // OPTIMIZATION NOTES
+    // ==================
+    // - It's more efficient to flip the screen ourselves than passing in a negative height to StretchDIBits().
+    // - CreateDIBSection() + StretchBlt() is more efficient than StretchDIBits() by a tiny amount.
+    // - BitBlt() is a tiny bit faster than StretchBlt(), but it's less than a microsecond. Probably not worth it.
+    //
+    // THINGS TO TRY
+    // -------------
+    // [DONE] Try using a palette (DIB_PAL_COLORS).
+    //     RESULT: Couldn't figure out how to get it working properly. Probably not worthwhile.
+
+#if 0
+    BITMAPINFO bmi;
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = screenWidth;
+    bmi.bmiHeader.biHeight = screenHeight;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    for (int y = 0; y < screenHeight; ++y) {
+        mo_uint32* pDstRow = ((mo_uint32*)pContext->pScreenRGBA) + (y * screenWidth);
+        for (int x = 0; x < screenWidth; ++x) {
+            unsigned int screenX = x;
+            unsigned int screenY = y;
+            //pDstRow[x] = pContext->palette[(pContext->screen[screenY][screenX] & 0x03)].rgba;
+            pDstRow[x] = pContext->palette[pContext->screen[screenHeight - screenY - 1][screenX]].rgba;    // <-- Needs to be upside down for Win32. Can also use a negative scale in StretchDIBits()
+        }
+    }
+
+    // Note how the height and Y position is flipped in order to make it the right way around.
+    //
+    // Questions:
+    //   - Does flipping upside down force it down a slower path? A) Yes, it's slower.
+    //StretchDIBits(pContext->hDC, 0, pContext->windowHeight-1, pContext->windowWidth, -pContext->windowHeight, 0, 0, screenWidth, screenHeight, pContext->pScreenRGBA, &bmi, DIB_RGB_COLORS, SRCCOPY);
+    StretchDIBits(pContext->hDC, 0, 0, pContext->windowWidth, pContext->windowHeight, 0, 0, screenWidth, screenHeight, pContext->pScreenRGBA, &bmi, DIB_RGB_COLORS, SRCCOPY);
+#else
+    // Before writing the data to the DIB section we need to flush GDI.
+    //GdiFlush();
 
-    return MO_SUCCESS;
+    // The DIB section is the same size as the virtual screen so it can all be converted in one go, or one row of each
+    // dirty run at a time. The whole DIB is always stretched to the window since we don't handle WM_PAINT.
+    if (dirtyTileCount == tileCount) {
+        mo_expand_color_indices(pContext, pPalette, (mo_uint32*)pContext->pScreenRGBA_DIB, pScreen, pContext->profile.resolutionX * pContext->profile.resolutionY);
+    } else {
+        mo_uint32 tileIndex = 0;
+        mo_uint32 left, top, right, bottom;
+        while (mo_next_dirty_run(pContext, pDirtyTiles, &tileIndex, &left, &top, &right, &bottom)) {
+            for (mo_uint32 y = top; y < bottom; ++y) {
+                mo_uint32 offset = (y * pContext->profile.resolutionX) + left;
+                mo_expand_color_indices(pContext, pPalette, (mo_uint32*)pContext->pScreenRGBA_DIB + offset, pScreen + offset, right - left);
+            }
+        }
+    }
+
+    // GDI device contexts must not be shared between threads. The window class uses CS_OWNDC so the cached DC belongs
+    // to the game thread. When presenting asynchronously a DC is taken from the system cache instead (DCX_CACHE
+    // overrides CS_OWNDC) and released straight away.
+    HDC hDC = pContext->hDC;
+    if (pContext->profile.asyncPresent) {
+        hDC = GetDCEx(pContext->hWnd, NULL, DCX_CACHE);
+    }
+
+    if (hDC != NULL) {
+        StretchBlt(hDC, 0, 0, pContext->windowWidth, pContext->windowHeight, pContext->hDIBDC, 0, 0, pContext->profile.resolutionX, pContext->profile.resolutionY, SRCCOPY);
+        if (pContext->profile.asyncPresent) {
+            ReleaseDC(pContext->hWnd, hDC);
+        }
+    }
+#endif
+#endif
+
+#ifdef MO_X11
+    // OPTIMZATION NOTES
+    // =================
+    // - The MIT-SHM extension using XShmPutImage() is about 7 microseconds faster than XPutImage() @ 160x144.
+    //
+    //
+    // THINGS TO TRY
+    // -------------
+    // [DONE] MIT-SHM Extension: https://linux.die.net/man/3/xshmputimage
+    //     RESULT: A good optimization. About 7 microseconds faster @ 160x144 and scales with higher resolutions.
+    // [DONE] Integer scaling with row replication instead of per-pixel floating point scaling.
+    //     RESULT: About 8x faster @ 1920x1080. See mo_present__expand_and_scale().
+    // [DONE] Dirty tile tracking so only changed regions are converted and sent with XShmPutImage().
+    //     RESULT: Nothing at all is done for static frames. When everything is dirty (such as after mo_clear()) the
+    //             whole buffer is done in one go, which is the same cost as before.
+
+    if (pContext->pPresentBufferX11 != NULL) {
+        if (dirtyTileCount == tileCount) {
+            mo_present__expand_and_scale(pContext, pScreen, pPalette, pContext->pPresentBufferX11->width, pContext->pPresentBufferX11->height, (mo_uint32*)pContext->pPresentBufferX11->data);
+            mo_x11_present(pContext);
+        } else if (dirtyTileCount > 0) {
+            mo_present__expand_and_scale_dirty(pContext, pScreen, pPalette, pDirtyTiles, pContext->pPresentBufferX11->width, pContext->pPresentBufferX11->height, (mo_uint32*)pContext->pPresentBufferX11->data);
+        }
+    }
+#endif
+
+#ifdef MO_HEADLESS
+    // There's no window to present to, but we still do the conversion so that the surface can be inspected by the
+    // application and so that the cost of presentation is representative of a real window.
+    if (pContext->pPresentBufferHeadless != NULL) {
+        if (dirtyTileCount == tileCount) {
+            mo_present__expand_and_scale(pContext, pScreen, pPalette, pContext->presentBufferWidthHeadless, pContext->presentBufferHeightHeadless, pContext->pPresentBufferHeadless);
+        } else if (dirtyTileCount > 0) {
+            mo_present__expand_and_scale_dirty(pContext, pScreen, pPalette, pDirtyTiles, pContext->presentBufferWidthHeadless, pContext->presentBufferHeightHeadless, pContext->pPresentBufferHeadless);
+        }
+    }
+#endif
+
+    mo_zero_memory(pDirtyTiles, tileCount);
 }
 
-void mo_uninit_audio(mo_context* pContext)
+static mal_thread_result MAL_THREADCALL mo_async_present_thread(void* pData)
 {
+    mo_context* pContext = (mo_context*)pData;
     mo_assert(pContext != NULL);
 
-    mal_device_uninit(&pContext->playbackDevice2);
+    for (;;) {
+        mal_event_wait(&pContext->asyncPresentWakeupEvent);
+        if (pContext->isAsyncPresentTerminating) {
+            break;
+        }
+
+        mo_present__screen(pContext, pContext->pAsyncPresentScreen, pContext->prevPresentPalette, pContext->pAsyncPresentDirtyTiles);
+        mal_event_signal(&pContext->asyncPresentDoneEvent);
+    }
+
+    return (mal_thread_result)0;
 }
 
+static void mo_palette_lookup__check(mo_context* pContext);
 
-mo_color_rgba mo_make_rgba(mo_uint8 r, mo_uint8 g, mo_uint8 b, mo_uint8 a)
+static void mo_present__async(mo_context* pContext)
 {
-    mo_color_rgba result;
-    result.b = b;
-    result.g = g;
-    result.r = r;
-    result.a = a;
-    return result;
+    // The virtual screen is copied rather than swapped so that it retains it's contents between steps, just like when
+    // presenting synchronously.
+    mo_wait_for_async_present(pContext);
+    mo_update_dirty_tiles(pContext);
+    mo_palette_lookup__check(pContext);
+
+    mo_copy_memory(pContext->pAsyncPresentScreen, pContext->screen, pContext->profile.resolutionX * pContext->profile.resolutionY * sizeof(mo_color_index));
+    mo_copy_memory(pContext->pAsyncPresentDirtyTiles, pContext->pDirtyTiles, pContext->dirtyTileCountX * pContext->dirtyTileCountY);
+    mo_zero_memory(pContext->pDirtyTiles, pContext->dirtyTileCountX * pContext->dirtyTileCountY);
+
+    pContext->isAsyncPresentBusy = MO_TRUE;
+    mal_event_signal(&pContext->asyncPresentWakeupEvent);
 }
 
-mo_color_rgba mo_make_rgb(mo_uint8 r, mo_uint8 g, mo_uint8 b)
+void mo_present(mo_context* pContext)
 {
-    return mo_make_rgba(r, g, b, 255);
+    if (pContext == NULL) return;
+
+    mo_wait_for_async_present(pContext);
+    mo_update_dirty_tiles(pContext);
+    mo_palette_lookup__check(pContext);
+
+    mo_present__screen(pContext, pContext->screen, pContext->prevPresentPalette, pContext->pDirtyTiles);
+}
+
+#define MO_COLOR_CUBE_CELL_COUNT    (32*64*32)
+
+// The number of lookups per palette entry before the color cube is built. Up until this point the lookups are done
+// with a full search of the palette which is cheaper than building the cube for only a few lookups.
+#define MO_COLOR_CUBE_SEARCHES_PER_ENTRY    1024
+
+static void mo_color_cube__free(mo_context* pContext)
+{
+    mo_free(pContext->pColorCubeOffsets);
+    mo_free(pContext->pColorCubeEntries);
+    pContext->pColorCubeOffsets = NULL;
+    pContext->pColorCubeEntries = NULL;
+}
+
+// Builds the lookup used by mo_find_closest_color(). A palette entry can only be the closest match for a color in a
+// cell if its nearest distance to the cell is no greater than the furthest distance to the cell of the entry that's
+// furthest away at worst. Keeping every such entry means the lookup gives exactly the same result as a full search.
+// Distances are per-channel so they're calculated per axis up front and summed per cell.
+static void mo_color_cube__build(mo_context* pContext)
+{
+    mo_color_cube__free(pContext);
+
+    mo_uint32 paletteSize = pContext->lookupPaletteSize;
+
+    // Per-axis [near, far] squared distances for each palette entry, R then G then B. Each axis is indexed by
+    // cell*256 + palette index.
+    const mo_uint32 axisSizes[3] = {32, 64, 32};
+    const mo_uint32 axisShifts[3] = {3, 2, 3};
+    mo_uint32* pAxisDistances = (mo_uint32*)mo_malloc((32+64+32) * 256 * 2 * sizeof(mo_uint32));
+    mo_uint32* pOffsets = (mo_uint32*)mo_malloc((MO_COLOR_CUBE_CELL_COUNT+1) * sizeof(mo_uint32));
+    mo_uint32 entryCapacity = MO_COLOR_CUBE_CELL_COUNT * 2;
+    mo_color_index* pEntries = (mo_color_index*)mo_malloc(entryCapacity);
+    if (pAxisDistances == NULL || pOffsets == NULL || pEntries == NULL) {
+        // Not fatal. mo_find_closest_color() will just be slower.
+        mo_free(pAxisDistances);
+        mo_free(pOffsets);
+        mo_free(pEntries);
+        return;
+    }
+
+    mo_uint32* ppAxisDistances[3];
+    ppAxisDistances[0] = pAxisDistances;
+    ppAxisDistances[1] = ppAxisDistances[0] + 32*256*2;
+    ppAxisDistances[2] = ppAxisDistances[1] + 64*256*2;
+    for (mo_uint32 iAxis = 0; iAxis < 3; ++iAxis) {
+        for (mo_uint32 iCell = 0; iCell < axisSizes[iAxis]; ++iCell) {
+            int lo = (int)(iCell << axisShifts[iAxis]);
+            int hi = lo + (1 << axisShifts[iAxis]) - 1;
+            for (mo_uint32 iColor = 0; iColor < paletteSize; ++iColor) {
+                const mo_color_rgba c = pContext->lookupPalette[iColor];
+                int v = (iAxis == 0) ? c.r : ((iAxis == 1) ? c.g : c.b);
+                int nearDist = (v < lo) ? lo - v : ((v > hi) ? v - hi : 0);
+                int farDist  = (v - lo > hi - v) ? v - lo : hi - v;
+                ppAxisDistances[iAxis][(iCell*256 + iColor)*2 + 0] = (mo_uint32)(nearDist*nearDist);
+                ppAxisDistances[iAxis][(iCell*256 + iColor)*2 + 1] = (mo_uint32)(farDist*farDist);
+            }
+        }
+    }
+
+    mo_uint32 entryCount = 0;
+    mo_uint32 rgDistances[256*2];
+    for (mo_uint32 r = 0; r < 32; ++r) {
+        for (mo_uint32 g = 0; g < 64; ++g) {
+            for (mo_uint32 iColor = 0; iColor < paletteSize; ++iColor) {
+                rgDistances[iColor*2 + 0] = ppAxisDistances[0][(r*256 + iColor)*2 + 0] + ppAxisDistances[1][(g*256 + iColor)*2 + 0];
+                rgDistances[iColor*2 + 1] = ppAxisDistances[0][(r*256 + iColor)*2 + 1] + ppAxisDistances[1][(g*256 + iColor)*2 + 1];
+            }
+
+            for (mo_uint32 b = 0; b < 32; ++b) {
+                const mo_uint32* pBDistances = ppAxisDistances[2] + b*256*2;
+
+                mo_uint32 maxDistance = 0xFFFFFFFF;
+                for (mo_uint32 iColor = 0; iColor < paletteSize; ++iColor) {
+                    if (iColor == pContext->lookupTransparentColorIndex) continue;
+                    mo_uint32 farDistance = rgDistances[iColor*2 + 1] + pBDistances[iColor*2 + 1];
+                    if (maxDistance > farDistance) {
+                        maxDistance = farDistance;
+                    }
+                }
+
+                if (entryCapacity - entryCount < 256) {
+                    entryCapacity *= 2;
+                    mo_color_index* pNewEntries = (mo_color_index*)mo_realloc(pEntries, entryCapacity);
+                    if (pNewEntries == NULL) {
+                        mo_free(pAxisDistances);
+                        mo_free(pOffsets);
+                        mo_free(pEntries);
+                        return;
+                    }
+                    pEntries = pNewEntries;
+                }
+
+                pOffsets[(r << 11) | (g << 5) | b] = entryCount;
+                for (mo_uint32 iColor = 0; iColor < paletteSize; ++iColor) {
+                    if (iColor == pContext->lookupTransparentColorIndex) continue;
+                    if (rgDistances[iColor*2 + 0] + pBDistances[iColor*2 + 0] <= maxDistance) {
+                        pEntries[entryCount++] = (mo_color_index)iColor;
+                    }
+                }
+            }
+        }
+    }
+    pOffsets[MO_COLOR_CUBE_CELL_COUNT] = entryCount;
+
+    mo_free(pAxisDistances);
+    pContext->pColorCubeOffsets = pOffsets;
+    pContext->pColorCubeEntries = pEntries;
+}
+
+static mo_bool32 mo_palette_lookup__matches_profile(mo_context* pContext)
+{
+    mo_uint32 paletteSize = pContext->profile.paletteSize;
+    if (paletteSize > 256) paletteSize = 256;
+
+    return pContext->isLookupBuilt &&
+        pContext->lookupPaletteSize == paletteSize &&
+        pContext->lookupTransparentColorIndex == pContext->profile.transparentColorIndex &&
+        memcmp(pContext->lookupPalette, pContext->profile.palette, paletteSize * sizeof(mo_color_rgba)) == 0;
+}
+
+// Picks up any changes made directly to the palette in the profile. This compares the whole palette so it's only done
+// once per frame and once per batch of lookups rather than for every lookup.
+static void mo_palette_lookup__check(mo_context* pContext)
+{
+    if (pContext->isLookupBuilt && pContext->lookupPaletteGeneration == pContext->paletteGeneration && !mo_palette_lookup__matches_profile(pContext)) {
+        pContext->paletteGeneration += 1;
+    }
+}
+
+// Makes sure the lookups used by mo_find_closest_color() match the current palette. The search arrays are cheap and
+// are rebuilt straight away, whereas the color cube is only built once enough colors are going to be looked up to make
+// it worthwhile. searchCount is the number of colors about to be looked up.
+static void mo_palette_lookup__update(mo_context* pContext, mo_uint64 searchCount)
+{
+    if (!pContext->isLookupBuilt || pContext->lookupPaletteGeneration != pContext->paletteGeneration) {
+        mo_color_cube__free(pContext);
+
+        mo_uint32 paletteSize = pContext->profile.paletteSize;
+        if (paletteSize > 256) paletteSize = 256;
+
+        mo_copy_memory(pContext->lookupPalette, pContext->profile.palette, paletteSize * sizeof(mo_color_rgba));
+        pContext->lookupPaletteSize = paletteSize;
+        pContext->lookupTransparentColorIndex = pContext->profile.transparentColorIndex;
+        pContext->lookupSearchCount = 0;
+        pContext->lookupPaletteGeneration = pContext->paletteGeneration;
+        pContext->isLookupBuilt = MO_TRUE;
+
+        for (mo_uint32 iColor = 0; iColor < 256; ++iColor) {
+            if (iColor < paletteSize && iColor != pContext->lookupTransparentColorIndex) {
+                pContext->paletteSearchR[iColor] = pContext->lookupPalette[iColor].r;
+                pContext->paletteSearchG[iColor] = pContext->lookupPalette[iColor].g;
+                pContext->paletteSearchB[iColor] = pContext->lookupPalette[iColor].b;
+            } else {
+                pContext->paletteSearchR[iColor] = 100000;
+                pContext->paletteSearchG[iColor] = 100000;
+                pContext->paletteSearchB[iColor] = 100000;
+            }
+        }
+        pContext->paletteSearchCount = (paletteSize + 7) & ~7U;
+    }
+
+    if (pContext->pColorCubeOffsets == NULL) {
+        pContext->lookupSearchCount += searchCount;
+        if (pContext->lookupSearchCount >= (mo_uint64)pContext->lookupPaletteSize * MO_COLOR_CUBE_SEARCHES_PER_ENTRY) {
+            mo_color_cube__build(pContext);
+            pContext->lookupSearchCount = 0;   // <-- Don't try again straight away if it failed.
+        }
+    }
 }
 
 mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowSizeY, const char* title, mo_on_step_proc onStep, void* pUserData, mo_context** ppContext)
@@ -1588,6 +4166,7 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
     mo_zero_object(ppContext);
 
     mo_profile defaultProfile;
+    mo_zero_object(&defaultProfile);
     defaultProfile.resolutionX = 160;
     defaultProfile.resolutionY = 144;
     defaultProfile.transparentColorIndex = 255;
@@ -1595,6 +4174,10 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
     mo_copy_memory(defaultProfile.palette, g_moDefaultPalette, 256*4);
     defaultProfile.audioChannels = 2;
     defaultProfile.audioSampleRate = 44100;
+    defaultProfile.presentThreadCount = 1;
+    defaultProfile.imageThreadCount = 1;
+    defaultProfile.maxSounds = MO_DEFAULT_MAX_SOUNDS;
+    defaultProfile.audioDecodeAheadMilliseconds = MO_DEFAULT_DECODE_AHEAD_MILLISECONDS;
     if (pProfile == NULL) pProfile = &defaultProfile;
     if (pProfile->paletteSize == 0) return MO_BAD_PROFILE;
     if (pProfile->transparentColorIndex >= pProfile->paletteSize) return MO_BAD_PROFILE;
@@ -1607,12 +4190,35 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
         pProfile->audioChannels = 2;
     }
 
+    if (pProfile->maxSounds == 0) pProfile->maxSounds = MO_DEFAULT_MAX_SOUNDS;
+    if (pProfile->audioDecodeAheadMilliseconds == 0) pProfile->audioDecodeAheadMilliseconds = MO_DEFAULT_DECODE_AHEAD_MILLISECONDS;
+
+    if (pProfile->presentThreadCount == 0) pProfile->presentThreadCount = 1;
+    if (pProfile->presentThreadCount > MO_MAX_PRESENT_THREADS) {
+        pProfile->presentThreadCount = MO_MAX_PRESENT_THREADS;
+    }
+
+    if (pProfile->imageThreadCount == 0) pProfile->imageThreadCount = 1;
+    if (pProfile->imageThreadCount > MO_MAX_IMAGE_THREADS) {
+        pProfile->imageThreadCount = MO_MAX_IMAGE_THREADS;
+    }
+
     if (windowSizeX == 0) windowSizeX = pProfile->resolutionX;
     if (windowSizeY == 0) windowSizeY = pProfile->resolutionY;
     if (title == NULL) title = "Mintaro";
 
+    mo_uint32 dirtyTileCountX = (pProfile->resolutionX + MO_DIRTY_TILE_SIZE-1) / MO_DIRTY_TILE_SIZE;
+    mo_uint32 dirtyTileCountY = (pProfile->resolutionY + MO_DIRTY_TILE_SIZE-1) / MO_DIRTY_TILE_SIZE;
+
     size_t screenSizeInBytes = pProfile->resolutionX * pProfile->resolutionY * sizeof(mo_color_index);
-    size_t contextSize = sizeof(mo_context) + screenSizeInBytes;
+    size_t dirtyTilesSizeInBytes = dirtyTileCountX * dirtyTileCountY;
+    size_t contextSize = sizeof(mo_context) + screenSizeInBytes + dirtyTilesSizeInBytes;
+    if (pProfile->asyncPresent) {
+        contextSize += screenSizeInBytes + dirtyTilesSizeInBytes;   // <-- For the copy of the screen that's used by the presentation thread.
+    }
+    if (pProfile->diffPresent) {
+        contextSize += screenSizeInBytes;   // <-- For the copy of the previously presented screen.
+    }
 
     mo_context* pContext = (mo_context*)mo_calloc(contextSize);
     if (pContext == NULL) {
@@ -1623,6 +4229,26 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
     pContext->pUserData = pUserData;
     pContext->profile = *pProfile;
     pContext->screen = pContext->pExtraData;
+    pContext->pDirtyTiles = pContext->pExtraData + screenSizeInBytes;
+    pContext->dirtyTileCountX = dirtyTileCountX;
+    pContext->dirtyTileCountY = dirtyTileCountY;
+    mo_uint8* pNextExtraData = pContext->pDirtyTiles + dirtyTilesSizeInBytes;
+    if (pProfile->asyncPresent) {
+        pContext->pAsyncPresentScreen = pNextExtraData;
+        pContext->pAsyncPresentDirtyTiles = pContext->pAsyncPresentScreen + screenSizeInBytes;
+        pNextExtraData += screenSizeInBytes + dirtyTilesSizeInBytes;
+    }
+    if (pProfile->diffPresent) {
+        pContext->pPrevPresentScreen = pNextExtraData;
+        pNextExtraData += screenSizeInBytes;
+    }
+
+    // Everything needs to be presented the first time around.
+    mo_mark_presentation_stale(pContext);
+
+    if (mo_has_avx2()) {
+        pContext->flags |= MO_FLAG_HAS_AVX2;
+    }
 
     // The window.
 #ifdef MO_WIN32
@@ -1699,6 +4325,13 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
 #ifdef MO_X11
     if (mo_atomic_increment(&g_MintaroInitCounter) == 1) {
         //assert(g_moX11Display == NULL);
+
+        // Xlib needs to be made thread-safe when presenting asynchronously because the presentation thread will be
+        // talking to the X server at the same time as the main thread is pumping events.
+        if (pProfile->asyncPresent) {
+            XInitThreads();
+        }
+
         g_moX11Display = XOpenDisplay(NULL);
         if (g_moX11Display == NULL) {
             mo_free(pContext);
@@ -1743,6 +4376,57 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
     }
 #endif
 
+#ifdef MO_HEADLESS
+    // There's no window, so the "window" size just defines the size of the surface we present to.
+    pContext->pPresentBufferHeadless = (mo_uint32*)mo_malloc(windowSizeX * windowSizeY * sizeof(mo_uint32));
+    if (pContext->pPresentBufferHeadless == NULL) {
+        mo_uninit(pContext);
+        return MO_OUT_OF_MEMORY;
+    }
+
+    pContext->presentBufferWidthHeadless  = windowSizeX;
+    pContext->presentBufferHeightHeadless = windowSizeY;
+#endif
+
+#if defined(MO_X11) || defined(MO_HEADLESS)
+    pContext->pPresentRowBuffer = (mo_uint32*)mo_malloc(pProfile->resolutionX * sizeof(mo_uint32));
+    if (pContext->pPresentRowBuffer == NULL) {
+        mo_uninit(pContext);
+        return MO_OUT_OF_MEMORY;
+    }
+
+    // Presentation threads.
+    for (mo_uint32 iWorker = 0; iWorker < pProfile->presentThreadCount-1; ++iWorker) {
+        if (!mo_present_worker_init(pContext, &pContext->presentWorkers[iWorker])) {
+            mo_uninit(pContext);
+            return MO_ERROR;
+        }
+
+        pContext->presentWorkerCount += 1;
+    }
+#endif
+
+    // Asynchronous presentation.
+    if (pProfile->asyncPresent) {
+        if (!mal_event_create(&pContext->asyncPresentWakeupEvent)) {
+            mo_uninit(pContext);
+            return MO_ERROR;
+        }
+        if (!mal_event_create(&pContext->asyncPresentDoneEvent)) {
+            mal_event_delete(&pContext->asyncPresentWakeupEvent);
+            mo_uninit(pContext);
+            return MO_ERROR;
+        }
+        if (!mal_thread_create(&pContext->asyncPresentThread, mo_async_present_thread, pContext)) {
+            mal_event_delete(&pContext->asyncPresentDoneEvent);
+            mal_event_delete(&pContext->asyncPresentWakeupEvent);
+            mo_uninit(pContext);
+            return MO_ERROR;
+        }
+
+        pContext->flags |= MO_FLAG_ASYNC_PRESENT_THREAD;
+    }
+
     // Audio.
     mo_result result = mo_init_audio(pContext);
     if (result != MO_SUCCESS) {
@@ -1750,7 +4434,6 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
         return result;
     }
 
-
     // Default key bindings.
     mo_bind_key_to_button(pContext, MO_KEY_ARROW_LEFT, MO_BUTTON_LEFT);
     mo_bind_key_to_button(pContext, MO_KEY_ARROW_UP, MO_BUTTON_UP);
@@ -1763,142 +4446,105 @@ mo_result mo_init(mo_profile* pProfile, mo_uint32 windowSizeX, mo_uint32 windowS
 
     // Timer.
     mo_timer_init(&pContext->timer);
+    mo_timer_init(&pContext->inputTimer);
 
-    *ppContext = pContext;
-    return MO_SUCCESS;
-}
-
-void mo_uninit(mo_context* pContext)
-{
-    if (pContext == NULL) return;
-
-    mo_uninit_audio(pContext);
-
-#ifdef MO_WIN32
-    if (pContext->hDIBSection) {
-        DeleteObject(pContext->hDIBSection);
-    }
-    if (pContext->hDIBDC) {
-        DeleteDC(pContext->hDIBDC);
-    }
-    if (pContext->hWnd) {
-        DestroyWindow(pContext->hWnd);
-    }
-    if (mo_atomic_decrement(&g_MintaroInitCounter) == 0) {
-        UnregisterClassA(g_MintaroWndClassName, GetModuleHandleA(NULL));
-    }
-#endif
-
-#ifdef MO_X11
-    if (pContext->gcX11) {
-        XFreeGC(g_moX11Display, pContext->gcX11);
-    }
-    if (pContext->windowX11) {
-        XDestroyWindow(g_moX11Display, pContext->windowX11);
-    }
-    if (mo_atomic_decrement(&g_MintaroInitCounter) == 0) {
-        XCloseDisplay(g_moX11Display);
+#ifdef _WIN32
+    // Frame pacing relies on Sleep() being accurate to about a millisecond which requires raising the resolution
+    // of the system timer. This is not done unconditionally because it has a system-wide cost.
+    if (pProfile->targetStepRate > 0) {
+        pContext->hWinMM = LoadLibraryA("winmm.dll");
+        if (pContext->hWinMM != NULL) {
+            typedef UINT (WINAPI * MO_PFN_timeBeginPeriod)(UINT uPeriod);
+            MO_PFN_timeBeginPeriod _timeBeginPeriod = (MO_PFN_timeBeginPeriod)GetProcAddress(pContext->hWinMM, "timeBeginPeriod");
+            if (_timeBeginPeriod != NULL) {
+                _timeBeginPeriod(1);
+            }
+        }
     }
 #endif
 
-    mo_free(pContext);
+    *ppContext = pContext;
+    return MO_SUCCESS;
 }
 
-void mo_present(mo_context* pContext)
+void mo_uninit(mo_context* pContext)
 {
     if (pContext == NULL) return;
 
-#ifdef MO_WIN32
-    // Conveniently, we can get Win32 to do the scaling for us. This means we're able to do an efficient 1x1 copy ourselves and then
-    // let the OS do the rest for us. Of course, there's a chance we could do it more efficiently ourselves, but maybe not.
-
-    // OPTIMIZATION NOTES
-    // ==================
-    // - It's more efficient to flip the screen ourselves than passing in a negative height to StretchDIBits().
-    // - CreateDIBSection() + StretchBlt() is more efficient than StretchDIBits() by a tiny amount.
-    // - BitBlt() is a tiny bit faster than StretchBlt(), but it's less than a microsecond. Probably not worth it.
-    //
-    // THINGS TO TRY
-    // -------------
-    // [DONE] Try using a palette (DIB_PAL_COLORS).
-    //     RESULT: Couldn't figure out how to get it working properly. Probably not worthwhile.
-
-#if 0
-    BITMAPINFO bmi;
-    ZeroMemory(&bmi, sizeof(bmi));
-    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-    bmi.bmiHeader.biWidth = screenWidth;
-    bmi.bmiHeader.biHeight = screenHeight;
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 32;
-    bmi.bmiHeader.biCompression = BI_RGB;
+    // The asynchronous presentation thread needs to be terminated first since it depends on the window.
+    if (pContext->flags & MO_FLAG_ASYNC_PRESENT_THREAD) {
+        pContext->isAsyncPresentTerminating = MO_TRUE;
+        mal_event_signal(&pContext->asyncPresentWakeupEvent);
+        mal_thread_wait(&pContext->asyncPresentThread);
 
-    for (int y = 0; y < screenHeight; ++y) {
-        mo_uint32* pDstRow = ((mo_uint32*)pContext->pScreenRGBA) + (y * screenWidth);
-        for (int x = 0; x < screenWidth; ++x) {
-            unsigned int screenX = x;
-            unsigned int screenY = y;
-            //pDstRow[x] = pContext->palette[(pContext->screen[screenY][screenX] & 0x03)].rgba;
-            pDstRow[x] = pContext->palette[pContext->screen[screenHeight - screenY - 1][screenX]].rgba;    // <-- Needs to be upside down for Win32. Can also use a negative scale in StretchDIBits()
-        }
+        mal_event_delete(&pContext->asyncPresentDoneEvent);
+        mal_event_delete(&pContext->asyncPresentWakeupEvent);
     }
 
-    // Note how the height and Y position is flipped in order to make it the right way around.
-    //
-    // Questions:
-    //   - Does flipping upside down force it down a slower path? A) Yes, it's slower.
-    //StretchDIBits(pContext->hDC, 0, pContext->windowHeight-1, pContext->windowWidth, -pContext->windowHeight, 0, 0, screenWidth, screenHeight, pContext->pScreenRGBA, &bmi, DIB_RGB_COLORS, SRCCOPY);
-    StretchDIBits(pContext->hDC, 0, 0, pContext->windowWidth, pContext->windowHeight, 0, 0, screenWidth, screenHeight, pContext->pScreenRGBA, &bmi, DIB_RGB_COLORS, SRCCOPY);
-#else
-    // Before writing the data to the DIB section we need to flush GDI.
-    //GdiFlush();
-
-    for (unsigned int y = 0; y < pContext->profile.resolutionY; ++y) {
-        mo_uint32* pDstRow = ((mo_uint32*)pContext->pScreenRGBA_DIB) + (y * pContext->profile.resolutionX);
-        for (unsigned int x = 0; x < pContext->profile.resolutionX; ++x) {
-            unsigned int screenX = x;
-            unsigned int screenY = y;
-            pDstRow[x] = pContext->profile.palette[pContext->screen[screenY*pContext->profile.resolutionX + screenX]].rgba;
+    mo_uninit_audio(pContext);
+
+#ifdef _WIN32
+    if (pContext->hWinMM != NULL) {
+        typedef UINT (WINAPI * MO_PFN_timeEndPeriod)(UINT uPeriod);
+        MO_PFN_timeEndPeriod _timeEndPeriod = (MO_PFN_timeEndPeriod)GetProcAddress(pContext->hWinMM, "timeEndPeriod");
+        if (_timeEndPeriod != NULL) {
+            _timeEndPeriod(1);
         }
+
+        FreeLibrary(pContext->hWinMM);
     }
+#endif
 
-    StretchBlt(pContext->hDC, 0, 0, pContext->windowWidth, pContext->windowHeight, pContext->hDIBDC, 0, 0, pContext->profile.resolutionX, pContext->profile.resolutionY, SRCCOPY);
+#if defined(MO_X11) || defined(MO_HEADLESS)
+    for (mo_uint32 iWorker = 0; iWorker < pContext->presentWorkerCount; ++iWorker) {
+        mo_present_worker_uninit(&pContext->presentWorkers[iWorker]);
+    }
 #endif
+
+#ifdef MO_WIN32
+    if (pContext->hDIBSection) {
+        DeleteObject(pContext->hDIBSection);
+    }
+    if (pContext->hDIBDC) {
+        DeleteDC(pContext->hDIBDC);
+    }
+    if (pContext->hWnd) {
+        DestroyWindow(pContext->hWnd);
+    }
+    if (mo_atomic_decrement(&g_MintaroInitCounter) == 0) {
+        UnregisterClassA(g_MintaroWndClassName, GetModuleHandleA(NULL));
+    }
 #endif
 
 #ifdef MO_X11
-    // OPTIMZATION NOTES
-    // =================
-    // - The MIT-SHM extension using XShmPutImage() is about 7 microseconds faster than XPutImage() @ 160x144.
-    //
-    //
-    // THINGS TO TRY
-    // -------------
-    // [DONE] MIT-SHM Extension: https://linux.die.net/man/3/xshmputimage
-    //     RESULT: A good optimization. About 7 microseconds faster @ 160x144 and scales with higher resolutions.
-
-    if (pContext->pPresentBufferX11 == NULL) return;
-
-    unsigned int dstSizeX = pContext->pPresentBufferX11->width;
-    unsigned int dstSizeY = pContext->pPresentBufferX11->height;
-    unsigned int srcSizeX = pContext->profile.resolutionX;
-    unsigned int srcSizeY = pContext->profile.resolutionY;
-
-    float ratioX = (float)srcSizeX / dstSizeX;
-    float ratioY = (float)srcSizeY / dstSizeY;
-
-    for (int y = 0; y < dstSizeY; ++y) {
-        mo_uint32* pDstRow = ((mo_uint32*)pContext->pPresentBufferX11->data) + (y * dstSizeX);
-        for (int x = 0; x < dstSizeX; ++x) {
-            unsigned int screenX = (unsigned int)(x*ratioX);
-            unsigned int screenY = (unsigned int)(y*ratioY);
+    if (pContext->gcX11) {
+        XFreeGC(g_moX11Display, pContext->gcX11);
+    }
+    if (pContext->windowX11) {
+        XDestroyWindow(g_moX11Display, pContext->windowX11);
+    }
+    if (mo_atomic_decrement(&g_MintaroInitCounter) == 0) {
+        XCloseDisplay(g_moX11Display);
+    }
+#endif
 
-            pDstRow[x] = pContext->profile.palette[pContext->screen[screenY*pContext->profile.resolutionX + screenX]].rgba;
-        }
+#ifdef MO_HEADLESS
+    if (pContext->pPresentBufferHeadless) {
+        mo_free(pContext->pPresentBufferHeadless);
     }
+#endif
 
-    mo_x11_present(pContext);
+#if defined(MO_X11) || defined(MO_HEADLESS)
+    if (pContext->pPresentColumnMap) {
+        mo_free(pContext->pPresentColumnMap);
+    }
+    if (pContext->pPresentRowBuffer) {
+        mo_free(pContext->pPresentRowBuffer);
+    }
 #endif
+
+    mo_color_cube__free(pContext);
+    mo_free(pContext);
 }
 
 #ifdef MO_X11
@@ -1951,9 +4597,11 @@ void mo_handle_x11_event(XEvent* ex)
     {
         case ConfigureNotify:
         {
-            if (pContext->pPresentBufferX11 == NULL || (pContext->pPresentBufferX11->width != ex->xconfigure.width || pContext->pPresentBufferX11->height != ex->xconfigure.height)) {
-                mo_x11_resize_presentation_buffer(pContext, ex->xconfigure.width, ex->xconfigure.height);
-            }
+            // Only the last size matters so the resize is deferred until the queue has been drained. See
+            // mo_x11_apply_pending_window_changes().
+            pContext->pendingWindowSizeX = ex->xconfigure.width;
+            pContext->pendingWindowSizeY = ex->xconfigure.height;
+            pContext->isResizePending = MO_TRUE;
         } break;
 
 
@@ -1972,88 +4620,172 @@ void mo_handle_x11_event(XEvent* ex)
 
         case KeyPress:
         {
+            mo__on_input_event(pContext, (mo_uint32)ex->xkey.time);
             mo__on_button_down(pContext, mo_get_key_binding(pContext, mo_convert_key_code__x11(ex->xkey.keycode)));
         } break;
 
         case KeyRelease:
         {
+            mo__on_input_event(pContext, (mo_uint32)ex->xkey.time);
             mo__on_button_up(pContext, mo_get_key_binding(pContext, mo_convert_key_code__x11(ex->xkey.keycode)));
         } break;
 
 
         case Expose:
         {
-            // We need to present the screen to the window. To do this we need to write the
-            // data to an XImage object and then call XPutImage() to copy the image over to
-            // the window.
-            mo_present(pContext);
-            XFlush(g_moX11Display); // <-- Is this needed? Assuming so because I saw it in an example, but not sure.
+            // We need to present the screen to the window. Expose events come in batches so this is deferred until
+            // the queue has been drained. See mo_x11_apply_pending_window_changes().
+            pContext->isExposePending = MO_TRUE;
         } break;
 
 
         default: break;
     }
 }
+
+static void mo_x11_apply_pending_window_changes(mo_context* pContext)
+{
+    // This is called after the event queue has been drained so that a storm of ConfigureNotify and Expose events
+    // only results in a single resize and a single present.
+    if (pContext->isResizePending) {
+        pContext->isResizePending = MO_FALSE;
+        if (pContext->pPresentBufferX11 == NULL || (pContext->pPresentBufferX11->width != (int)pContext->pendingWindowSizeX || pContext->pPresentBufferX11->height != (int)pContext->pendingWindowSizeY)) {
+            mo_wait_for_async_present(pContext);
+            mo_mark_presentation_stale(pContext);
+            mo_x11_resize_presentation_buffer(pContext, pContext->pendingWindowSizeX, pContext->pendingWindowSizeY);
+        }
+    }
+
+    if (pContext->isExposePending) {
+        // We need to present the screen to the window. To do this we need to write the data to an XImage object
+        // and then call XPutImage() to copy the image over to the window. mo_present() only sends dirty regions
+        // so the whole buffer needs to be sent explicitly.
+        pContext->isExposePending = MO_FALSE;
+        mo_present(pContext);
+        mo_x11_present(pContext);
+        XFlush(g_moX11Display); // <-- Is this needed? Assuming so because I saw it in an example, but not sure.
+    }
+}
 #endif
 
+static void mo_step(mo_context* pContext, double dt)
+{
+    if (pContext->onStep) {
+        pContext->onStep(pContext, dt);
+
+        pContext->buttonPressState = 0;
+        pContext->buttonReleaseState = 0;
+    }
+}
+
 int mo_run(mo_context* pContext)
 {
     if (pContext == NULL) return MO_INVALID_ARGS;
 
+    // Frame pacing. Frame deadlines are measured from the start of the loop with pacingTimer. When a deadline is
+    // missed the schedule is restarted from the current time rather than trying to catch up with a burst of frames.
+    double stepPeriod = (pContext->profile.targetStepRate > 0) ? 1.0 / pContext->profile.targetStepRate : 0;
+    double nextFrameTime = stepPeriod;
+    double accumulator = 0;
+    mo_timer pacingTimer;
+    mo_timer_init(&pacingTimer);
+
     while ((pContext->flags & MO_FLAG_CLOSING) == 0) {
-        // Handle window events first.
+        // Handle window events first. Every pending event is handled before stepping so that input doesn't
+        // lag behind by a frame for each event in the queue.
+        pContext->eventsThisFrame = 0;
+
 #ifdef MO_WIN32
         MSG msg;
-        if (PeekMessageA(&msg, NULL, 0, 0, PM_REMOVE))
+        while (PeekMessageA(&msg, NULL, 0, 0, PM_REMOVE))
         {
             if (msg.message == WM_QUIT) {
+                mo_wait_for_async_present(pContext);
                 return (int)msg.wParam;  // Received a quit message.
             }
 
             TranslateMessage(&msg);
             DispatchMessageA(&msg);
+            pContext->eventsThisFrame += 1;
         }
 #endif
 
 #ifdef MO_X11
-        if (XPending(g_moX11Display) > 0) {   // <-- Use a while loop instead?
+        while (XPending(g_moX11Display) > 0) {
             XEvent x11Event;
             XNextEvent(g_moX11Display, &x11Event);
 
             if (x11Event.type == ClientMessage) {
                 if ((Atom)x11Event.xclient.data.l[0] == g_WM_DELETE_WINDOW) {
+                    mo_wait_for_async_present(pContext);
                     return 0;   // Received a quit message.
                 }
             };
 
             mo_handle_x11_event(&x11Event);
+            pContext->eventsThisFrame += 1;
         }
+
+        mo_x11_apply_pending_window_changes(pContext);
 #endif
 
-        // Now just step the game.
+        pContext->inputStats.eventCount += pContext->eventsThisFrame;
+        pContext->inputStats.lastEventsPerFrame = pContext->eventsThisFrame;
+        if (pContext->inputStats.maxEventsPerFrame < pContext->eventsThisFrame) {
+            pContext->inputStats.maxEventsPerFrame = pContext->eventsThisFrame;
+        }
+
+        // Now just step the game. With a fixed timestep the game is stepped in whole periods, with the remainder
+        // carried over to the next frame. The amount of time that can be caught up on is limited so that a long
+        // stall, such as a breakpoint, doesn't result in a huge number of steps.
         double dt = mo_timer_tick(&pContext->timer);
-        if (pContext->onStep) {
-            pContext->onStep(pContext, dt);
+        mo_bool32 hasStepped = MO_FALSE;
+        if (pContext->profile.fixedTimestep && stepPeriod > 0) {
+            accumulator += dt;
+            if (accumulator > stepPeriod * MO_MAX_CATCH_UP_STEPS) {
+                accumulator = stepPeriod * MO_MAX_CATCH_UP_STEPS;
+            }
 
-            pContext->buttonPressState = 0;
-            pContext->buttonReleaseState = 0;
+            while (accumulator >= stepPeriod) {
+                mo_step(pContext, stepPeriod);
+                accumulator -= stepPeriod;
+                hasStepped = MO_TRUE;
+            }
+        } else {
+            mo_step(pContext, dt);
+            hasStepped = MO_TRUE;
         }
 
         // Collect garbage.
-        if (pContext->isSoundMarkedForDeletion) {
-            for (size_t iSound = 0; iSound < pContext->soundCount; /* DO NOTHING */) {
-                if (pContext->ppSounds[iSound]->isMarkedForDeletion) {
-                    mo_sound_delete(pContext->ppSounds[iSound]);
-                } else {
-                    iSound += 1;
-                }
-            }
-        }
+        mo_audio__collect_garbage(pContext);
 
         // Present the screen to the window.
-        mo_present(pContext);
+        if (pContext->flags & MO_FLAG_ASYNC_PRESENT_THREAD) {
+            mo_present__async(pContext);
+        } else {
+            mo_present(pContext);
+        }
+
+        // Pending input hasn't been seen by the game until a step has run, so frames without one are left out of the
+        // latency statistics.
+        if (hasStepped) {
+            mo__on_frame_presented(pContext);
+        }
+
+        // Wait for the next frame.
+        if (stepPeriod > 0) {
+            double currentTime = mo_timer_peek(&pacingTimer);
+            if (currentTime < nextFrameTime) {
+                mo_wait_until(&pacingTimer, nextFrameTime);
+                nextFrameTime += stepPeriod;
+            } else {
+                pContext->missedDeadlineCount += 1;
+                nextFrameTime = currentTime + stepPeriod;
+            }
+        }
     }
 
+    mo_wait_for_async_present(pContext);
     return 0;
 }
 
@@ -2068,6 +4800,18 @@ void mo_close(mo_context* pContext)
     pContext->flags |= MO_FLAG_CLOSING;
 }
 
+mo_uint64 mo_get_missed_deadline_count(mo_context* pContext)
+{
+    if (pContext == NULL) return 0;
+    return pContext->missedDeadlineCount;
+}
+
+mo_uint32 mo_get_audio_underrun_count(mo_context* pContext)
+{
+    if (pContext == NULL) return 0;
+    return mo_atomic_load_u32(&pContext->audioUnderrunCount);
+}
+
 void mo_log(mo_context* pContext, const char* message)
 {
     if (pContext == NULL || pContext->onLog == NULL) return;
@@ -2185,7 +4929,7 @@ static void* mo_open_and_read_file_with_extra_data(mo_context* pContext, const c
         return NULL;
     }
 
-#ifdef MO_WIN32
+#ifdef _WIN32
     HANDLE hFile = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE) {
         mo_logf(pContext, "Could not find file: %s", filePath);
@@ -2206,65 +4950,465 @@ static void* mo_open_and_read_file_with_extra_data(mo_context* pContext, const c
         return NULL;
     }
 
-    DWORD bytesRead;
-    if (!ReadFile(hFile, pFileData, fileSize.LowPart, &bytesRead, NULL) || bytesRead != fileSize.LowPart) {
-        mo_logf(pContext, "Failed to read image file: %s", filePath);
-        mo_free(pFileData);
-        CloseHandle(hFile);
-        return NULL;
+    DWORD bytesRead;
+    if (!ReadFile(hFile, pFileData, fileSize.LowPart, &bytesRead, NULL) || bytesRead != fileSize.LowPart) {
+        mo_logf(pContext, "Failed to read image file: %s", filePath);
+        mo_free(pFileData);
+        CloseHandle(hFile);
+        return NULL;
+    }
+
+    CloseHandle(hFile);
+
+    if (pFileSizeOut) *pFileSizeOut = (unsigned int)fileSize.LowPart;
+    return pFileData;
+#endif
+
+#ifdef MO_POSIX
+    int fd = open(filePath, O_RDONLY, 0666);
+    if (fd == -1) {
+        mo_logf(pContext, "Could not find file: %s", filePath);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        mo_logf(pContext, "Failed to retrieve file info: %s", filePath);
+        close(fd);
+        return NULL;
+    }
+
+    if (info.st_size + extraBytes > 0xFFFFFFFF) {
+        mo_logf(pContext, "File is too large: %s", filePath);
+        close(fd);
+        return NULL;    // File is too big.
+    }
+
+    void* pFileData = mo_malloc(info.st_size + extraBytes);
+    if (pFileData == NULL) {
+        mo_logf(pContext, "Not enough memory to load image: %s", filePath);
+        close(fd);
+        return NULL;
+    }
+
+    ssize_t bytesRead = read(fd, pFileData, info.st_size);
+    if (bytesRead != info.st_size) {
+        mo_logf(pContext, "Failed to read image file: %s", filePath);
+        mo_free(pFileData);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+
+    if (pFileSizeOut) *pFileSizeOut = (unsigned int)info.st_size;
+    return pFileData;
+#endif
+}
+
+static void* mo_open_and_read_file(mo_context* pContext, const char* filePath, size_t* pFileSizeOut)
+{
+    return mo_open_and_read_file_with_extra_data(pContext, filePath, pFileSizeOut, 0);
+}
+
+// A file mapping is the contents of a file that images and sound sources can point into directly rather than taking a
+// copy. On POSIX platforms the file is mapped with mmap() so the pages come straight from the page cache. Everywhere
+// else the file is just read into memory as normal. Mappings are reference counted, but only from the game thread.
+struct mo_file_mapping
+{
+    void* pData;
+    size_t size;
+    mo_uint32 refCount;
+    mo_bool32 isMapped;
+};
+
+static mo_file_mapping* mo_file_mapping__open(mo_context* pContext, const char* filePath)
+{
+    mo_file_mapping* pMapping = (mo_file_mapping*)mo_calloc(sizeof(*pMapping));
+    if (pMapping == NULL) {
+        return NULL;
+    }
+
+    pMapping->refCount = 1;
+
+#ifdef MO_POSIX
+    int fd = open(filePath, O_RDONLY, 0666);
+    if (fd != -1) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && (mo_uint64)info.st_size <= SIZE_MAX) {
+            // The mapping is read-only so the pages stay shared with the page cache. A writable mapping would have every
+            // page copied into private memory which defeats the point. Images that need to be written to get their
+            // own copy with mo_image_make_writable(). The pages are read ahead in the background so the audio thread
+            // is less likely to end up waiting on the disk when it reads sample data out of a mapped WAV file.
+            void* pData = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (pData != MAP_FAILED) {
+            #ifdef MADV_WILLNEED
+                madvise(pData, (size_t)info.st_size, MADV_WILLNEED);
+            #endif
+                close(fd);
+                pMapping->pData = pData;
+                pMapping->size = (size_t)info.st_size;
+                pMapping->isMapped = MO_TRUE;
+                return pMapping;
+            }
+        }
+
+        close(fd);
+    }
+#endif
+
+    // Fall back to reading the file into memory.
+    pMapping->pData = mo_open_and_read_file(pContext, filePath, &pMapping->size);
+    if (pMapping->pData == NULL) {
+        mo_free(pMapping);
+        return NULL;
+    }
+
+    return pMapping;
+}
+
+static mo_file_mapping* mo_file_mapping__retain(mo_file_mapping* pMapping)
+{
+    mo_assert(pMapping != NULL);
+    pMapping->refCount += 1;
+    return pMapping;
+}
+
+static void mo_file_mapping__release(mo_file_mapping* pMapping)
+{
+    if (pMapping == NULL) return;
+
+    mo_assert(pMapping->refCount > 0);
+    pMapping->refCount -= 1;
+    if (pMapping->refCount > 0) {
+        return;
+    }
+
+#ifdef MO_POSIX
+    if (pMapping->isMapped) {
+        munmap(pMapping->pData, pMapping->size);
+    }
+#endif
+    if (!pMapping->isMapped) {
+        mo_free(pMapping->pData);
+    }
+
+    mo_free(pMapping);
+}
+
+// The state shared by every thread taking part in converting an RGBA image to color indices. Threads take rows one at
+// a time in order from nextRow until there are none left.
+typedef struct
+{
+    mo_context* pContext;
+    mo_dither_mode ditherMode;
+    unsigned int width;
+    unsigned int height;
+    const mo_uint8* pSrc;
+    mo_uint8* pDst;
+    volatile mo_uint32 nextRow;
+
+    // Ordered dithering. The amount added to each channel for each position in the 8x8 Bayer matrix.
+    int orderedOffsets[64];
+
+    // Floyd-Steinberg. Error is diffused into the next row, so a row can only do a pixel once the row above it has done
+    // the pixel to the right of it. pRowProgress is the number of pixels each row has done. The error going into each
+    // row is accumulated in one of errorRowCount rows, each of which is (width+2) x RGB, scaled by 16 and offset by one
+    // pixel so the left and right edges don't need special casing. The row reading the error clears it as it goes so it
+    // can be reused by a later row.
+    volatile mo_uint32* pRowProgress;
+    mo_int16* pErrorRows;
+    mo_uint32 errorRowCount;
+} mo_image_conversion;
+
+static const mo_uint8 g_moBayer8x8[64] = {
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21
+};
+
+static mo_uint8 mo_clamp_u8(int value)
+{
+    return (mo_uint8)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+}
+
+static mo_color_index mo_find_closest_color__unchecked(mo_context* pContext, mo_color_rgba color);
+
+static void mo_image__convert_rgba8_row(mo_image_conversion* pConversion, unsigned int y)
+{
+    mo_context* pContext = pConversion->pContext;
+    const mo_color_index transparentColorIndex = pContext->profile.transparentColorIndex;
+    const unsigned int width = pConversion->width;
+    const mo_uint8* pRunningPixel = pConversion->pSrc + ((size_t)y*width*4);
+    mo_uint8* pRunningIndex = pConversion->pDst + ((size_t)y*width);
+
+    // Neighbouring pixels are usually the same color so the previous result is reused where possible.
+    mo_color_rgba prevColor;
+    prevColor.rgba = 0;  // <-- Transparent, so never equal to a color that needs looking up.
+    mo_color_index prevColorIndex = transparentColorIndex;
+
+    if (pConversion->ditherMode == mo_dither_mode_floyd_steinberg) {
+        mo_int16* pErrorIn  = pConversion->pErrorRows + ((y+0) % pConversion->errorRowCount) * (width+2)*3 + 3;
+        mo_int16* pErrorOut = pConversion->pErrorRows + ((y+1) % pConversion->errorRowCount) * (width+2)*3 + 3;
+        mo_uint32 rowAboveProgress = (y == 0) ? width : 0;
+        int errorR = 0;
+        int errorG = 0;
+        int errorB = 0;
+        for (unsigned int x = 0; x < width; ++x) {
+            mo_uint32 requiredProgress = (x+2 < width) ? x+2 : width;
+            while (rowAboveProgress < requiredProgress) {
+                rowAboveProgress = mo_atomic_load_u32(&pConversion->pRowProgress[y-1]);
+                if (rowAboveProgress < requiredProgress) {
+                    mo_yield();
+                }
+            }
+
+            // errorR/G/B is the error carried over from the pixel to the left, already weighted by 7.
+            int r = pRunningPixel[0] + ((pErrorIn[x*3 + 0] + errorR) / 16);
+            int g = pRunningPixel[1] + ((pErrorIn[x*3 + 1] + errorG) / 16);
+            int b = pRunningPixel[2] + ((pErrorIn[x*3 + 2] + errorB) / 16);
+            pErrorIn[x*3 + 0] = 0;
+            pErrorIn[x*3 + 1] = 0;
+            pErrorIn[x*3 + 2] = 0;
+
+            if (pRunningPixel[3] < 255) {
+                pRunningIndex[x] = transparentColorIndex;
+                errorR = 0;
+                errorG = 0;
+                errorB = 0;
+            } else {
+                mo_color_rgba colorIn;
+                colorIn.r = mo_clamp_u8(r);
+                colorIn.g = mo_clamp_u8(g);
+                colorIn.b = mo_clamp_u8(b);
+                colorIn.a = 255;
+                if (colorIn.rgba != prevColor.rgba) {
+                    prevColor = colorIn;
+                    prevColorIndex = mo_find_closest_color__unchecked(pContext, colorIn);
+                }
+
+                pRunningIndex[x] = prevColorIndex;
+
+                mo_color_rgba colorOut = pContext->profile.palette[prevColorIndex];
+                int diffR = (int)colorIn.r - colorOut.r;
+                int diffG = (int)colorIn.g - colorOut.g;
+                int diffB = (int)colorIn.b - colorOut.b;
+                mo_int16* pErrorOutPixel = pErrorOut + x*3;
+                pErrorOutPixel[-3] += (mo_int16)(diffR*3); pErrorOutPixel[0] += (mo_int16)(diffR*5); pErrorOutPixel[3] += (mo_int16)(diffR*1);
+                pErrorOutPixel[-2] += (mo_int16)(diffG*3); pErrorOutPixel[1] += (mo_int16)(diffG*5); pErrorOutPixel[4] += (mo_int16)(diffG*1);
+                pErrorOutPixel[-1] += (mo_int16)(diffB*3); pErrorOutPixel[2] += (mo_int16)(diffB*5); pErrorOutPixel[5] += (mo_int16)(diffB*1);
+                errorR = diffR*7;
+                errorG = diffG*7;
+                errorB = diffB*7;
+            }
+
+            mo_atomic_store_u32(&pConversion->pRowProgress[y], x+1);
+            pRunningPixel += 4;
+        }
+
+        return;
+    }
+
+    const int* pOrderedOffsets = pConversion->orderedOffsets + ((y & 7) * 8);
+    for (unsigned int x = 0; x < width; ++x) {
+        if (pRunningPixel[3] < 255) {
+            pRunningIndex[x] = transparentColorIndex;
+        } else {
+            mo_color_rgba colorIn;
+            colorIn.a = 255;
+            if (pConversion->ditherMode == mo_dither_mode_ordered) {
+                int offset = pOrderedOffsets[x & 7];
+                colorIn.r = mo_clamp_u8(pRunningPixel[0] + offset);
+                colorIn.g = mo_clamp_u8(pRunningPixel[1] + offset);
+                colorIn.b = mo_clamp_u8(pRunningPixel[2] + offset);
+            } else {
+                colorIn.r = pRunningPixel[0];
+                colorIn.g = pRunningPixel[1];
+                colorIn.b = pRunningPixel[2];
+            }
+
+            if (colorIn.rgba != prevColor.rgba) {
+                prevColor = colorIn;
+                prevColorIndex = mo_find_closest_color__unchecked(pContext, colorIn);
+            }
+
+            pRunningIndex[x] = prevColorIndex;
+        }
+
+        pRunningPixel += 4;
+    }
+}
+
+// Converts rows until there are none left. This is called from several threads at once for large images so it must
+// not modify the context.
+static void mo_image__convert_rgba8_rows(mo_image_conversion* pConversion)
+{
+    for (;;) {
+        mo_uint32 y = mo_atomic_increment(&pConversion->nextRow) - 1;
+        if (y >= pConversion->height) {
+            break;
+        }
+
+        mo_image__convert_rgba8_row(pConversion, y);
+    }
+}
+
+static mal_thread_result MAL_THREADCALL mo_image__convert_rgba8_thread(void* pData)
+{
+    mo_image__convert_rgba8_rows((mo_image_conversion*)pData);
+    return (mal_thread_result)0;
+}
+
+static mo_result mo_image__convert_rgba8(mo_context* pContext, unsigned int width, unsigned int height, const mo_uint8* pSrc, mo_uint8* pDst)
+{
+    // The palette lookups are shared by all of the conversion threads so they need to be ready before any are started.
+    mo_palette_lookup__check(pContext);
+    mo_palette_lookup__update(pContext, (mo_uint64)width * height);
+
+    // Small images aren't worth starting threads for. Threads are only started for the duration of the conversion since
+    // images are usually all loaded up front. The thread count is clamped again here because the profile can be changed
+    // at any time after mo_init().
+    mo_uint32 threadCount = pContext->profile.imageThreadCount;
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+    if (threadCount > MO_MAX_IMAGE_THREADS) {
+        threadCount = MO_MAX_IMAGE_THREADS;
+    }
+    if ((mo_uint64)width * height < 256*256) {
+        threadCount = 1;
+    }
+    if (threadCount > height) {
+        threadCount = height;
+    }
+
+    mo_image_conversion conversion;
+    mo_zero_object(&conversion);
+    conversion.pContext = pContext;
+    conversion.ditherMode = pContext->profile.imageDitherMode;
+    conversion.width = width;
+    conversion.height = height;
+    conversion.pSrc = pSrc;
+    conversion.pDst = pDst;
+
+    if (conversion.ditherMode == mo_dither_mode_ordered) {
+        // The spread is roughly the distance between neighbouring colors of an evenly distributed palette of the
+        // same size.
+        int spread = (int)(255 / powf((float)pContext->profile.paletteSize, 1/3.0f));
+        for (int i = 0; i < 64; ++i) {
+            conversion.orderedOffsets[i] = ((g_moBayer8x8[i]*2 + 1 - 64) * spread) / 128;
+        }
+    }
+
+    if (conversion.ditherMode == mo_dither_mode_floyd_steinberg) {
+        // A row is only ever taken once every row more than threadCount rows above it is finished, so that many rows of
+        // error plus a couple of spares is enough.
+        conversion.errorRowCount = threadCount + 2;
+        conversion.pErrorRows = (mo_int16*)mo_calloc(conversion.errorRowCount * (width+2)*3 * sizeof(mo_int16));
+        conversion.pRowProgress = (volatile mo_uint32*)mo_calloc(height * sizeof(mo_uint32));
+        if (conversion.pErrorRows == NULL || conversion.pRowProgress == NULL) {
+            mo_free(conversion.pErrorRows);
+            mo_free((void*)conversion.pRowProgress);
+            return MO_OUT_OF_MEMORY;
+        }
     }
 
-    CloseHandle(hFile);
+    // Threads that fail to start are fine since there's nothing assigning rows to them.
+    mal_thread threads[MO_MAX_IMAGE_THREADS-1];
+    mo_bool32 isThreadRunning[MO_MAX_IMAGE_THREADS-1];
+    for (mo_uint32 iThread = 0; iThread < threadCount-1; ++iThread) {
+        isThreadRunning[iThread] = mal_thread_create(&threads[iThread], mo_image__convert_rgba8_thread, &conversion);
+    }
 
-    if (pFileSizeOut) *pFileSizeOut = (unsigned int)fileSize.LowPart;
-    return pFileData;
-#endif
+    mo_image__convert_rgba8_rows(&conversion);
 
-#ifdef MO_POSIX
-    int fd = open(filePath, O_RDONLY, 0666);
-    if (fd == -1) {
-        mo_logf(pContext, "Could not find file: %s", filePath);
-        return NULL;
+    for (mo_uint32 iThread = 0; iThread < threadCount-1; ++iThread) {
+        if (isThreadRunning[iThread]) {
+            mal_thread_wait(&threads[iThread]);
+        #ifdef _WIN32
+            CloseHandle(threads[iThread]);
+        #endif
+        }
     }
 
-    struct stat info;
-    if (fstat(fd, &info) == -1) {
-        mo_logf(pContext, "Failed to retrieve file info: %s", filePath);
-        close(fd);
-        return NULL;
+    mo_free(conversion.pErrorRows);
+    mo_free((void*)conversion.pRowProgress);
+    return MO_SUCCESS;
+}
+
+// Spans are only built for images whose opaque runs are at least this long on average.
+#define MO_MIN_AVERAGE_SPAN_LENGTH  4
+
+static void mo_image__build_spans(mo_context* pContext, mo_image* pImage)
+{
+    if (pImage->width > 0xFFFF) {
+        return;
     }
 
-    if (info.st_size + extraBytes > 0xFFFFFFFF) {
-        mo_logf(pContext, "File is too large: %s", filePath);
-        close(fd);
-        return NULL;    // File is too big.
+    const mo_color_index transparentColorIndex = pContext->profile.transparentColorIndex;
+
+    mo_uint64 spanCount = 0;
+    mo_uint64 opaqueCount = 0;
+    for (mo_uint32 y = 0; y < pImage->height; ++y) {
+        const mo_uint8* pRow = pImage->pData + ((size_t)y * pImage->width);
+        mo_bool32 isInSpan = MO_FALSE;
+        for (mo_uint32 x = 0; x < pImage->width; ++x) {
+            mo_bool32 isOpaque = pRow[x] != transparentColorIndex;
+            if (isOpaque) {
+                opaqueCount += 1;
+                if (!isInSpan) {
+                    spanCount += 1;
+                }
+            }
+            isInSpan = isOpaque;
+        }
     }
 
-    void* pFileData = mo_malloc(info.st_size + extraBytes);
-    if (pFileData == NULL) {
-        mo_logf(pContext, "Not enough memory to load image: %s", filePath);
-        close(fd);
-        return NULL;
+    if (spanCount * MO_MIN_AVERAGE_SPAN_LENGTH > opaqueCount || spanCount > 0xFFFFFFFF) {
+        return;
     }
 
-    ssize_t bytesRead = read(fd, pFileData, info.st_size);
-    if (bytesRead != info.st_size) {
-        mo_logf(pContext, "Failed to read image file: %s", filePath);
-        mo_free(pFileData);
-        close(fd);
-        return NULL;
+    size_t rowSpansSize = ((size_t)pImage->height + 1) * sizeof(mo_uint32);
+    mo_uint32* pRowSpans = (mo_uint32*)mo_malloc(rowSpansSize + (size_t)spanCount * sizeof(mo_image_span));
+    if (pRowSpans == NULL) {
+        return; // Not fatal. The image will be drawn pixel by pixel.
     }
 
-    close(fd);
+    mo_image_span* pSpans = (mo_image_span*)((mo_uint8*)pRowSpans + rowSpansSize);
+    mo_uint32 iSpan = 0;
+    for (mo_uint32 y = 0; y < pImage->height; ++y) {
+        const mo_uint8* pRow = pImage->pData + ((size_t)y * pImage->width);
+        pRowSpans[y] = iSpan;
 
-    if (pFileSizeOut) *pFileSizeOut = (unsigned int)info.st_size;
-    return pFileData;
-#endif
-}
+        mo_uint32 x = 0;
+        for (;;) {
+            while (x < pImage->width && pRow[x] == transparentColorIndex) {
+                x += 1;
+            }
+            if (x == pImage->width) {
+                break;
+            }
 
-static void* mo_open_and_read_file(mo_context* pContext, const char* filePath, size_t* pFileSizeOut)
-{
-    return mo_open_and_read_file_with_extra_data(pContext, filePath, pFileSizeOut, 0);
+            mo_uint32 spanBeg = x;
+            while (x < pImage->width && pRow[x] != transparentColorIndex) {
+                x += 1;
+            }
+
+            pSpans[iSpan].x = (mo_uint16)spanBeg;
+            pSpans[iSpan].length = (mo_uint16)(x - spanBeg);
+            iSpan += 1;
+        }
+    }
+    pRowSpans[pImage->height] = iSpan;
+
+    pImage->pRowSpans = pRowSpans;
+    pImage->pSpans = pSpans;
+    pImage->spanTransparentColorIndex = transparentColorIndex;
 }
 
 mo_result mo_image_create(mo_context* pContext, unsigned int width, unsigned int height, mo_image_format format, const void* pData, mo_image** ppImage)
@@ -2276,7 +5420,7 @@ mo_result mo_image_create(mo_context* pContext, unsigned int width, unsigned int
 
     // Allocate the image first so we have an output buffer.
     size_t dataSize = width * height;
-    mo_image* pImage = (mo_image*)mo_calloc((sizeof(*pImage)-1) + dataSize);
+    mo_image* pImage = (mo_image*)mo_calloc(sizeof(*pImage) + dataSize);
     if (pImage == NULL) {
         return MO_OUT_OF_MEMORY;
     }
@@ -2284,30 +5428,16 @@ mo_result mo_image_create(mo_context* pContext, unsigned int width, unsigned int
     pImage->width = width;
     pImage->height = height;
     pImage->format = format;
+    pImage->pData = (mo_uint8*)(pImage + 1);
 
     switch (format)
     {
         case mo_image_format_rgba8:
         {
-            mo_color_rgba colorIn;
-
-            const mo_uint8* pRunningPixel = (const mo_uint8*)pData;
-            for (unsigned int y = 0; y < height; ++y) {
-                for (unsigned int x = 0; x < width; ++x) {
-                    colorIn.r = pRunningPixel[0];
-                    colorIn.g = pRunningPixel[1];
-                    colorIn.b = pRunningPixel[2];
-                    colorIn.a = pRunningPixel[3];
-                    mo_color_index colorIndex = mo_find_closest_color(pContext, colorIn);
-
-                    // Set the transparent bit.
-                    if (colorIn.a < 255) {
-                        colorIndex = pContext->profile.transparentColorIndex;
-                    }
-
-                    pImage->pData[y*width + x] = colorIndex;
-                    pRunningPixel += 4;
-                }
+            mo_result result = mo_image__convert_rgba8(pContext, width, height, (const mo_uint8*)pData, pImage->pData);
+            if (result != MO_SUCCESS) {
+                mo_free(pImage);
+                return result;
             }
         } break;
 
@@ -2318,10 +5448,37 @@ mo_result mo_image_create(mo_context* pContext, unsigned int width, unsigned int
 
         default:
         {
+            mo_free(pImage);
             return MO_UNSUPPORTED_IMAGE_FORMAT;
         } break;
     }
 
+    mo_image__build_spans(pContext, pImage);
+
+    *ppImage = pImage;
+    return MO_SUCCESS;
+}
+
+// Creates an image whose data points straight into a mapped .moimage file. The image holds a reference to the mapping.
+static mo_result mo_image_create__mapped(mo_context* pContext, unsigned int width, unsigned int height, const void* pData, mo_file_mapping* pMapping, mo_image** ppImage)
+{
+    mo_assert(ppImage != NULL);
+    *ppImage = NULL;
+
+    if (pContext == NULL || width == 0 || height == 0 || pData == NULL || pMapping == NULL) return MO_INVALID_ARGS;
+
+    mo_image* pImage = (mo_image*)mo_calloc(sizeof(*pImage));
+    if (pImage == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    pImage->width = width;
+    pImage->height = height;
+    pImage->format = mo_image_format_native;
+    pImage->pData = (mo_uint8*)pData;
+    pImage->pFileMapping = mo_file_mapping__retain(pMapping);
+    mo_image__build_spans(pContext, pImage);
+
     *ppImage = pImage;
     return MO_SUCCESS;
 }
@@ -2352,6 +5509,10 @@ static const void* mo_image_load__native(const void* pFileData, size_t fileSize,
     mo_copy_memory(&width, pFileData8 + 4, 4);
     mo_copy_memory(&height, pFileData8 + 8, 4);
 
+    if ((mo_uint64)width * height > fileSize - 12) {
+        return NULL;    // The file is truncated.
+    }
+
     if (pWidthOut  != NULL) *pWidthOut  = (unsigned int)width;
     if (pHeightOut != NULL) *pHeightOut = (unsigned int)height;
     if (pFormat    != NULL) *pFormat    = mo_image_format_native;
@@ -2826,12 +5987,14 @@ mo_result mo_image_load(mo_context* pContext, const char* filePath, mo_image** p
 
     if (pContext == NULL || filePath == NULL) return MO_INVALID_ARGS;
 
-    size_t fileSize;
-    void* pFileData = mo_open_and_read_file(pContext, filePath, &fileSize);
-    if (pFileData == NULL) {
+    mo_file_mapping* pMapping = mo_file_mapping__open(pContext, filePath);
+    if (pMapping == NULL) {
         return MO_DOES_NOT_EXIST;
     }
 
+    const void* pFileData = pMapping->pData;
+    size_t fileSize = pMapping->size;
+
     unsigned int width = 0;
     unsigned int height = 0;
     mo_image_format format = mo_image_format_unknown;
@@ -2845,14 +6008,19 @@ mo_result mo_image_load(mo_context* pContext, const char* filePath, mo_image** p
         pImageData = mo_image_load__native(pFileData, fileSize, &width, &height, &format);
         if (pImageData == NULL) {
             mo_logf(pContext, "Corrupt image file (%s)", filePath);
-            mo_free(pFileData);
+            mo_file_mapping__release(pMapping);
             return MO_INVALID_RESOURCE;
         }
+
+        // Native images are already in the format we want so they just point into the file.
+        mo_result result = mo_image_create__mapped(pContext, width, height, pImageData, pMapping, ppImage);
+        mo_file_mapping__release(pMapping);
+        return result;
     } else if (mo_extension_equal(filePath, "tga")) {
         pImageDataTGA = mo_image_load__tga(pFileData, fileSize, &width, &height, &format);
         if (pImageDataTGA == NULL) {
             mo_logf(pContext, "Corrupt image file (%s)", filePath);
-            mo_free(pFileData);
+            mo_file_mapping__release(pMapping);
             return MO_INVALID_RESOURCE;
         }
 
@@ -2862,12 +6030,13 @@ mo_result mo_image_load(mo_context* pContext, const char* filePath, mo_image** p
         pImageDataSTB = mo_image_load__stb(pFileData, fileSize, &width, &height, &format);
         if (pImageDataSTB == NULL) {
             mo_logf(pContext, "Unsupported or corrupt image file (%s): %s", filePath, stbi__g_failure_reason);
-            mo_free(pFileData);
+            mo_file_mapping__release(pMapping);
             return MO_INVALID_RESOURCE;
         }
 
         pImageData = pImageDataSTB;
 #else
+        mo_file_mapping__release(pMapping);
         return MO_INVALID_RESOURCE;
 #endif
     }
@@ -2884,16 +6053,54 @@ mo_result mo_image_load(mo_context* pContext, const char* filePath, mo_image** p
     }
 #endif
 
-    mo_free(pFileData); // <-- This must be done last! The reason is that pImageData might just be an offset of this pointer.
+    mo_file_mapping__release(pMapping);
     return result;
 }
 
 void mo_image_delete(mo_context* pContext, mo_image* pImage)
 {
     if (pContext == NULL || pImage == NULL) return;
+
+    mo_file_mapping__release(pImage->pFileMapping);
+    mo_free(pImage->pWritableData);
+    mo_free(pImage->pRowSpans);
     mo_free(pImage);
 }
 
+mo_result mo_image_make_writable(mo_context* pContext, mo_image* pImage)
+{
+    if (pContext == NULL || pImage == NULL) return MO_INVALID_ARGS;
+
+    if (pImage->pFileMapping == NULL) {
+        return MO_SUCCESS;
+    }
+
+    size_t dataSize = (size_t)pImage->width * pImage->height;
+    mo_uint8* pWritableData = (mo_uint8*)mo_malloc(dataSize);
+    if (pWritableData == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    mo_copy_memory(pWritableData, pImage->pData, dataSize);
+    pImage->pData = pWritableData;
+    pImage->pWritableData = pWritableData;
+
+    mo_file_mapping__release(pImage->pFileMapping);
+    pImage->pFileMapping = NULL;
+
+    return MO_SUCCESS;
+}
+
+void mo_image_update(mo_context* pContext, mo_image* pImage)
+{
+    if (pContext == NULL || pImage == NULL) return;
+
+    mo_free(pImage->pRowSpans);
+    pImage->pRowSpans = NULL;
+    pImage->pSpans = NULL;
+    mo_image__build_spans(pContext, pImage);
+}
+
 
 //// Drawing ////
 
@@ -2906,18 +6113,17 @@ static float mo_color_distance2(mo_color_rgba c1, mo_color_rgba c2)
     return (float)(diffr*diffr + diffg*diffg + diffb*diffb);
 }
 
-mo_color_index mo_find_closest_color(mo_context* pContext, mo_color_rgba color)
+#if !defined(MO_SUPPORT_SSE2) && !defined(MO_SUPPORT_NEON)
+static mo_color_index mo_find_closest_color__scalar(mo_context* pContext, mo_color_rgba color)
 {
-    if (pContext == NULL) return 0;
-
     // We just do a simple distance test.
     float minDistance = 3.402823e+38f;  // FLT_MAX
     mo_color_index closestIndex = 0;
 
     mo_color_index i = 0;
     for (;;) {
-        if (i != pContext->profile.transparentColorIndex) {
-            float distance = mo_color_distance2(color, pContext->profile.palette[i]);
+        if (i != pContext->lookupTransparentColorIndex) {
+            float distance = mo_color_distance2(color, pContext->lookupPalette[i]);
             if (minDistance > distance) {
                 minDistance = distance;
                 closestIndex = i;
@@ -2928,8 +6134,8 @@ mo_color_index mo_find_closest_color(mo_context* pContext, mo_color_rgba color)
             }
         }
 
-        mo_assert(pContext->profile.paletteSize > 0);
-        if (i == 255 || i == pContext->profile.paletteSize-1) {
+        mo_assert(pContext->lookupPaletteSize > 0);
+        if (i == 255 || i == pContext->lookupPaletteSize-1) {
             break;
         }
 
@@ -2938,6 +6144,188 @@ mo_color_index mo_find_closest_color(mo_context* pContext, mo_color_rgba color)
 
     return closestIndex;
 }
+#endif
+
+#if defined(MO_SUPPORT_SSE2) || defined(MO_SUPPORT_AVX2) || defined(MO_SUPPORT_NEON)
+// The SIMD searches keep the closest distance and index separately in each lane, and then pick the closest lane. Ties
+// go to the lowest index to match the scalar search.
+static mo_color_index mo_find_closest_color__reduce(const float* pDistances, const mo_int32* pIndices, mo_uint32 laneCount)
+{
+    mo_uint32 iBest = 0;
+    for (mo_uint32 iLane = 1; iLane < laneCount; ++iLane) {
+        if (pDistances[iLane] < pDistances[iBest] || (pDistances[iLane] == pDistances[iBest] && pIndices[iLane] < pIndices[iBest])) {
+            iBest = iLane;
+        }
+    }
+
+    return (mo_color_index)pIndices[iBest];
+}
+#endif
+
+#if defined(MO_SUPPORT_SSE2)
+static mo_color_index mo_find_closest_color__sse2(mo_context* pContext, mo_color_rgba color)
+{
+    const __m128 r = _mm_set1_ps((float)color.r);
+    const __m128 g = _mm_set1_ps((float)color.g);
+    const __m128 b = _mm_set1_ps((float)color.b);
+    const __m128i four = _mm_set1_epi32(4);
+    __m128 minDistance = _mm_set1_ps(3.402823e+38f);
+    __m128i minIndex = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (mo_uint32 i = 0; i < pContext->paletteSearchCount; i += 4) {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(pContext->paletteSearchR + i), r);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(pContext->paletteSearchG + i), g);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(pContext->paletteSearchB + i), b);
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+        __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, minDistance));
+        minIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, minIndex));
+        minDistance = _mm_min_ps(distance, minDistance);
+        index = _mm_add_epi32(index, four);
+    }
+
+    float distances[4];
+    mo_int32 indices[4];
+    _mm_storeu_ps(distances, minDistance);
+    _mm_storeu_si128((__m128i*)indices, minIndex);
+    return mo_find_closest_color__reduce(distances, indices, 4);
+}
+#endif
+
+#ifdef MO_SUPPORT_AVX2
+MO_AVX2_FUNCTION
+static mo_color_index mo_find_closest_color__avx2(mo_context* pContext, mo_color_rgba color)
+{
+    const __m256 r = _mm256_set1_ps((float)color.r);
+    const __m256 g = _mm256_set1_ps((float)color.g);
+    const __m256 b = _mm256_set1_ps((float)color.b);
+    const __m256i eight = _mm256_set1_epi32(8);
+    __m256 minDistance = _mm256_set1_ps(3.402823e+38f);
+    __m256i minIndex = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (mo_uint32 i = 0; i < pContext->paletteSearchCount; i += 8) {
+        __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(pContext->paletteSearchR + i), r);
+        __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(pContext->paletteSearchG + i), g);
+        __m256 db = _mm256_sub_ps(_mm256_loadu_ps(pContext->paletteSearchB + i), b);
+        __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+
+        __m256 closer = _mm256_cmp_ps(distance, minDistance, _CMP_LT_OQ);
+        minIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(minIndex), _mm256_castsi256_ps(index), closer));
+        minDistance = _mm256_min_ps(distance, minDistance);
+        index = _mm256_add_epi32(index, eight);
+    }
+
+    float distances[8];
+    mo_int32 indices[8];
+    _mm256_storeu_ps(distances, minDistance);
+    _mm256_storeu_si256((__m256i*)indices, minIndex);
+    return mo_find_closest_color__reduce(distances, indices, 8);
+}
+#endif
+
+#if defined(MO_SUPPORT_NEON)
+static mo_color_index mo_find_closest_color__neon(mo_context* pContext, mo_color_rgba color)
+{
+    const float32x4_t r = vdupq_n_f32((float)color.r);
+    const float32x4_t g = vdupq_n_f32((float)color.g);
+    const float32x4_t b = vdupq_n_f32((float)color.b);
+    const mo_int32 firstIndices[4] = {0, 1, 2, 3};
+    float32x4_t minDistance = vdupq_n_f32(3.402823e+38f);
+    int32x4_t minIndex = vdupq_n_s32(0);
+    int32x4_t index = vld1q_s32(firstIndices);
+
+    for (mo_uint32 i = 0; i < pContext->paletteSearchCount; i += 4) {
+        float32x4_t dr = vsubq_f32(vld1q_f32(pContext->paletteSearchR + i), r);
+        float32x4_t dg = vsubq_f32(vld1q_f32(pContext->paletteSearchG + i), g);
+        float32x4_t db = vsubq_f32(vld1q_f32(pContext->paletteSearchB + i), b);
+        float32x4_t distance = vmlaq_f32(vmlaq_f32(vmulq_f32(dr, dr), dg, dg), db, db);
+
+        uint32x4_t closer = vcltq_f32(distance, minDistance);
+        minIndex = vbslq_s32(closer, index, minIndex);
+        minDistance = vminq_f32(distance, minDistance);
+        index = vaddq_s32(index, vdupq_n_s32(4));
+    }
+
+    float distances[4];
+    mo_int32 indices[4];
+    vst1q_f32(distances, minDistance);
+    vst1q_s32(indices, minIndex);
+    return mo_find_closest_color__reduce(distances, indices, 4);
+}
+#endif
+
+static mo_color_index mo_find_closest_color__unchecked(mo_context* pContext, mo_color_rgba color)
+{
+    // The lookups must be up to date with mo_palette_lookup__update(). This is what image conversion uses since it
+    // only needs to check once for the whole image, and it can be called from multiple threads.
+
+    // The color cube narrows the search down to the few palette entries that could possibly be the closest.
+    if (pContext->pColorCubeOffsets != NULL) {
+        mo_uint32 cell = ((mo_uint32)(color.r >> 3) << 11) | ((mo_uint32)(color.g >> 2) << 5) | (mo_uint32)(color.b >> 3);
+        mo_uint32 iEntry    = pContext->pColorCubeOffsets[cell];
+        mo_uint32 iEntryEnd = pContext->pColorCubeOffsets[cell+1];
+
+        mo_color_index closestIndex = 0;
+        float minDistance = 3.402823e+38f;  // FLT_MAX
+        for (; iEntry < iEntryEnd; ++iEntry) {
+            mo_color_index i = pContext->pColorCubeEntries[iEntry];
+            float distance = mo_color_distance2(color, pContext->lookupPalette[i]);
+            if (minDistance > distance) {
+                minDistance = distance;
+                closestIndex = i;
+            }
+        }
+
+        return closestIndex;
+    }
+
+    // No cube so the whole palette needs to be searched.
+#ifdef MO_SUPPORT_AVX2
+    if (pContext->flags & MO_FLAG_HAS_AVX2) {
+        return mo_find_closest_color__avx2(pContext, color);
+    }
+#endif
+#if defined(MO_SUPPORT_SSE2)
+    return mo_find_closest_color__sse2(pContext, color);
+#elif defined(MO_SUPPORT_NEON)
+    return mo_find_closest_color__neon(pContext, color);
+#else
+    return mo_find_closest_color__scalar(pContext, color);
+#endif
+}
+
+mo_color_index mo_find_closest_color(mo_context* pContext, mo_color_rgba color)
+{
+    if (pContext == NULL) return 0;
+
+    mo_palette_lookup__update(pContext, 1);
+    return mo_find_closest_color__unchecked(pContext, color);
+}
+
+mo_result mo_set_palette(mo_context* pContext, mo_uint32 paletteSize, const mo_color_rgba* pPalette)
+{
+    if (pContext == NULL || pPalette == NULL || paletteSize == 0 || paletteSize > 256) return MO_INVALID_ARGS;
+    if (pContext->profile.transparentColorIndex >= paletteSize) return MO_INVALID_ARGS;
+
+    // The presentation thread reads the palette so it needs to be finished with the previous frame first.
+    mo_wait_for_async_present(pContext);
+
+    mo_copy_memory(pContext->profile.palette, pPalette, paletteSize * sizeof(*pPalette));
+    pContext->profile.paletteSize = paletteSize;
+    pContext->paletteGeneration += 1;
+
+    // Every pixel on the screen may have changed color.
+    mo_mark_presentation_stale(pContext);
+    return MO_SUCCESS;
+}
+
+void mo_invalidate_palette(mo_context* pContext)
+{
+    if (pContext == NULL) return;
+    pContext->paletteGeneration += 1;
+}
 
 void mo_clear(mo_context* pContext, mo_color_index colorIndex)
 {
@@ -2948,6 +6336,26 @@ void mo_clear(mo_context* pContext, mo_color_index colorIndex)
             pContext->screen[y*pContext->profile.resolutionX + x] = colorIndex;
         }
     }
+
+    mo_mark_all_dirty(pContext);
+}
+
+void mo_invalidate(mo_context* pContext, int posX, int posY, int sizeX, int sizeY)
+{
+    if (pContext == NULL) return;
+
+    int left   = posX;
+    int top    = posY;
+    int right  = left + sizeX;
+    int bottom = top + sizeY;
+
+    // Clamp.
+    if (left   < 0)   left   = 0;
+    if (top    < 0)   top    = 0;
+    if (right  > (int)pContext->profile.resolutionX) right  = (int)pContext->profile.resolutionX;
+    if (bottom > (int)pContext->profile.resolutionY) bottom = (int)pContext->profile.resolutionY;
+
+    mo_mark_dirty(pContext, left, top, right, bottom);
 }
 
 void mo_draw_quad(mo_context* pContext, int posX, int posY, int sizeX, int sizeY, mo_color_index colorIndex)
@@ -2969,6 +6377,8 @@ void mo_draw_quad(mo_context* pContext, int posX, int posY, int sizeX, int sizeY
     if (right  > (int)pContext->profile.resolutionX) right  = (int)pContext->profile.resolutionX;
     if (bottom > (int)pContext->profile.resolutionY) bottom = (int)pContext->profile.resolutionY;
 
+    mo_mark_dirty(pContext, left, top, right, bottom);
+
     // Draw.
     // TODO: Optimize me.
     for (int y = top; y < bottom; ++y) {
@@ -3265,6 +6675,8 @@ static void mo_draw_glyph(mo_context* pContext, int posX, int posY, char c, mo_c
     if (right  > (int)pContext->profile.resolutionX) right  = (int)pContext->profile.resolutionX;
     if (bottom > (int)pContext->profile.resolutionY) bottom = (int)pContext->profile.resolutionY;
 
+    mo_mark_dirty(pContext, left, top, right, bottom);
+
     // Draw.
     // TODO: Optimize me.
     for (int y = top; y < bottom; ++y) {
@@ -3305,34 +6717,177 @@ void mo_draw_textf(mo_context* pContext, int posX, int posY, mo_color_index colo
 #endif
     va_end(args);
 
-    if (len < 0) {
-        return;
+    if (len < 0) {
+        return;
+    }
+
+    char* text = (char*)mo_malloc(len+1);
+    if (text == NULL) {
+        va_end(args);
+        return;
+    }
+
+    va_start(args, format);
+#if defined(_MSC_VER)
+    len = vsprintf_s(text, len+1, format, args);
+#else
+    len = vsnprintf(text, len+1, format, args);
+#endif
+    va_end(args);
+
+    mo_draw_text(pContext, posX, posY, colorIndex, text);
+
+    mo_free(text);
+    va_end(args);
+}
+
+void mo_draw_image(mo_context* pContext, int dstX, int dstY, mo_image* pImage, int srcX, int srcY, int srcWidth, int srcHeight)
+{
+    if (pImage == NULL) return;
+    mo_draw_image_scaled(pContext, dstX, dstY, srcWidth, srcHeight, pImage, srcX, srcY, srcWidth, srcHeight);
+}
+
+// Draws an already clipped, unscaled rectangle of an image by copying each opaque run of pixels that's inside it.
+static void mo_draw_image__spans(mo_context* pContext, int dstX, int dstY, int width, int height, mo_image* pImage, int imageX, int imageY)
+{
+    for (int y = 0; y < height; ++y) {
+        const mo_image_span* pSpan    = pImage->pSpans + pImage->pRowSpans[imageY+y];
+        const mo_image_span* pSpanEnd = pImage->pSpans + pImage->pRowSpans[imageY+y+1];
+
+        // Sprite sheets can have a lot of spans in a row so the first one reaching into the rectangle is searched for.
+        const mo_image_span* pSpanLo = pSpan;
+        const mo_image_span* pSpanHi = pSpanEnd;
+        while (pSpanLo < pSpanHi) {
+            const mo_image_span* pSpanMid = pSpanLo + ((pSpanHi - pSpanLo) / 2);
+            if (pSpanMid->x + pSpanMid->length <= imageX) {
+                pSpanLo = pSpanMid + 1;
+            } else {
+                pSpanHi = pSpanMid;
+            }
+        }
+
+        const mo_uint8* pSrcRow = pImage->pData + ((size_t)(imageY+y) * pImage->width);
+        mo_color_index* pDstRow = pContext->screen + ((size_t)(dstY+y) * pContext->profile.resolutionX) + dstX;
+        for (pSpan = pSpanLo; pSpan < pSpanEnd && pSpan->x < imageX+width; ++pSpan) {
+            int spanBeg = (pSpan->x > imageX) ? pSpan->x : imageX;
+            int spanEnd = (pSpan->x + pSpan->length < imageX+width) ? pSpan->x + pSpan->length : imageX+width;
+            mo_copy_memory(pDstRow + (spanBeg - imageX), pSrcRow + spanBeg, spanEnd - spanBeg);
+        }
+    }
+}
+
+static void mo_blit_masked__scalar(mo_color_index* pDst, const mo_uint8* pSrc, mo_uint32 count, mo_color_index transparentColorIndex)
+{
+    for (mo_uint32 i = 0; i < count; ++i) {
+        if (pSrc[i] != transparentColorIndex) {
+            pDst[i] = pSrc[i];
+        }
+    }
+}
+
+#if defined(MO_SUPPORT_SSE2)
+static void mo_blit_masked__sse2(mo_color_index* pDst, const mo_uint8* pSrc, mo_uint32 count, mo_color_index transparentColorIndex)
+{
+    // 16 at a time. Blocks that are entirely transparent or entirely opaque skip the blend.
+    const __m128i transparent = _mm_set1_epi8((char)transparentColorIndex);
+    mo_uint32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i src = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m128i mask = _mm_cmpeq_epi8(src, transparent);
+        int bits = _mm_movemask_epi8(mask);
+        if (bits == 0xFFFF) {
+            continue;
+        }
+        if (bits != 0) {
+            __m128i dst = _mm_loadu_si128((const __m128i*)(pDst + i));
+            src = _mm_or_si128(_mm_andnot_si128(mask, src), _mm_and_si128(mask, dst));
+        }
+        _mm_storeu_si128((__m128i*)(pDst + i), src);
+    }
+
+    mo_blit_masked__scalar(pDst + i, pSrc + i, count - i, transparentColorIndex);
+}
+#endif
+
+#ifdef MO_SUPPORT_AVX2
+MO_AVX2_FUNCTION
+static void mo_blit_masked__avx2(mo_color_index* pDst, const mo_uint8* pSrc, mo_uint32 count, mo_color_index transparentColorIndex)
+{
+    // 32 at a time, then 16 at a time for what's left so narrow sprites still benefit.
+    const __m256i transparent = _mm256_set1_epi8((char)transparentColorIndex);
+    mo_uint32 i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i src = _mm256_loadu_si256((const __m256i*)(pSrc + i));
+        __m256i mask = _mm256_cmpeq_epi8(src, transparent);
+        int bits = _mm256_movemask_epi8(mask);
+        if (bits == -1) {
+            continue;
+        }
+        if (bits != 0) {
+            src = _mm256_blendv_epi8(src, _mm256_loadu_si256((const __m256i*)(pDst + i)), mask);
+        }
+        _mm256_storeu_si256((__m256i*)(pDst + i), src);
+    }
+
+    const __m128i transparent128 = _mm256_castsi256_si128(transparent);
+    for (; i + 16 <= count; i += 16) {
+        __m128i src = _mm_loadu_si128((const __m128i*)(pSrc + i));
+        __m128i mask = _mm_cmpeq_epi8(src, transparent128);
+        _mm_storeu_si128((__m128i*)(pDst + i), _mm_blendv_epi8(src, _mm_loadu_si128((const __m128i*)(pDst + i)), mask));
     }
 
-    char* text = (char*)mo_malloc(len+1);
-    if (text == NULL) {
-        va_end(args);
-        return;
+    mo_blit_masked__scalar(pDst + i, pSrc + i, count - i, transparentColorIndex);
+}
+#endif
+
+#if defined(MO_SUPPORT_NEON)
+static void mo_blit_masked__neon(mo_color_index* pDst, const mo_uint8* pSrc, mo_uint32 count, mo_color_index transparentColorIndex)
+{
+    const uint8x16_t transparent = vdupq_n_u8(transparentColorIndex);
+    mo_uint32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t src = vld1q_u8(pSrc + i);
+        uint8x16_t mask = vceqq_u8(src, transparent);
+        vst1q_u8(pDst + i, vbslq_u8(mask, vld1q_u8(pDst + i), src));
     }
 
-    va_start(args, format);
-#if defined(_MSC_VER)
-    len = vsprintf_s(text, len+1, format, args);
-#else
-    len = vsnprintf(text, len+1, format, args);
+    mo_blit_masked__scalar(pDst + i, pSrc + i, count - i, transparentColorIndex);
+}
 #endif
-    va_end(args);
 
-    mo_draw_text(pContext, posX, posY, colorIndex, text);
+// Copies a row of color indices, skipping over transparent ones.
+static void mo_blit_masked(mo_context* pContext, mo_color_index* pDst, const mo_uint8* pSrc, mo_uint32 count)
+{
+    const mo_color_index transparentColorIndex = pContext->profile.transparentColorIndex;
 
-    mo_free(text);
-    va_end(args);
+#ifdef MO_SUPPORT_AVX2
+    if (pContext->flags & MO_FLAG_HAS_AVX2) {
+        mo_blit_masked__avx2(pDst, pSrc, count, transparentColorIndex);
+        return;
+    }
+#endif
+#if defined(MO_SUPPORT_SSE2)
+    mo_blit_masked__sse2(pDst, pSrc, count, transparentColorIndex);
+#elif defined(MO_SUPPORT_NEON)
+    mo_blit_masked__neon(pDst, pSrc, count, transparentColorIndex);
+#else
+    mo_blit_masked__scalar(pDst, pSrc, count, transparentColorIndex);
+#endif
 }
 
-void mo_draw_image(mo_context* pContext, int dstX, int dstY, mo_image* pImage, int srcX, int srcY, int srcWidth, int srcHeight)
+// Draws an already clipped, unscaled rectangle of an image a row at a time, skipping transparent pixels. This is for
+// images that don't have spans.
+static void mo_draw_image__masked(mo_context* pContext, int dstX, int dstY, int width, int height, mo_image* pImage, int imageX, int imageY)
 {
-    if (pImage == NULL) return;
-    mo_draw_image_scaled(pContext, dstX, dstY, pImage->width, pImage->height, pImage, srcX, srcY, srcWidth, srcHeight);
+    if (width <= 0) {
+        return;
+    }
+
+    for (int y = 0; y < height; ++y) {
+        const mo_uint8* pSrcRow = pImage->pData + ((size_t)(imageY+y) * pImage->width) + imageX;
+        mo_color_index* pDstRow = pContext->screen + ((size_t)(dstY+y) * pContext->profile.resolutionX) + dstX;
+        mo_blit_masked(pContext, pDstRow, pSrcRow, (mo_uint32)width);
+    }
 }
 
 void mo_draw_image_scaled(mo_context* pContext, int dstX, int dstY, int dstWidth, int dstHeight, mo_image* pImage, int srcX, int srcY, int srcWidth, int srcHeight/*, float rotation*/)
@@ -3399,20 +6954,17 @@ void mo_draw_image_scaled(mo_context* pContext, int dstX, int dstY, int dstWidth
         dstHeight = (int)pContext->profile.resolutionY - dstY;
     }
 
+    mo_mark_dirty(pContext, dstX, dstY, dstX+dstWidth, dstY+dstHeight);
+
     //if (rotation == 0) {
         if (scaleX == 1.0f && scaleY == 1.0f) {
-            // No rotation, no scaling. Fast path.
-            // TODO: Optimize me.
-            for (int y = 0; y < dstHeight; ++y) {
-                for (int x = 0; x < dstWidth; ++x) {
-                    int imageX = (int)(srcXOffset + srcX + x);
-                    int imageY = (int)(srcYOffset + srcY + y);
-
-                    mo_color_index colorIndex = pImage->pData[imageY*pImage->width + imageX];
-                    if (colorIndex != pContext->profile.transparentColorIndex) {
-                        pContext->screen[(dstY+y)*pContext->profile.resolutionX + (dstX+x)] = colorIndex;
-                    }
-                }
+            // No rotation, no scaling. Fast path. The offsets are always whole pixels here.
+            int imageX = srcX + (int)srcXOffset;
+            int imageY = srcY + (int)srcYOffset;
+            if (pImage->pRowSpans != NULL && pImage->spanTransparentColorIndex == pContext->profile.transparentColorIndex) {
+                mo_draw_image__spans(pContext, dstX, dstY, dstWidth, dstHeight, pImage, imageX, imageY);
+            } else {
+                mo_draw_image__masked(pContext, dstX, dstY, dstWidth, dstHeight, pImage, imageX, imageY);
             }
         } else {
             // No rotation, with scaling.
@@ -3438,6 +6990,35 @@ void mo_draw_image_scaled(mo_context* pContext, int dstX, int dstY, int dstWidth
 
 //// Audio ////
 
+static mo_int16* mo_sound_source__decode_if_short(mo_context* pContext, mo_sound_source_type type, size_t dataSize, const void* pData, mo_uint32* pChannels, mo_uint32* pSampleRate, mo_uint64* pFrameCount)
+{
+    // Decodes the whole of a compressed sound, but only if it's no longer than profile.audioDecodeOnLoadMilliseconds.
+    // Returns NULL if it's too long, or if it can't be decoded here in which case it's left to fail later.
+    mo_uint32 channels;
+    mo_uint32 sampleRate;
+    void* pDecoder = mo_stream__open_memory_decoder(type, pData, dataSize, &channels, &sampleRate);
+    if (pDecoder == NULL) {
+        return NULL;
+    }
+
+    mo_int16* pSamples = NULL;
+    mo_uint64 frameCount = mo_stream__get_length_in_frames(type, pDecoder);
+    if (frameCount > 0 && frameCount*1000 <= (mo_uint64)pContext->profile.audioDecodeOnLoadMilliseconds * sampleRate) {
+        pSamples = (mo_int16*)mo_malloc((size_t)(frameCount * channels * sizeof(mo_int16)));
+        if (pSamples != NULL) {
+            // The length is only a hint so whatever is actually decoded is used.
+            frameCount = mo_stream__decode(type, pDecoder, channels, pSamples, (mo_uint32)frameCount);
+        }
+    }
+
+    mo_stream__close_decoder(type, pDecoder);
+
+    *pChannels = channels;
+    *pSampleRate = sampleRate;
+    *pFrameCount = frameCount;
+    return pSamples;
+}
+
 mo_result mo_sound_source_create__generic_decoder(mo_context* pContext, mo_sound_source_type type, size_t dataSize, const void* pData, mo_sound_source** ppSource)
 {
     if (ppSource == NULL) return MO_INVALID_ARGS;
@@ -3445,12 +7026,39 @@ mo_result mo_sound_source_create__generic_decoder(mo_context* pContext, mo_sound
 
     if (pContext == NULL || dataSize == 0 || pData == NULL) return MO_INVALID_ARGS;
 
+    // Short sounds are decoded once here and turned into a raw source rather than being decoded every time they're
+    // played.
+    if (pContext->profile.audioDecodeOnLoadMilliseconds > 0) {
+        mo_uint32 channels;
+        mo_uint32 sampleRate;
+        mo_uint64 frameCount;
+        mo_int16* pSamples = mo_sound_source__decode_if_short(pContext, type, dataSize, pData, &channels, &sampleRate, &frameCount);
+        if (pSamples != NULL) {
+            mo_result result = mo_sound_source_create(pContext, channels, sampleRate, frameCount * channels, pSamples, ppSource);
+            mo_free(pSamples);
+            return result;
+        }
+    }
+
+    // The data is checked and the format found out here. Each sound opens its own decoder on the streaming thread.
+    mo_uint32 channels;
+    mo_uint32 sampleRate;
+    void* pDecoder = mo_stream__open_memory_decoder(type, pData, dataSize, &channels, &sampleRate);
+    if (pDecoder == NULL) {
+        return MO_INVALID_RESOURCE;
+    }
+
+    mo_stream__close_decoder(type, pDecoder);
+
     mo_sound_source* pSource = (mo_sound_source*)mo_calloc(sizeof(*pSource) + dataSize);
     if (pSource == NULL) {
         return MO_OUT_OF_MEMORY;
     }
 
+    pSource->pContext = pContext;
     pSource->type = type;
+    pSource->vorbis.channels = channels;
+    pSource->vorbis.sampleRate = sampleRate;
     pSource->vorbis.dataSize = dataSize;
     mo_copy_memory(pSource->vorbis.pData, pData, dataSize);
 
@@ -3469,13 +7077,52 @@ mo_result mo_sound_source_create_vorbis(mo_context* pContext, size_t dataSize, c
 
 mo_result mo_sound_source_create_flac(mo_context* pContext, size_t dataSize, const void* pData, mo_sound_source** ppSource)
 {
-#ifdef MO_HAS_STB_VORBIS
+#ifdef MO_HAS_DR_FLAC
     return mo_sound_source_create__generic_decoder(pContext, mo_sound_source_type_flac, dataSize, pData, ppSource);
 #else
     return MO_UNSUPPORTED_AUDIO_FORMAT;
 #endif
 }
 
+static mo_result mo_resample_s16(const mo_context* pContext, const mo_int16* pSrc, mo_uint64 srcFrameCount, mo_uint32 channels, mo_uint64 step, mo_int16* pDst, mo_uint64 dstFrameCount)
+{
+    // Used for resampling a whole sound up front. The source is converted to floating point with silence either side of
+    // it for the filter to read into at the start and end.
+    mo_uint64 windowSizeInSamples = (MO_RESAMPLER_TAPS + srcFrameCount + MO_RESAMPLER_TAPS) * channels;
+    if (windowSizeInSamples > SIZE_MAX/sizeof(float)) return MO_INVALID_ARGS;
+
+    float* pWindow = (float*)mo_calloc((size_t)(windowSizeInSamples * sizeof(float)));
+    if (pWindow == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    for (mo_uint64 iSample = 0; iSample < srcFrameCount*channels; ++iSample) {
+        pWindow[MO_RESAMPLER_TAPS*channels + iSample] = pSrc[iSample];
+    }
+
+    float tempFrames[4096];
+    mo_uint32 tempFrameCount = sizeof(tempFrames) / sizeof(tempFrames[0]) / channels;
+
+    mo_uint64 pos = (mo_uint64)MO_RESAMPLER_TAPS << 32;
+    while (dstFrameCount > 0) {
+        mo_uint32 framesToProcess = tempFrameCount;
+        if (framesToProcess > dstFrameCount) {
+            framesToProcess = (mo_uint32)dstFrameCount;
+        }
+
+        mo_zero_memory(tempFrames, framesToProcess * channels * sizeof(float));
+        mo_resample__accumulate(pContext, pWindow, channels, pos, step, tempFrames, framesToProcess, 1, 1);
+        mo_mixer__convert_bus_to_s16(pDst, tempFrames, framesToProcess * channels);
+
+        pos += framesToProcess * step;
+        pDst += framesToProcess * channels;
+        dstFrameCount -= framesToProcess;
+    }
+
+    mo_free(pWindow);
+    return MO_SUCCESS;
+}
+
 mo_result mo_sound_source_create(mo_context* pContext, unsigned int channels, unsigned int sampleRate, mo_uint64 sampleCount, const mo_int16* pSampleData, mo_sound_source** ppSource)
 {
     if (ppSource == NULL) return MO_INVALID_ARGS;
@@ -3484,6 +7131,20 @@ mo_result mo_sound_source_create(mo_context* pContext, unsigned int channels, un
     if (pContext == NULL || channels == 0 || sampleRate == 0 || sampleCount == 0) return MO_INVALID_ARGS;
     if (sampleCount > SIZE_MAX/sizeof(mo_int16)) return MO_INVALID_ARGS; // Sound is too big.
 
+    // When pre-resampling is enabled the sound is converted to the device's sample rate here so the mixer can just
+    // read it directly. The length is worked out from the step so the last frame is guaranteed to be inside the source.
+    mo_uint32 deviceSampleRate = pContext->playbackDevice2.sampleRate;
+    mo_bool32 isResampling = pContext->profile.audioPreResample && sampleRate != deviceSampleRate && deviceSampleRate != 0;
+    mo_uint64 resamplerStep = 0;
+    mo_uint64 srcFrameCount = sampleCount / channels;
+    if (isResampling) {
+        if (srcFrameCount == 0 || srcFrameCount > 0xFFFFFFFF) return MO_INVALID_ARGS;
+        resamplerStep = mo_resampler__calculate_step(sampleRate, deviceSampleRate, 1);
+        sampleCount = (((srcFrameCount << 32) + resamplerStep - 1) / resamplerStep) * channels;
+        sampleRate = deviceSampleRate;
+        if (sampleCount > SIZE_MAX/sizeof(mo_int16)) return MO_INVALID_ARGS;
+    }
+
     size_t sampleDataSize = (size_t)(sampleCount * sizeof(mo_int16));
 
     mo_sound_source* pSource = (mo_sound_source*)mo_calloc(sizeof(*pSource) + sampleDataSize);
@@ -3491,17 +7152,55 @@ mo_result mo_sound_source_create(mo_context* pContext, unsigned int channels, un
         return MO_OUT_OF_MEMORY;
     }
 
+    pSource->pContext = pContext;
+    pSource->type = mo_sound_source_type_raw;
+    pSource->raw.channels = channels;
+    pSource->raw.sampleRate = sampleRate;
+    pSource->raw.sampleCount = sampleCount;
+    pSource->raw.pSampleData = (mo_int16*)(pSource + 1);
+
+    if (isResampling) {
+        mo_result result = mo_resample_s16(pContext, pSampleData, srcFrameCount, channels, resamplerStep, (mo_int16*)(pSource + 1), sampleCount / channels);
+        if (result != MO_SUCCESS) {
+            mo_free(pSource);
+            return result;
+        }
+    } else {
+        mo_copy_memory(pSource + 1, pSampleData, sampleDataSize);
+    }
+
+    *ppSource = pSource;
+    return MO_SUCCESS;
+}
+
+// Creates a raw source whose sample data points straight into a mapped WAV file. The source holds a reference to the mapping.
+static mo_result mo_sound_source_create__mapped(mo_context* pContext, unsigned int channels, unsigned int sampleRate, mo_uint64 sampleCount, const mo_int16* pSampleData, mo_file_mapping* pMapping, mo_sound_source** ppSource)
+{
+    mo_assert(ppSource != NULL);
+    *ppSource = NULL;
+
+    if (pContext == NULL || channels == 0 || sampleRate == 0 || sampleCount == 0 || pMapping == NULL) return MO_INVALID_ARGS;
+
+    mo_sound_source* pSource = (mo_sound_source*)mo_calloc(sizeof(*pSource));
+    if (pSource == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    pSource->pContext = pContext;
     pSource->type = mo_sound_source_type_raw;
+    pSource->pFileMapping = mo_file_mapping__retain(pMapping);
     pSource->raw.channels = channels;
     pSource->raw.sampleRate = sampleRate;
     pSource->raw.sampleCount = sampleCount;
-    mo_copy_memory(pSource->raw.pSampleData, pSampleData, sampleDataSize);
+    pSource->raw.pSampleData = pSampleData;
 
     *ppSource = pSource;
     return MO_SUCCESS;
 }
 
-static mo_int16* mo_sound_source_load__wav(const void* pFileData, size_t fileSize, unsigned int* pChannels, unsigned int* pSampleRate, mo_uint64* pSampleCount)
+// When pIsAliased is not null and the file contains 16-bit PCM the returned pointer points into pFileData rather than
+// a new allocation, and *pIsAliased is set to true. In that case it must not be freed.
+static mo_int16* mo_sound_source_load__wav(const void* pFileData, size_t fileSize, unsigned int* pChannels, unsigned int* pSampleRate, mo_uint64* pSampleCount, mo_bool32* pIsAliased)
 {
     // NOTES:
     // - This function only works on little endian.
@@ -3529,6 +7228,7 @@ static mo_int16* mo_sound_source_load__wav(const void* pFileData, size_t fileSiz
     if (pChannels) *pChannels = 0;
     if (pSampleRate) *pSampleRate = 0;
     if (pSampleCount) *pSampleCount = 0;
+    if (pIsAliased) *pIsAliased = MO_FALSE;
     if (pFileData == NULL || fileSize < 4) return NULL;
 
     mo_bool32 isWave64 = MO_FALSE;
@@ -3677,6 +7377,17 @@ static mo_int16* mo_sound_source_load__wav(const void* pFileData, size_t fileSiz
         actualFormatTag = *(mo_uint16*)subformatGUID;   // The actual format tag is derived from the first 2 bytes of the subformat GUID.
     }
 
+    // 16-bit PCM is already in the format the mixer wants so it can be used straight out of the file.
+    if (pIsAliased != NULL && actualFormatTag == 0x0001 && bitsPerSample == 16 && ((size_t)pFileData8 & 1) == 0) {
+        if (fileSize < sampleCount*2) return NULL;
+
+        if (pChannels) *pChannels = (unsigned int)channels;
+        if (pSampleRate) *pSampleRate = (unsigned int)sampleRate;
+        if (pSampleCount) *pSampleCount = sampleCount;
+        *pIsAliased = MO_TRUE;
+        return (mo_int16*)pFileData8;
+    }
+
     mo_int16* pSamples = (mo_int16*)MO_WAV_MALLOC((size_t)sampleCount * sizeof(mo_int16));
     if (pSamples == NULL) {
         return NULL;
@@ -3687,6 +7398,7 @@ static mo_int16* mo_sound_source_load__wav(const void* pFileData, size_t fileSiz
         case 0x0001:    // WAVE_FORMAT_PCM
         {
             if (bitsPerSample == 16) {
+                if (fileSize < sampleCount*2) goto free_and_return_null;
                 MO_WAV_COPY(pSamples, pFileData8, (size_t)sampleCount * sizeof(mo_int16));
             } else {
                 // 8-, 24- and 32-bit conversions can be optimized.
@@ -3863,23 +7575,36 @@ mo_result mo_sound_source_load(mo_context* pContext, const char* filePath, mo_so
 
     if (pContext == NULL || filePath == NULL) return MO_INVALID_ARGS;
 
-    size_t fileSize;
-    void* pFileData = mo_open_and_read_file(pContext, filePath, &fileSize);
-    if (pFileData == NULL) {
+    mo_file_mapping* pMapping = mo_file_mapping__open(pContext, filePath);
+    if (pMapping == NULL) {
         return MO_DOES_NOT_EXIST;
     }
 
+    const void* pFileData = pMapping->pData;
+    size_t fileSize = pMapping->size;
+
     mo_result result = MO_INVALID_RESOURCE;
     mo_sound_source* pSource = NULL;
 
-    // WAV / Raw.
+    // WAV / Raw. 16-bit PCM is played straight out of the file unless it needs to be pre-resampled, in which case the
+    // resampler reads from the file instead.
     unsigned int channels;
     unsigned int sampleRate;
     uint64_t totalSampleCount;
-    mo_int16* pSampleDataS16 = mo_sound_source_load__wav(pFileData, fileSize, &channels, &sampleRate, &totalSampleCount);
+    mo_bool32 isAliased;
+    mo_int16* pSampleDataS16 = mo_sound_source_load__wav(pFileData, fileSize, &channels, &sampleRate, &totalSampleCount, &isAliased);
     if (pSampleDataS16 != NULL) {
-        result = mo_sound_source_create(pContext, channels, sampleRate, totalSampleCount, pSampleDataS16, &pSource);
-        mo_free(pSampleDataS16);
+        mo_uint32 deviceSampleRate = pContext->playbackDevice2.sampleRate;
+        mo_bool32 isResampling = pContext->profile.audioPreResample && sampleRate != deviceSampleRate && deviceSampleRate != 0;
+        if (isAliased && !isResampling) {
+            result = mo_sound_source_create__mapped(pContext, channels, sampleRate, totalSampleCount, pSampleDataS16, pMapping, &pSource);
+        } else {
+            result = mo_sound_source_create(pContext, channels, sampleRate, totalSampleCount, pSampleDataS16, &pSource);
+        }
+
+        if (!isAliased) {
+            mo_free(pSampleDataS16);
+        }
     }
 
 #ifdef MO_HAS_STB_VORBIS
@@ -3897,7 +7622,7 @@ mo_result mo_sound_source_load(mo_context* pContext, const char* filePath, mo_so
     }
 #endif
 
-    mo_free(pFileData);
+    mo_file_mapping__release(pMapping);
 
     if (pSource == NULL) {
         return MO_INVALID_RESOURCE;
@@ -3911,23 +7636,94 @@ mo_result mo_sound_source_load(mo_context* pContext, const char* filePath, mo_so
     return result;
 }
 
+mo_result mo_sound_source_open_stream(mo_context* pContext, const char* filePath, mo_sound_source** ppSource)
+{
+    if (ppSource == NULL) return MO_INVALID_ARGS;
+    mo_zero_object(ppSource);
+
+    if (pContext == NULL || filePath == NULL) return MO_INVALID_ARGS;
+
+    // The file is opened once here to find out what it is. It's opened again for each sound on the streaming thread.
+    mo_sound_source_type decoderTypes[2] = {mo_sound_source_type_vorbis, mo_sound_source_type_flac};
+    mo_sound_source_type decoderType = mo_sound_source_type_raw;
+    mo_uint32 channels = 0;
+    mo_uint32 sampleRate = 0;
+    for (int iDecoderType = 0; iDecoderType < 2; ++iDecoderType) {
+        void* pDecoder = mo_stream__open_file_decoder(decoderTypes[iDecoderType], filePath, &channels, &sampleRate);
+        if (pDecoder != NULL) {
+            mo_stream__close_decoder(decoderTypes[iDecoderType], pDecoder);
+            decoderType = decoderTypes[iDecoderType];
+            break;
+        }
+    }
+
+    if (decoderType == mo_sound_source_type_raw) {
+        mo_logf(pContext, "Could not open file for streaming: %s", filePath);
+        return MO_INVALID_RESOURCE;
+    }
+
+    size_t filePathSize = strlen(filePath) + 1;
+    mo_sound_source* pSource = (mo_sound_source*)mo_calloc(sizeof(*pSource) + filePathSize);
+    if (pSource == NULL) {
+        return MO_OUT_OF_MEMORY;
+    }
+
+    pSource->pContext = pContext;
+    pSource->type = mo_sound_source_type_stream;
+    pSource->stream.channels = channels;
+    pSource->stream.sampleRate = sampleRate;
+    pSource->stream.decoderType = decoderType;
+    mo_copy_memory(pSource->stream.filePath, filePath, filePathSize);
+
+    *ppSource = pSource;
+    return MO_SUCCESS;
+}
+
 void mo_sound_source_delete(mo_sound_source* pSource)
 {
     if (pSource == NULL) return;
+
+    // A sound that's been deleted may still be in use by the audio thread, in which case we need to wait for it to
+    // be released before the source can be freed. This only ever waits if the sound was deleted very recently.
+    mo_context* pContext = pSource->pContext;
+    for (mo_uint32 iSound = 0; iSound < pContext->retiringSoundCount; /* DO NOTHING */) {
+        mo_sound* pSound = pContext->ppRetiringSounds[iSound];
+        if (pSound->pSource == pSource) {
+            while (!mo_atomic_load_u32(&pSound->isRetired) || mo_atomic_load_u32(&pSound->isStreamFilling)) {
+                mo_audio__wait_for_mixer(pContext);
+            }
+
+            mo_sound__release(pSound);
+            pContext->ppRetiringSounds[iSound] = pContext->ppRetiringSounds[pContext->retiringSoundCount-1];
+            pContext->retiringSoundCount -= 1;
+        } else {
+            iSound += 1;
+        }
+    }
+
+    mo_file_mapping__release(pSource->pFileMapping);
     mo_free(pSource);
 }
 
 mo_result mo_play_sound_source(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group)
+{
+    return mo_play_sound_source_with_priority(pContext, pSource, group, 0);
+}
+
+static mo_result mo_sound__create(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group, mo_uint32 priority, mo_sound** ppSound);
+
+mo_result mo_play_sound_source_with_priority(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group, mo_uint32 priority)
 {
     if (pContext == NULL || pSource == NULL) return MO_INVALID_ARGS;
 
     mo_sound* pSound;
-    mo_result result = mo_sound_create(pContext, pSource, group, &pSound);
+    mo_result result = mo_sound__create(pContext, pSource, group, priority, &pSound);
     if (result != MO_SUCCESS) {
         return result;
     }
 
     pSound->flags |= MO_SOUND_FLAG_INLINED;
+    pContext->inlinedSoundCount += 1;
     mo_sound_play(pSound, MO_FALSE);
 
     return MO_SUCCESS;
@@ -3936,93 +7732,221 @@ mo_result mo_play_sound_source(mo_context* pContext, mo_sound_source* pSource, m
 
 void mo_sound_group_pause(mo_context* pContext, mo_uint32 group)
 {
-    if (pContext == NULL || group < MO_SOUND_GROUP_COUNT) return;
+    if (pContext == NULL || group >= MO_SOUND_GROUP_COUNT) return;
     pContext->soundGroups[group].flags |= MO_SOUND_GROUP_FLAG_PAUSED;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_group_pause;
+    command.group = group;
+    mo_audio__post_command(pContext, &command);
 }
 
 void mo_sound_group_resume(mo_context* pContext, mo_uint32 group)
 {
-    if (pContext == NULL || group < MO_SOUND_GROUP_COUNT) return;
+    if (pContext == NULL || group >= MO_SOUND_GROUP_COUNT) return;
     pContext->soundGroups[group].flags &= ~MO_SOUND_GROUP_FLAG_PAUSED;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_group_resume;
+    command.group = group;
+    mo_audio__post_command(pContext, &command);
 }
 
 mo_bool32 mo_sound_group_is_paused(mo_context* pContext, mo_uint32 group)
 {
-    if (pContext == NULL || group < MO_SOUND_GROUP_COUNT) return MO_FALSE;
+    if (pContext == NULL || group >= MO_SOUND_GROUP_COUNT) return MO_FALSE;
     return (pContext->soundGroups[group].flags & MO_SOUND_GROUP_FLAG_PAUSED) != 0;
 }
 
 void mo_sound_group_set_volume(mo_context* pContext, mo_uint32 group, float linearVolume)
 {
-    if (pContext == NULL || group < MO_SOUND_GROUP_COUNT) return;
+    if (pContext == NULL || group >= MO_SOUND_GROUP_COUNT) return;
     if (linearVolume < 0) linearVolume = 0;
     pContext->soundGroups[group].linearVolume = linearVolume;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_group_set_volume;
+    command.group = group;
+    command.linearVolume = linearVolume;
+    mo_audio__post_command(pContext, &command);
+}
+
+
+static mo_bool32 mo_sound__is_better_steal_victim(mo_context* pContext, mo_sound* pSound, mo_sound* pVictim)
+{
+    // Sounds that have already finished are always taken first since nobody will hear them go.
+    mo_bool32 isPlaying = mo_sound_is_playing(pSound);
+    mo_bool32 isVictimPlaying = mo_sound_is_playing(pVictim);
+    if (isPlaying != isVictimPlaying) {
+        return !isPlaying;
+    }
+
+    // Serials wrap around so they're compared by their difference.
+    mo_bool32 isOlder = (mo_int32)(pSound->serial - pVictim->serial) < 0;
+
+    switch (pContext->profile.soundStealPolicy)
+    {
+        case mo_sound_steal_policy_quietest:
+        {
+            float volume = pSound->linearVolume * pContext->soundGroups[pSound->group].linearVolume;
+            float victimVolume = pVictim->linearVolume * pContext->soundGroups[pVictim->group].linearVolume;
+            return volume < victimVolume || (volume == victimVolume && isOlder);
+        }
+
+        case mo_sound_steal_policy_lowest_priority:
+        {
+            return pSound->priority < pVictim->priority || (pSound->priority == pVictim->priority && isOlder);
+        }
+
+        case mo_sound_steal_policy_oldest:
+        default:
+        {
+            return isOlder;
+        }
+    }
 }
 
+static mo_sound* mo_sound__acquire(mo_context* pContext, mo_uint32 priority)
+{
+    mo_assert(pContext != NULL);
+
+    // When every sound is in use one of the inlined ones is stopped to make room. Sounds created with mo_sound_create()
+    // are never stolen because the application is holding on to them.
+    if (pContext->soundCount == pContext->profile.maxSounds) {
+        mo_sound* pVictim = NULL;
+        if (pContext->inlinedSoundCount > 0) {
+            for (mo_uint32 iSound = 0; iSound < pContext->soundCount; ++iSound) {
+                mo_sound* pSound = pContext->ppSounds[iSound];
+                if ((pSound->flags & MO_SOUND_FLAG_INLINED) == 0) {
+                    continue;
+                }
+
+                if (pVictim == NULL || mo_sound__is_better_steal_victim(pContext, pSound, pVictim)) {
+                    pVictim = pSound;
+                }
+            }
+        }
+
+        if (pVictim == NULL) {
+            return NULL;
+        }
+
+        if (pContext->profile.soundStealPolicy == mo_sound_steal_policy_lowest_priority && mo_sound_is_playing(pVictim) && pVictim->priority > priority) {
+            return NULL;
+        }
+
+        mo_sound_delete(pVictim);
+    }
+
+    // The pool has room for every live sound plus as many that are waiting to be retired, so the free list can only be
+    // empty while the audio thread is catching up on deletions. It won't take long.
+    while (pContext->pFirstFreeSound == NULL) {
+        mo_audio__release_retired_sounds(pContext);
+        if (pContext->pFirstFreeSound == NULL) {
+            mo_audio__wait_for_mixer(pContext);
+        }
+    }
+
+    mo_sound* pSound = pContext->pFirstFreeSound;
+    pContext->pFirstFreeSound = pSound->pNextFreeSound;
+
+    mo_zero_object(pSound);
+    pSound->pContext = pContext;
+    pSound->serial = pContext->nextSoundSerial++;
+    pSound->priority = priority;
+    return pSound;
+}
 
 mo_result mo_sound_create(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group, mo_sound** ppSound)
+{
+    return mo_sound__create(pContext, pSource, group, 0, ppSound);
+}
+
+static mo_result mo_sound__create(mo_context* pContext, mo_sound_source* pSource, mo_uint32 group, mo_uint32 priority, mo_sound** ppSound)
 {
     if (ppSound == NULL) return MO_INVALID_ARGS;
     mo_zero_object(ppSound);
 
     if (pContext == NULL || pSource == NULL || group >= MO_SOUND_GROUP_COUNT) return MO_INVALID_ARGS;
 
-    mo_sound* pSound = (mo_sound*)mo_calloc(sizeof(*pSound));
+    // Anything that can fail is done before acquiring the sound because acquiring it may steal another one, and that
+    // can't be undone. Compressed sources are decoded on the streaming thread, including opening the decoder, so the
+    // only thing that can fail is allocating the buffer. The format is known from the source so it's allocated here.
+    mo_sound_source_type decoderType = mo_sound_source_type_raw;
+    mo_uint32 decoderChannels = 0;
+    mo_uint32 decoderSampleRate = 0;
+    mo_uint32 streamBufferSizeInFrames = 0;
+    mo_int16* pStreamBuffer = NULL;
+    if (pSource->type != mo_sound_source_type_raw) {
+        if (pSource->type == mo_sound_source_type_stream) {
+            decoderType = pSource->stream.decoderType;
+            decoderChannels = pSource->stream.channels;
+            decoderSampleRate = pSource->stream.sampleRate;
+        } else {
+            decoderType = pSource->type;
+            decoderChannels = pSource->vorbis.channels;
+            decoderSampleRate = pSource->vorbis.sampleRate;
+        }
+
+        streamBufferSizeInFrames = mo_stream__calculate_buffer_size(pContext, decoderSampleRate);
+        pStreamBuffer = (mo_int16*)mo_malloc(streamBufferSizeInFrames * decoderChannels * sizeof(mo_int16));
+        if (pStreamBuffer == NULL) {
+            return MO_OUT_OF_MEMORY;
+        }
+    }
+
+    mo_sound* pSound = mo_sound__acquire(pContext, priority);
     if (pSound == NULL) {
-        return MO_OUT_OF_MEMORY;
+        mo_free(pStreamBuffer);
+        return MO_TOO_MANY_SOUNDS;
     }
 
-    pSound->pContext = pContext;
     pSound->pSource = pSource;
     pSound->group = group;
     pSound->linearVolume = 1;
+    pSound->mixerLinearVolume = 1;
     pSound->pan = 0;
+    pSound->mixerPanGainL = 1;
+    pSound->mixerPanGainR = 1;
+    pSound->pitch = 1;
+    pSound->mixerPitch = 1;
 
     // Depending on the sound source we may need some per-sound decoding information.
     if (pSource->type == mo_sound_source_type_raw)
     {
         pSound->raw.currentSample = 0;
     }
-#ifdef MO_HAS_STB_VORBIS
-    else if (pSource->type == mo_sound_source_type_vorbis)
-    {
-        pSound->vorbis.currentSample = 0;
-        pSound->vorbis.pDecoder = stb_vorbis_open_memory((const unsigned char*)pSource->vorbis.pData, (int)pSource->vorbis.dataSize, NULL, NULL);
-        if (pSound->vorbis.pDecoder == NULL) {
-            mo_free(pSound);
-            return MO_INVALID_RESOURCE;
-        }
-    }
-#endif
-#ifdef MO_HAS_DR_FLAC
-    else if (pSource->type == mo_sound_source_type_flac)
+    else
     {
-        pSound->flac.currentSample = 0;
-        pSound->flac.pDecoder = drflac_open_memory(pSource->flac.pData, pSource->flac.dataSize);
-        if (pSound->flac.pDecoder == NULL) {
-            mo_free(pSound);
-            return MO_INVALID_RESOURCE;
-        }
+        pSound->decoder.type = decoderType;
+        pSound->decoder.channels = decoderChannels;
+        pSound->decoder.sampleRate = decoderSampleRate;
+        pSound->streamBufferSizeInFrames = streamBufferSizeInFrames;
+        pSound->pStreamBuffer = pStreamBuffer;
     }
-#endif
 
-    // Add the sound to the array.
-    if (pContext->soundBufferSize == pContext->soundCount) {
-        mo_uint32 newSoundBufferSize = (pContext->soundBufferSize == 0) ? 8 : pContext->soundBufferSize*2;
-        mo_sound** ppNewSounds = (mo_sound**)mo_realloc(pContext->ppSounds, newSoundBufferSize * sizeof(*ppNewSounds));
-        if (ppNewSounds == NULL) {
-            mo_free(pSound);
-            return MO_OUT_OF_MEMORY;
+    // Add the sound to the list of live sounds.
+    mo_assert(pContext->soundCount < pContext->profile.maxSounds);
+    pSound->soundIndex = pContext->soundCount;
+    pContext->ppSounds[pContext->soundCount] = pSound;
+    pContext->soundCount += 1;
+
+    // From here on the streaming thread owns the decoder. It's woken up so the first fill happens straight away.
+    if (pSource->type != mo_sound_source_type_raw) {
+        mal_mutex_lock(&pContext->streamLock);
+        {
+            pSound->streamIndex = pContext->streamingSoundCount;
+            pContext->ppStreamingSounds[pContext->streamingSoundCount] = pSound;
+            pContext->streamingSoundCount += 1;
         }
+        mal_mutex_unlock(&pContext->streamLock);
 
-        pContext->ppSounds = ppNewSounds;
-        pContext->soundBufferSize = newSoundBufferSize;
+        mal_event_signal(&pContext->streamWakeupEvent);
     }
 
-    mo_assert(pContext->soundBufferSize > pContext->soundCount);
-    pContext->ppSounds[pContext->soundCount] = pSound;
-    pContext->soundCount += 1;
-
 
     *ppSound = pSound;
     return MO_SUCCESS;
@@ -4035,18 +7959,40 @@ void mo_sound_delete(mo_sound* pSound)
     mo_context* pContext = pSound->pContext;
     mo_assert(pContext != NULL);
 
-    for (mo_uint32 iSound = 0; iSound < pContext->soundCount; ++iSound) {
-        if (pContext->ppSounds[iSound] == pSound) {
-            for (; iSound < pContext->soundCount-1; ++iSound) {
-                pContext->ppSounds[iSound] = pContext->ppSounds[iSound+1];
-            }
+    // Swap the last sound into this one's place.
+    mo_assert(pContext->ppSounds[pSound->soundIndex] == pSound);
+    mo_sound* pLastSound = pContext->ppSounds[pContext->soundCount-1];
+    pContext->ppSounds[pSound->soundIndex] = pLastSound;
+    pLastSound->soundIndex = pSound->soundIndex;
+    pContext->soundCount -= 1;
 
-            pContext->soundCount -= 1;
-            break;
+    // The streaming thread needs to stop filling the sound's buffer before the audio thread retires it.
+    if (pSound->pSource->type != mo_sound_source_type_raw) {
+        mal_mutex_lock(&pContext->streamLock);
+        {
+            mo_sound* pLastStreamingSound = pContext->ppStreamingSounds[pContext->streamingSoundCount-1];
+            pContext->ppStreamingSounds[pSound->streamIndex] = pLastStreamingSound;
+            pLastStreamingSound->streamIndex = pSound->streamIndex;
+            pContext->streamingSoundCount -= 1;
         }
+        mal_mutex_unlock(&pContext->streamLock);
+    }
+
+    if ((pSound->flags & MO_SOUND_FLAG_INLINED) != 0) {
+        pContext->inlinedSoundCount -= 1;
     }
 
-    mo_free(pSound);
+    // The sound can't be returned to the pool until the audio thread has released it. That happens when garbage is
+    // next collected, or sooner if the pool runs dry.
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_delete;
+    command.pSound = pSound;
+    mo_audio__post_command(pContext, &command);
+
+    mo_assert(pContext->retiringSoundCount < pContext->soundPoolSize);
+    pContext->ppRetiringSounds[pContext->retiringSoundCount] = pSound;
+    pContext->retiringSoundCount += 1;
 }
 
 void mo_sound_mark_for_deletion(mo_sound* pSound)
@@ -4067,6 +8013,42 @@ void mo_sound_set_volume(mo_sound* pSound, float linearVolume)
     if (pSound == NULL) return;
     if (linearVolume < 0) linearVolume = 0;
     pSound->linearVolume = linearVolume;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_set_volume;
+    command.pSound = pSound;
+    command.linearVolume = linearVolume;
+    mo_audio__post_command(pSound->pContext, &command);
+}
+
+void mo_sound_set_pan(mo_sound* pSound, float pan)
+{
+    if (pSound == NULL) return;
+    pan = mo_clampf(pan, -1, 1);
+    pSound->pan = pan;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_set_pan;
+    command.pSound = pSound;
+    command.pan = pan;
+    mo_audio__post_command(pSound->pContext, &command);
+}
+
+void mo_sound_set_pitch(mo_sound* pSound, float pitch)
+{
+    if (pSound == NULL) return;
+    if (!(pitch >= 0.001f)) pitch = 0.001f;   // <-- Written this way so NaN is caught as well.
+    pitch = mo_clampf(pitch, 0.001f, MO_MAX_PITCH);
+    pSound->pitch = pitch;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_set_pitch;
+    command.pSound = pSound;
+    command.pitch = pitch;
+    mo_audio__post_command(pSound->pContext, &command);
 }
 
 void mo_sound_play(mo_sound* pSound, mo_bool32 loop)
@@ -4080,18 +8062,38 @@ void mo_sound_play(mo_sound* pSound, mo_bool32 loop)
     }
 
     pSound->flags |= MO_SOUND_FLAG_PLAYING;
+    pSound->playID += 1;
+
+    // Streaming sounds are looped by the streaming thread as it decodes ahead of the mixer.
+    mo_atomic_store_u32(&pSound->isStreamLooping, (loop) ? 1 : 0);
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_play;
+    command.pSound = pSound;
+    command.playID = pSound->playID;
+    command.loop = loop;
+    mo_audio__post_command(pSound->pContext, &command);
 }
 
 void mo_sound_stop(mo_sound* pSound)
 {
     if (pSound == NULL) return;
     pSound->flags &= ~MO_SOUND_FLAG_PLAYING;
+
+    mo_audio_command command;
+    mo_zero_object(&command);
+    command.type = mo_audio_command_type_stop;
+    command.pSound = pSound;
+    mo_audio__post_command(pSound->pContext, &command);
 }
 
 mo_bool32 mo_sound_is_playing(mo_sound* pSound)
 {
     if (pSound == NULL) return MO_FALSE;
-    return (pSound->flags & MO_SOUND_FLAG_PLAYING) != 0;
+
+    // The audio thread lets us know when the sound has reached the end via finishedPlayID.
+    return (pSound->flags & MO_SOUND_FLAG_PLAYING) != 0 && mo_atomic_load_u32(&pSound->finishedPlayID) != pSound->playID;
 }
 
 mo_bool32 mo_sound_is_looping(mo_sound* pSound)
@@ -4100,6 +8102,12 @@ mo_bool32 mo_sound_is_looping(mo_sound* pSound)
     return (pSound->flags & MO_SOUND_FLAG_LOOPING) != 0;
 }
 
+mo_uint32 mo_sound_get_underrun_count(mo_sound* pSound)
+{
+    if (pSound == NULL) return 0;
+    return mo_atomic_load_u32(&pSound->underrunCount);
+}
+
 
 //// Input ////
 
@@ -4139,6 +8147,15 @@ mo_button mo_get_key_binding(mo_context* pContext, mo_key key)
     return 0;
 }
 
+void mo_get_input_stats(mo_context* pContext, mo_input_stats* pStats)
+{
+    if (pStats == NULL) return;
+    mo_zero_object(pStats);
+
+    if (pContext == NULL) return;
+    *pStats = pContext->inputStats;
+}
+
 mo_bool32 mo_is_button_down(mo_context* pContext, unsigned int button)
 {
     if (pContext == NULL) return MO_FALSE;
@@ -4221,15 +8238,6 @@ mo_bool32 mo_was_button_released(mo_context* pContext, unsigned int button)
 #endif
 
 
-#ifdef MAL_WIN32
-    #define MAL_THREADCALL WINAPI
-    typedef unsigned long mal_thread_result;
-#else
-    #define MAL_THREADCALL
-    typedef void* mal_thread_result;
-#endif
-typedef mal_thread_result (MAL_THREADCALL * mal_thread_entry_proc)(void* pData);
-
 #define MAL_STATE_UNINITIALIZED     0
 #define MAL_STATE_STOPPED           1   // The device's default state after initialization.
 #define MAL_STATE_STARTED           2   // The worker thread is in it's main loop waiting for the driver to request or deliver audio data.
@@ -4995,6 +9003,11 @@ static mal_result mal_device__main_loop__null(mal_device* pDevice)
             continue;
         }
 
+        // The buffer is circular, so only process up to the end of the buffer. The rest will be picked up in the next iteration.
+        if (framesAvailable > pDevice->bufferSizeInFrames - pDevice->null_device.lastProcessedFrame) {
+            framesAvailable = pDevice->bufferSizeInFrames - pDevice->null_device.lastProcessedFrame;
+        }
+
         // If it's a playback device, don't bother grabbing more data if the device is being stopped.
         if (pDevice->null_device.breakFromMainLoop && pDevice->type == mal_device_type_playback) {
             return MAL_FALSE;
@@ -0,0 +1,188 @@
+// Tests for things that can't easily be seen by running a game. This runs headless so it doesn't need a window.
+//
+// To build and run:
+//
+// GCC/Clang (Linux)   gcc -std=gnu99 mintaro_test.c -lpthread -lm -ldl && ./a.out
+//
+// A non-zero exit code means something failed.
+#define MO_HEADLESS
+#define MAL_NO_ALSA
+#define MINTARO_IMPLEMENTATION
+#include "../mintaro.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+static int g_failureCount = 0;
+
+#define MO_TEST_CHECK(condition) \
+    if (!(condition)) { \
+        printf("FAILED: %s (%s:%d)\n", #condition, __FILE__, __LINE__); \
+        g_failureCount += 1; \
+    }
+
+static mo_context* init_test_context()
+{
+    mo_profile profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.resolutionX = 160;
+    profile.resolutionY = 144;
+    memcpy(profile.palette, g_moDefaultPalette, sizeof(g_moDefaultPalette));
+    profile.paletteSize = 256;
+    profile.transparentColorIndex = 255;
+
+    mo_context* pContext;
+    if (mo_init(&profile, 160, 144, "Test", NULL, NULL, &pContext) != MO_SUCCESS) {
+        return NULL;
+    }
+
+    return pContext;
+}
+
+static void test_pitch(mo_context* pContext)
+{
+    // Pitches that can't be played must never make it to the mixer. The step calculation converts to an integer which is
+    // undefined for NaN and anything out of range.
+    mo_int16 samples[4096];
+    for (int i = 0; i < 4096; ++i) {
+        samples[i] = (mo_int16)((i % 64) * 512 - 16384);
+    }
+
+    mo_sound_source* pSource;
+    MO_TEST_CHECK(mo_sound_source_create(pContext, 1, 22050, 4096, samples, &pSource) == MO_SUCCESS);
+
+    mo_sound* pSound;
+    MO_TEST_CHECK(mo_sound_create(pContext, pSource, MO_SOUND_GROUP_EFFECTS, &pSound) == MO_SUCCESS);
+
+    const float pitches[] = {NAN, -NAN, INFINITY, -INFINITY, -1, 0, 1e30f, 1e-30f, 1};
+    for (size_t i = 0; i < sizeof(pitches)/sizeof(pitches[0]); ++i) {
+        mo_sound_set_pitch(pSound, pitches[i]);
+        MO_TEST_CHECK(pSound->pitch >= 0.001f && pSound->pitch <= MO_MAX_PITCH);
+
+        mo_uint64 step = mo_resampler__calculate_step(22050, 48000, pitches[i]);
+        MO_TEST_CHECK(step >= 1 && step <= MO_RESAMPLER_MAX_STEP);
+
+        mo_sound_play(pSound, MO_TRUE);
+        mo_sleep(0.005);   // <-- Give the mixer a chance to play at this pitch.
+    }
+
+    mo_sound_delete(pSound);
+    mo_sound_source_delete(pSource);
+}
+
+static void test_image_thread_count(mo_context* pContext)
+{
+    // The profile is public so the thread count can be anything by the time an image is converted, not just what
+    // mo_init() allowed. The result must be the same as a single-threaded conversion.
+    const unsigned int width  = 320;
+    const unsigned int height = 256;
+    static mo_uint8 rgba[320*256*4];
+    for (size_t i = 0; i < sizeof(rgba); ++i) {
+        rgba[i] = (mo_uint8)((i * 7) ^ (i >> 9));
+    }
+
+    pContext->profile.imageThreadCount = 1;
+    mo_image* pExpected;
+    MO_TEST_CHECK(mo_image_create(pContext, width, height, mo_image_format_rgba8, rgba, &pExpected) == MO_SUCCESS);
+
+    const mo_uint32 threadCounts[] = {0, MO_MAX_IMAGE_THREADS + 1, 1000};
+    for (size_t i = 0; i < sizeof(threadCounts)/sizeof(threadCounts[0]); ++i) {
+        pContext->profile.imageThreadCount = threadCounts[i];
+
+        mo_image* pImage;
+        MO_TEST_CHECK(mo_image_create(pContext, width, height, mo_image_format_rgba8, rgba, &pImage) == MO_SUCCESS);
+        MO_TEST_CHECK(memcmp(pImage->pData, pExpected->pData, width*height) == 0);
+        mo_image_delete(pContext, pImage);
+    }
+
+    pContext->profile.imageThreadCount = 1;
+    mo_image_delete(pContext, pExpected);
+}
+
+static void test_image_update(mo_context* pContext)
+{
+    // Images are drawn with runs of opaque pixels that are built when the image is created. Editing the image's data
+    // must be followed by mo_image_update() for the runs to match.
+    const mo_color_index transparent = (mo_color_index)pContext->profile.transparentColorIndex;
+    const mo_color_index background  = 1;
+
+    mo_uint8 data[32*8];
+    for (int i = 0; i < 32*8; ++i) {
+        data[i] = ((i % 32) < 16) ? 2 : transparent;
+    }
+
+    mo_image* pImage;
+    MO_TEST_CHECK(mo_image_create(pContext, 32, 8, mo_image_format_native, data, &pImage) == MO_SUCCESS);
+    MO_TEST_CHECK(pImage->pRowSpans != NULL);
+
+    // Swap the opaque and transparent halves.
+    for (int i = 0; i < 32*8; ++i) {
+        pImage->pData[i] = ((i % 32) < 16) ? transparent : 3;
+    }
+    mo_image_update(pContext, pImage);
+
+    mo_clear(pContext, background);
+    mo_draw_image(pContext, 0, 0, pImage, 0, 0, 32, 8);
+
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 32; ++x) {
+            mo_color_index expected = (x < 16) ? background : 3;
+            MO_TEST_CHECK(pContext->screen[y*pContext->profile.resolutionX + x] == expected);
+        }
+    }
+
+    mo_image_delete(pContext, pImage);
+}
+
+static void test_palette_changes(mo_context* pContext)
+{
+    // mo_find_closest_color() must use the new palette after both mo_set_palette() and a direct edit followed by
+    // mo_invalidate_palette().
+    mo_color_rgba palette[256];
+    memset(palette, 0, sizeof(palette));
+    palette[7].r = 255; palette[7].a = 255;
+
+    mo_color_rgba red;
+    memset(&red, 0, sizeof(red));
+    red.r = 255; red.a = 255;
+
+    MO_TEST_CHECK(mo_set_palette(pContext, 256, palette) == MO_SUCCESS);
+    MO_TEST_CHECK(mo_find_closest_color(pContext, red) == 7);
+
+    palette[7].r = 0; palette[7].b = 255;
+    palette[9].r = 255; palette[9].a = 255;
+    MO_TEST_CHECK(mo_set_palette(pContext, 256, palette) == MO_SUCCESS);
+    MO_TEST_CHECK(mo_find_closest_color(pContext, red) == 9);
+
+    pContext->profile.palette[9].r = 0;
+    pContext->profile.palette[11] = red;
+    mo_invalidate_palette(pContext);
+    MO_TEST_CHECK(mo_find_closest_color(pContext, red) == 11);
+
+    MO_TEST_CHECK(mo_set_palette(pContext, 256, (const mo_color_rgba*)g_moDefaultPalette) == MO_SUCCESS);
+}
+
+int main()
+{
+    mo_context* pContext = init_test_context();
+    if (pContext == NULL) {
+        printf("Failed to initialize.\n");
+        return 1;
+    }
+
+    test_pitch(pContext);
+    test_image_thread_count(pContext);
+    test_image_update(pContext);
+    test_palette_changes(pContext);
+
+    mo_uninit(pContext);
+
+    if (g_failureCount > 0) {
+        printf("%d check(s) failed.\n", g_failureCount);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+    return 0;
+}